@@ -0,0 +1,475 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <iterator>
+
+#include "bench_utils.hpp"
+#include "latency_histogram.hpp"
+#include "hash_file_storage.hpp"
+
+
+// looks at an existing table (it's never opened for writing) and tells how its records
+// are spread over pages, what takes place for nothing and what other page lengths
+// and load factors would give for the same keys
+struct Options {
+    std::string dir;
+    std::vector<uint64_t> page_lengths = { 4, 6, 10, 16, 64, 100 };
+    // max_load_factor is records per bucket, so they are given as parts of a page
+    std::vector<double> fills = { 0.5, 0.75, 1.0, 1.5, 2.0 };
+    double max_miss_pages = 1.1;
+    bool sizes = true;
+};
+
+void print_usage(std::ostream &out) {
+    out << "usage: analyze --dir D [options]\n"
+        << "  --dir D              directory of the table (hash_idx, keys_idx and data)\n"
+        << "  --page-lengths L,..  page lengths to simulate (4,6,10,16,64,100)\n"
+        << "  --fills F,..         load factor thresholds to simulate, in page lengths\n"
+        << "                       (0.5,0.75,1,1.5,2), 0.75 is the default of the index\n"
+        << "  --max-miss-pages P   pages a failed lookup may read on average, the advice\n"
+        << "                       is the smallest index within it (1.1)\n"
+        << "  --no-sizes           don't read data (it's read randomly), keys_idx is read\n"
+        << "                       anyway: hashes of keys aren't in hash_idx\n";
+}
+
+template <typename T>
+std::vector<T> parse_list(const std::string &str, std::function<T (const std::string &)> parse) {
+    std::vector<T> items;
+    std::istringstream in(str);
+    std::string item;
+    while (std::getline(in, item, ',')) { items.push_back(parse(item)); }
+    if (items.empty()) { throw bench::BadOption("empty list [" + str + "]"); }
+    return items;
+}
+
+Options parse_options(int argc, char **argv) {
+    Options opts;
+    bench::setters_t setters = {
+        { "--dir", [&](const std::string &v) { opts.dir = v; } },
+        { "--page-lengths", [&](const std::string &v) {
+            opts.page_lengths = parse_list<uint64_t>(v, [](const std::string &s) { return std::stoull(s); }); } },
+        { "--fills", [&](const std::string &v) {
+            opts.fills = parse_list<double>(v, [](const std::string &s) { return std::stod(s); }); } },
+        { "--max-miss-pages", [&](const std::string &v) { opts.max_miss_pages = std::stod(v); } },
+    };
+    bench::flags_t flags = {
+        { "--no-sizes", [&] { opts.sizes = false; } },
+    };
+
+    bench::parse_options(argc, argv, setters, flags, print_usage);
+
+    if (opts.dir.empty()) { throw bench::BadOption("--dir is required"); }
+    for (auto length : opts.page_lengths) {
+        if (length == 0) { throw bench::BadOption("page length must be positive"); }
+    }
+    for (auto fill : opts.fills) {
+        if (fill <= 0) { throw bench::BadOption("fills must be positive"); }
+    }
+    return opts;
+}
+
+using index_header_t = HashedFile<std::string, std::string, 1>::index_t::Header;
+
+// what a chain looks like on disk
+struct Shape {
+    uint64_t pages = 0;
+    uint64_t overflow_pages = 0;
+    uint64_t unreachable_pages = 0;   // reserved spare pages and lost ones
+    uint64_t lost_records = 0;        // alive segments in unreachable pages
+    uint64_t broken_links = 0;
+    uint64_t alive = 0;
+    uint64_t dead = 0;
+    uint64_t empty_slots = 0;         // in reachable pages
+    std::vector<uint64_t> chain_lengths; // [n] buckets with chains of n + 1 pages
+    uint64_t hit_pages = 0;           // sum over alive records of pages read to find them
+    uint64_t links = 0;
+    uint64_t contiguous_links = 0;    // next page is right after the current one
+    uint64_t backward_links = 0;
+    uint64_t link_distance = 0;       // sum of |jump| in pages
+    uint64_t runs = 0;                // contiguous pieces of all chains
+    uint64_t torn_tail = 0;           // bytes after the last whole page
+};
+
+// sizes as they are on disk, with length prefixes
+struct Sizes {
+    fcl::LatencyHistogram keys;
+    fcl::LatencyHistogram values;
+    uint64_t key_bytes = 0;
+    uint64_t value_bytes = 0;
+    int64_t keys_file = -1;  // -1 if there is no file
+    int64_t data_file = -1;
+};
+
+// one simulated configuration
+struct Simulation {
+    uint64_t page_length = 0;
+    double fill = 0;
+    double max_load_factor = 0;
+    uint64_t buckets = 0;
+    uint64_t pages = 0;
+    uint64_t page_bytes = 0;
+    double hit_pages = 0;
+    double miss_pages = 0;
+    uint64_t max_chain = 0;
+
+    uint64_t index_bytes() const {
+        return sizeof(index_header_t) + pages * page_bytes;
+    }
+};
+
+double mib(double bytes) {
+    return bytes / double(1 << 20);
+}
+
+double percent(uint64_t part, uint64_t whole) {
+    return whole == 0 ? 0.0 : 100.0 * double(part) / double(whole);
+}
+
+// sizes of all the things from `refs` which are read from `path` one by one,
+// `seen` gets every one of them (in the order of the file, not of `refs`)
+template <typename T>
+int64_t measure(
+        const bench::fs::path &path,
+        int64_t skip, // header of the file
+        fcl::LengthPrefix prefix,
+        std::vector<int64_t> refs,
+        fcl::LatencyHistogram &sizes,
+        uint64_t &total,
+        std::function<void (const T &)> seen = nullptr) {
+    if (!bench::fs::exists(path)) { return -1; }
+    details::file_t file(path.string(), std::ios::in | std::ios::binary);
+    if (!file) { throw details::CannotOpenFile(path.string()); }
+    fcl::BinIStreamWrap<details::file_t> stream(file);
+    stream.set_length_prefix(prefix);
+    std::sort(refs.begin(), refs.end()); // it's almost sequential then
+    T item;
+    for (auto ref : refs) {
+        if (ref < skip || ref >= file.size()) { continue; } // it isn't ours
+        stream.set_ipos(ref);
+        stream >> item;
+        auto size = uint64_t(stream.get_ipos() - ref);
+        sizes.record(size);
+        total += size;
+        if (seen) { seen(item); }
+    }
+    return file.size();
+}
+
+// on-disk size of a page of another length: segments and meta fields, padded like a struct
+uint64_t page_bytes(uint64_t page_length, uint64_t segment_bytes) {
+    constexpr uint64_t meta = 3 * sizeof(uint64_t) + sizeof(uint32_t);
+    constexpr uint64_t align = alignof(uint64_t);
+    return (page_length * segment_bytes + meta + align - 1) / align * align;
+}
+
+// the index doubles its buckets when load factor reaches the threshold before an insertion,
+// so this is where it ends up after `n` insertions into a fresh table
+uint64_t simulated_bucket_count(uint64_t n, double max_load_factor) {
+    uint64_t buckets = 2;
+    while (n > 1 && double(n - 1) / double(buckets) >= max_load_factor) { buckets *= 2; }
+    return buckets;
+}
+
+Simulation simulate(const std::vector<uint64_t> &hashes, uint64_t page_length, double fill, uint64_t segment_bytes) {
+    Simulation sim;
+    sim.page_length = page_length;
+    sim.fill = fill;
+    sim.max_load_factor = std::max(1.0, fill * double(page_length)); // the index asserts >= 1
+    sim.buckets = simulated_bucket_count(hashes.size(), sim.max_load_factor);
+    sim.page_bytes = page_bytes(page_length, segment_bytes);
+
+    std::vector<uint64_t> counts(sim.buckets, 0);
+    for (auto hash : hashes) { counts[hash & (sim.buckets - 1)]++; }
+    uint64_t hit_pages = 0;
+    for (auto count : counts) {
+        auto full = count / page_length, rest = count % page_length;
+        auto chain = std::max<uint64_t>(1, (count + page_length - 1) / page_length);
+        sim.pages += chain;
+        sim.max_chain = std::max(sim.max_chain, chain);
+        // i-th record of a bucket is found on page i / page_length + 1
+        hit_pages += page_length * full * (full + 1) / 2 + rest * (full + 1);
+    }
+    sim.hit_pages = hashes.empty() ? 0.0 : double(hit_pages) / double(hashes.size());
+    sim.miss_pages = double(sim.pages) / double(sim.buckets); // a miss reads the whole chain
+    return sim;
+}
+
+template <uint64_t PageLength>
+void analyze(const Options &opts, const index_header_t &header) {
+    using table_t = HashedFile<std::string, std::string, PageLength>;
+    using index_t = typename table_t::index_t;
+    using storage_t = typename table_t::storage_t;
+    using page_t = typename index_t::Page;
+    using segment_t = typename index_t::Segment;
+    using pos_t = int64_t;
+
+    auto dir = bench::fs::path(opts.dir);
+    auto table_path = (dir/"hash_idx").string();
+    if (header.key_signature != fcl::type_signature<std::string>()
+            || header.data_signature != storage_t::data_signature) {
+        throw std::runtime_error("only tables of strings are known here");
+    }
+
+    details::file_t table_file(table_path, std::ios::in | std::ios::binary);
+    if (!table_file) { throw details::CannotOpenFile(table_path); }
+    fcl::BinIStreamWrap<details::file_t> table(table_file);
+
+    // one pass through the file, then chains are walked in memory
+    struct PageInfo {
+        uint64_t seg_count = 0;
+        uint64_t alive = 0;
+        pos_t next_page_pos = 0;
+    };
+    Shape shape;
+    auto body = uint64_t(table_file.size()) - sizeof(index_header_t);
+    shape.pages = body / sizeof(page_t);
+    shape.torn_tail = body % sizeof(page_t);
+    if (shape.pages < header.bucket_count) { throw std::runtime_error("hash_idx is shorter than its buckets"); }
+
+    std::vector<PageInfo> pages(shape.pages);
+    std::vector<uint64_t> hashes;
+    std::vector<int64_t> key_refs, value_refs;
+    hashes.reserve(header.size);
+    uint64_t corrupted = 0;
+    table.set_ipos(sizeof(index_header_t));
+    page_t page;
+    for (uint64_t i = 0; i < shape.pages; ++i) {
+        table >> page;
+        if (!page.is_sound()) {
+            corrupted++;
+            continue;
+        }
+        auto &info = pages[i];
+        info.seg_count = page.seg_count;
+        info.next_page_pos = page.next_page_pos;
+        for (size_t j = 0; j < page.seg_count; ++j) {
+            const auto &seg = page.segs[j];
+            if (seg.state() == details::seg_state::dead) { shape.dead++; }
+            if (seg.state() != details::seg_state::alive) { continue; }
+            info.alive++;
+            key_refs.push_back(seg.key_ref());
+            value_refs.push_back(seg.value);
+        }
+    }
+
+    auto first_overflow = pos_t(sizeof(index_header_t) + sizeof(page_t) * header.bucket_count);
+    std::vector<bool> reached(shape.pages, false);
+    for (uint64_t bucket = 0; bucket < header.bucket_count; ++bucket) {
+        auto current = bucket;
+        uint64_t length = 0;
+        shape.runs++;
+        while (true) {
+            reached[current] = true;
+            const auto &info = pages[current];
+            length++;
+            shape.alive += info.alive;
+            shape.hit_pages += info.alive * length;
+            shape.empty_slots += PageLength - info.seg_count;
+            auto pos = info.next_page_pos;
+            if (pos == 0) { break; }
+            bool sane = pos >= first_overflow && (pos - first_overflow) % pos_t(sizeof(page_t)) == 0
+                && header.bucket_count + uint64_t(pos - first_overflow) / sizeof(page_t) < shape.pages;
+            auto next = sane ? header.bucket_count + uint64_t(pos - first_overflow) / sizeof(page_t) : 0;
+            if (!sane || reached[next]) {
+                shape.broken_links++;
+                break;
+            }
+            shape.links++;
+            if (next == current + 1) { shape.contiguous_links++; }
+            else { shape.runs++; }
+            if (next < current) { shape.backward_links++; }
+            shape.link_distance += next > current ? next - current : current - next;
+            current = next;
+        }
+        if (shape.chain_lengths.size() < length) { shape.chain_lengths.resize(length); }
+        shape.chain_lengths[length - 1]++;
+    }
+    shape.overflow_pages = shape.pages - header.bucket_count;
+    for (uint64_t i = 0; i < shape.pages; ++i) {
+        if (reached[i]) { continue; }
+        shape.unreachable_pages++;
+        shape.lost_records += pages[i].alive;
+    }
+
+    // segments keep only fingerprints of hashes, the simulation needs whole ones
+    Sizes sizes;
+    fcl::WyHash<std::string> hasher; // the one of table_t
+    sizes.keys_file = measure<std::string>(
+        dir/"keys_idx", 0, details::flags_length_prefix(header.flags),
+        key_refs, sizes.keys, sizes.key_bytes,
+        [&](const std::string &key) { hashes.push_back(hasher(key)); }
+    );
+    if (opts.sizes) {
+        if (bench::fs::exists(dir/"data")) {
+            details::file_t data_file((dir/"data").string(), std::ios::in | std::ios::binary);
+            fcl::BinIStreamWrap<details::file_t> data(data_file);
+            auto data_header = fcl::read_val<typename storage_t::Header>(data);
+            sizes.data_file = measure<std::string>(
+                dir/"data", sizeof(data_header), details::flags_length_prefix(data_header.flags),
+                value_refs, sizes.values, sizes.value_bytes
+            );
+        }
+    }
+
+    auto &out = std::cout;
+    auto segment_bytes = uint64_t(sizeof(segment_t));
+    out << std::fixed << std::setprecision(2);
+    out << "table: " << header.size << " records (" << shape.alive << " reachable), "
+        << header.bucket_count << " buckets, page length " << PageLength
+        << ", " << sizeof(page_t) << " bytes per page, " << segment_bytes << " per segment\n";
+    if (header.flags & details::format_flags::unclean) {
+        out << "warning: the table wasn't closed properly, numbers below may be off\n";
+    }
+    if (corrupted != 0) { out << "warning: " << corrupted << " pages have bad checksums, they are taken as empty\n"; }
+    if (shape.torn_tail != 0) { out << "warning: " << shape.torn_tail << " bytes after the last whole page\n"; }
+    if (shape.broken_links != 0) { out << "warning: " << shape.broken_links << " chains end with a bad link\n"; }
+
+    out << "\npages: " << shape.pages << " (" << shape.overflow_pages << " overflow, "
+        << shape.unreachable_pages << " unreachable"
+        << (shape.lost_records != 0 ? ", " + std::to_string(shape.lost_records) + " records in them" : "")
+        << ")\n";
+    auto slots = (shape.pages - shape.unreachable_pages) * PageLength;
+    out << "segments: " << shape.alive << " alive, " << shape.dead << " dead, "
+        << shape.empty_slots << " empty; " << percent(shape.alive, slots) << "% of slots are used, "
+        << percent(shape.dead, shape.alive + shape.dead) << "% of records are dead\n";
+    out << "load factor: " << double(shape.alive) / double(header.bucket_count)
+        << " records per bucket (" << double(shape.alive) / double(header.bucket_count * PageLength)
+        << " of a page)\n";
+
+    out << "\nchain length (pages): buckets\n";
+    uint64_t chain_pages = 0;
+    for (size_t length = 0; length < shape.chain_lengths.size(); ++length) {
+        chain_pages += (length + 1) * shape.chain_lengths[length];
+        if (shape.chain_lengths[length] == 0) { continue; }
+        out << std::setw(8) << length + 1 << ": " << shape.chain_lengths[length]
+            << " (" << percent(shape.chain_lengths[length], header.bucket_count) << "%)\n";
+    }
+    out << "pages per lookup: " << (shape.alive == 0 ? 0.0 : double(shape.hit_pages) / double(shape.alive))
+        << " if found, " << double(chain_pages) / double(header.bucket_count) << " if not\n";
+
+    out << "overflow links: " << shape.links << ", " << percent(shape.contiguous_links, shape.links)
+        << "% to the next page, " << percent(shape.backward_links, shape.links) << "% backwards, "
+        << (shape.links == 0 ? 0.0 : double(shape.link_distance) / double(shape.links))
+        << " pages away on average; " << double(shape.runs) / double(header.bucket_count)
+        << " contiguous runs per chain\n";
+
+    {
+        auto print_sizes = [&](const char *name, const fcl::LatencyHistogram &h) {
+            out << name << " bytes: mean " << h.mean() << ", p50 " << h.percentile(0.5)
+                << ", p90 " << h.percentile(0.9) << ", p99 " << h.percentile(0.99)
+                << ", max " << h.max() << " (percentiles are within 1/"
+                << fcl::LatencyHistogram::sub_buckets << ")\n";
+        };
+        out << "\n";
+        if (sizes.keys_file >= 0) { print_sizes("key", sizes.keys); }
+        if (sizes.data_file >= 0) { print_sizes("value", sizes.values); }
+    }
+
+    // what takes place, but isn't a reachable alive record or its key and value
+    out << "\nwasted bytes:\n";
+    auto wasted = [&](const std::string &what, uint64_t bytes, uint64_t of) {
+        out << "  " << std::left << std::setw(34) << what << std::right << std::setw(12) << bytes
+            << std::setw(8) << percent(bytes, of) << "%\n";
+    };
+    auto table_bytes = uint64_t(table_file.size());
+    wasted("hash_idx, empty slots", shape.empty_slots * segment_bytes, table_bytes);
+    wasted("hash_idx, dead segments", shape.dead * segment_bytes, table_bytes);
+    wasted("hash_idx, unreachable pages", shape.unreachable_pages * sizeof(page_t), table_bytes);
+    if (sizes.keys_file >= 0) {
+        // keys of dead records stay there: a resurrected record takes its old one back
+        wasted("keys_idx, keys of no alive record", uint64_t(sizes.keys_file) - sizes.key_bytes, uint64_t(sizes.keys_file));
+    }
+    if (sizes.data_file >= 0) {
+        auto header_bytes = uint64_t(sizeof(typename storage_t::Header));
+        wasted("data, overwritten and dead values", uint64_t(sizes.data_file) - header_bytes - sizes.value_bytes,
+               uint64_t(sizes.data_file));
+    }
+
+    // same hashes in other tables: they would be built by inserting the records into a fresh one
+    std::vector<Simulation> sims;
+    auto candidates = opts.page_lengths;
+    if (std::find(candidates.begin(), candidates.end(), PageLength) == candidates.end()) {
+        candidates.push_back(PageLength);
+    }
+    for (auto length : candidates) {
+        for (auto fill : opts.fills) { sims.push_back(simulate(hashes, length, fill, segment_bytes)); }
+    }
+
+    out << "\nsimulated on " << hashes.size() << " records (* is this page length with the default threshold):\n"
+        << std::setw(8) << "page len" << std::setw(8) << "fill" << std::setw(10) << "max lf"
+        << std::setw(12) << "buckets" << std::setw(12) << "index MiB" << std::setw(10) << "hit pg"
+        << std::setw(10) << "miss pg" << std::setw(10) << "max pg" << std::setw(12) << "KiB/miss" << "\n";
+    const Simulation *advice = nullptr;
+    for (const auto &sim : sims) {
+        bool current = sim.page_length == PageLength && sim.fill == 0.75;
+        out << std::setw(8) << sim.page_length << std::setw(8) << sim.fill << std::setw(10) << sim.max_load_factor
+            << std::setw(12) << sim.buckets << std::setw(12) << mib(double(sim.index_bytes()))
+            << std::setw(10) << sim.hit_pages << std::setw(10) << sim.miss_pages
+            << std::setw(10) << sim.max_chain
+            << std::setw(12) << sim.miss_pages * double(sim.page_bytes) / 1024.0
+            << (current ? " *" : "") << "\n";
+        if (sim.miss_pages <= opts.max_miss_pages
+                && (!advice || sim.index_bytes() < advice->index_bytes())) {
+            advice = &sim;
+        }
+    }
+
+    if (advice) {
+        out << "\nadvice: PageLength " << advice->page_length << " with set_load_factor_threshold("
+            << advice->max_load_factor << ") is the smallest index (" << mib(double(advice->index_bytes()))
+            << " MiB) where a miss reads <= " << opts.max_miss_pages << " pages ("
+            << advice->miss_pages * double(advice->page_bytes) / 1024.0 << " KiB)\n";
+    }
+    else {
+        out << "\nadvice: nothing simulated keeps misses within " << opts.max_miss_pages
+            << " pages, try lower --fills\n";
+    }
+    // rehash moves dead segments as they are, but only reachable pages survive it
+    if (shape.unreachable_pages != 0 && shape.lost_records == 0) {
+        out << "shrink_to_fit would drop " << shape.unreachable_pages << " unreachable pages\n";
+    }
+}
+
+void run(const Options &opts) {
+    auto table_path = (bench::fs::path(opts.dir)/"hash_idx").string();
+    details::file_t file(table_path, std::ios::in | std::ios::binary);
+    if (!file) { throw details::CannotOpenFile(table_path); }
+    fcl::BinIStreamWrap<details::file_t> stream(file);
+    auto header = fcl::read_val<index_header_t>(stream);
+    file.close();
+    if (header.format_version != details::index_format_version || header.bucket_count == 0) {
+        throw details::IncompatableFormat();
+    }
+
+    // page length is a template parameter, so only some of them can be read
+    switch (header.page_length) {
+    case 4: return analyze<4>(opts, header);
+    case 6: return analyze<6>(opts, header);
+    case 10: return analyze<10>(opts, header);
+    case 16: return analyze<16>(opts, header);
+    case 64: return analyze<64>(opts, header);
+    case 100: return analyze<100>(opts, header);
+    case 1000: return analyze<1000>(opts, header);
+    }
+    throw std::runtime_error("page length " + std::to_string(header.page_length) + " isn't known here");
+}
+
+int main(int argc, char **argv) {
+    try {
+        run(parse_options(argc, argv));
+    }
+    catch (const bench::BadOption &err) {
+        std::cerr << err.what() << std::endl;
+        print_usage(std::cerr);
+        return 1;
+    }
+    catch (const std::exception &err) {
+        std::cerr << "Exception: " << err.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
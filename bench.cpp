@@ -0,0 +1,379 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+#include <fstream>
+#include <sstream>
+#include <ctime>
+#include <thread>
+
+#include "bench_json.hpp"
+#include "bench_utils.hpp"
+#include "hash_file_storage.hpp"
+
+
+struct Options {
+    uint64_t n = 100000;
+    uint64_t ops = 0; // operations in get/update phases, `n` if zero
+    bench::SizeRange key_size{ 10, 10 };
+    bench::SizeRange value_size{ 10, 10 };
+    std::string access = "uniform";
+    double hit_ratio = 0.5;
+    bool cold = false;
+    unsigned reps = 3;
+    uint64_t page_length = 10;
+    std::string dir;
+    uint64_t seed = 42;
+    uint64_t batch = 0; // inserts per WriteBatch, they go one by one if zero
+    uint64_t resident = 0; // bytes of bucket pages kept in memory
+    std::string json; // file for machine-readable results, if any
+};
+
+// bench.pro puts `git describe` here
+#ifndef BENCH_REVISION
+#   define BENCH_REVISION "unknown"
+#endif
+
+// what one repetition of a phase has shown, bench_compare tests differences on them
+struct RepResult {
+    double seconds = 0;
+    double mean_ns = 0;
+    uint64_t p50_ns = 0;
+    uint64_t p99_ns = 0;
+};
+
+// counters of the table and its files summed over repetitions
+struct IoResult {
+    uint64_t pages_read = 0;
+    uint64_t pages_written = 0;
+    uint64_t key_compares = 0;
+    uint64_t false_positives = 0;
+    uint64_t values_read = 0;
+    uint64_t values_written = 0;
+    uint64_t sys_reads = 0;
+    uint64_t sys_writes = 0;
+    uint64_t sys_bytes_read = 0;
+    uint64_t sys_bytes_written = 0;
+
+    template <typename Table>
+    void add(const Table &table) {
+        auto &index = table.idxs().counters();
+        pages_read += index.pages_read;
+        pages_written += index.pages_written;
+        key_compares += index.key_compares;
+        false_positives += index.false_positives;
+        values_read += table.storage().counters().values_read;
+        values_written += table.storage().counters().values_written;
+        for (auto *io : { &table.idxs().table_io(), &table.idxs().keys_io(), &table.storage().io() }) {
+            sys_reads += io->sys_reads;
+            sys_writes += io->sys_writes;
+            sys_bytes_read += io->sys_bytes_read;
+            sys_bytes_written += io->sys_bytes_written;
+        }
+    }
+};
+
+// all the phases of all the repetitions
+struct PhaseResult {
+    std::string name;
+    bench::Latencies latencies;
+    std::vector<RepResult> reps;
+    uint64_t ops_per_rep = 0;
+    IoResult io;
+};
+
+// page length is a template parameter, so only some of them are here
+const uint64_t page_lengths[] = { 4, 10, 16, 64, 100, 1000 };
+
+void print_usage(std::ostream &out) {
+    out << "usage: bench [options]\n"
+        << "  --n N               records to load (100000)\n"
+        << "  --ops N             operations in get and update phases (= n)\n"
+        << "  --key-size A[:B]    key length, fixed or uniform in [A, B] (10)\n"
+        << "  --value-size A[:B]  value length (10)\n"
+        << "  --access P          uniform | zipf[:theta] | latest[:theta] |\n"
+        << "                      hotspot[:hot_fraction[:hot_ops]] (uniform)\n"
+        << "  --hit-ratio R       share of gets asking for existing keys (0.5)\n"
+        << "  --cache warm|cold   cold drops page cache of the table before each phase (warm)\n"
+        << "  --reps N            repetitions, each one on a fresh table (3)\n"
+        << "  --page-length L     one of 4, 10, 16, 64, 100, 1000 (10)\n"
+        << "  --dir D             where to create tables (system temp directory)\n"
+        << "  --seed S            seed of all generators (42)\n"
+        << "  --batch N           load by write batches of N inserts (0, one by one)\n"
+        << "  --resident B        keep bucket pages of the index in memory, up to B bytes (0)\n"
+        << "  --json FILE         also write results there, see bench_compare\n";
+}
+
+Options parse_options(int argc, char **argv) {
+    Options opts;
+    bench::setters_t setters = {
+        { "--n", [&](const std::string &v) { opts.n = std::stoull(v); } },
+        { "--ops", [&](const std::string &v) { opts.ops = std::stoull(v); } },
+        { "--key-size", [&](const std::string &v) { opts.key_size = bench::SizeRange::parse(v); } },
+        { "--value-size", [&](const std::string &v) { opts.value_size = bench::SizeRange::parse(v); } },
+        { "--access", [&](const std::string &v) { bench::AccessPattern::parse(v); opts.access = v; } },
+        { "--hit-ratio", [&](const std::string &v) { opts.hit_ratio = std::stod(v); } },
+        { "--cache", [&](const std::string &v) {
+            if (v != "warm" && v != "cold") { throw bench::BadOption("--cache " + v); }
+            opts.cold = v == "cold"; } },
+        { "--reps", [&](const std::string &v) { opts.reps = unsigned(std::stoul(v)); } },
+        { "--page-length", [&](const std::string &v) { opts.page_length = std::stoull(v); } },
+        { "--dir", [&](const std::string &v) { opts.dir = v; } },
+        { "--seed", [&](const std::string &v) { opts.seed = std::stoull(v); } },
+        { "--batch", [&](const std::string &v) { opts.batch = std::stoull(v); } },
+        { "--resident", [&](const std::string &v) { opts.resident = std::stoull(v); } },
+        { "--json", [&](const std::string &v) { opts.json = v; } },
+    };
+
+    bench::parse_options(argc, argv, setters, {}, print_usage);
+
+    if (opts.ops == 0) { opts.ops = opts.n; }
+    if (opts.n == 0 || opts.reps == 0) { throw bench::BadOption("--n and --reps must be positive"); }
+    if (opts.hit_ratio < 0 || opts.hit_ratio > 1) { throw bench::BadOption("--hit-ratio must be in [0, 1]"); }
+    if (std::find(std::begin(page_lengths), std::end(page_lengths), opts.page_length) == std::end(page_lengths)) {
+        throw bench::BadOption("--page-length " + std::to_string(opts.page_length));
+    }
+    if (opts.dir.empty()) { opts.dir = bench::fs::temp_directory_path().string(); }
+    return opts;
+}
+
+template <uint64_t PageLength>
+void run_repetition(const Options &opts, unsigned rep, std::vector<PhaseResult> &results) {
+    using table_t = HashedFile<std::string, std::string, PageLength>;
+
+    bench::rng_t rng(opts.seed + rep);
+    // keys [0, n) are loaded, [n, 2n) are never there
+    bench::KeyGenerator keys(2 * opts.n, opts.key_size, opts.seed);
+    auto access = bench::AccessPattern::parse(opts.access);
+    access.prepare(opts.n);
+    std::bernoulli_distribution hit(opts.hit_ratio);
+
+    // workload is generated before the clock starts
+    std::vector<std::string> load_keys, load_values;
+    load_keys.reserve(opts.n);
+    load_values.reserve(opts.n);
+    for (uint64_t i = 0; i < opts.n; ++i) {
+        load_keys.push_back(keys(i));
+        load_values.push_back(bench::random_string(rng, opts.value_size(rng)));
+    }
+    std::vector<std::string> get_keys, update_keys, update_values, erase_keys;
+    for (uint64_t i = 0; i < opts.ops; ++i) {
+        get_keys.push_back(keys(hit(rng) ? access(rng) : opts.n + access(rng)));
+        update_keys.push_back(keys(access(rng)));
+        update_values.push_back(bench::random_string(rng, opts.value_size(rng)));
+    }
+    for (uint64_t i = 0; i < opts.n / 2; ++i) {
+        erase_keys.push_back(keys(access(rng)));
+    }
+
+    auto dir = bench::make_run_dir(opts.dir);
+    auto cleanup = wheels::finally([&] { bench::fs::remove_all(dir); });
+    std::unique_ptr<table_t> table;
+    auto reopen = [&] {
+        table.reset();
+        if (opts.cold) { bench::drop_page_cache(dir); }
+        table.reset(new table_t(dir, false));
+        table->set_resident_memory(opts.resident);
+    };
+
+    auto phase = [&](size_t index, const std::string &name, uint64_t n, auto op) {
+        if (results.size() <= index) { results.resize(index + 1); }
+        auto &result = results[index];
+        result.name = name;
+        result.ops_per_rep = n;
+        bench::Latencies latencies;
+        RepResult rep;
+        rep.seconds = bench::run_timed(n, latencies, op);
+        rep.mean_ns = latencies.mean();
+        rep.p50_ns = latencies.percentile(0.5);
+        rep.p99_ns = latencies.percentile(0.99);
+        result.reps.push_back(rep);
+        result.latencies.merge(latencies);
+        result.io.add(*table);
+    };
+
+    table.reset(new table_t(dir, true));
+    table->set_resident_memory(opts.resident);
+    if (opts.batch == 0) {
+        phase(0, "insert", opts.n, [&](size_t i) { table->insert(load_keys[i], load_values[i]); });
+    }
+    else {
+        WriteBatch<std::string, std::string> batch;
+        phase(0, "insert", opts.n, [&](size_t i) {
+            batch.insert(load_keys[i], load_values[i]);
+            if (batch.size() == opts.batch || i + 1 == opts.n) {
+                table->write(batch);
+                batch.clear();
+            }
+        });
+    }
+    reopen();
+    uint64_t found = 0;
+    phase(1, "get", opts.ops, [&](size_t i) { if (table->get(get_keys[i])) { found++; } });
+    reopen();
+    phase(2, "update", opts.ops, [&](size_t i) { table->insert_or_assign(update_keys[i], update_values[i]); });
+    reopen();
+    phase(3, "erase", erase_keys.size(), [&](size_t i) { table->erase(erase_keys[i]); });
+
+    std::cout << "rep " << rep << ": " << found << " of " << opts.ops << " gets found, "
+              << "load factor " << table->get_load_factor() << std::endl;
+}
+
+template <uint64_t PageLength>
+std::vector<PhaseResult> run(const Options &opts) {
+    std::vector<PhaseResult> results;
+    for (unsigned rep = 0; rep < opts.reps; ++rep) {
+        run_repetition<PageLength>(opts, rep, results);
+    }
+    return results;
+}
+
+std::vector<PhaseResult> run_with_page_length(const Options &opts) {
+    switch (opts.page_length) {
+    case 4: return run<4>(opts);
+    case 10: return run<10>(opts);
+    case 16: return run<16>(opts);
+    case 64: return run<64>(opts);
+    case 100: return run<100>(opts);
+    case 1000: return run<1000>(opts);
+    }
+    throw bench::BadOption("--page-length " + std::to_string(opts.page_length));
+}
+
+void print_results(std::ostream &out, std::vector<PhaseResult> &results) {
+    out << std::left << std::setw(8) << "phase" << std::right
+        << std::setw(12) << "ops/s" << std::setw(12) << "mean us" << std::setw(12) << "p50 us"
+        << std::setw(12) << "p99 us" << std::setw(12) << "p999 us" << std::setw(12) << "max us"
+        << std::endl;
+    out << std::fixed;
+    for (auto &result : results) {
+        // throughput of the median repetition, latencies of all of them together
+        std::vector<double> seconds;
+        for (auto &rep : result.reps) { seconds.push_back(rep.seconds); }
+        std::sort(seconds.begin(), seconds.end());
+        auto median = seconds[seconds.size() / 2];
+        auto us = [](double ns) { return ns / 1000.0; };
+        out << std::left << std::setw(8) << result.name << std::right
+            << std::setprecision(0) << std::setw(12) << double(result.ops_per_rep) / median
+            << std::setprecision(2)
+            << std::setw(12) << us(result.latencies.mean())
+            << std::setw(12) << us(double(result.latencies.percentile(0.5)))
+            << std::setw(12) << us(double(result.latencies.percentile(0.99)))
+            << std::setw(12) << us(double(result.latencies.percentile(0.999)))
+            << std::setw(12) << us(double(result.latencies.percentile(1.0)))
+            << std::endl;
+    }
+}
+
+std::string utc_now() {
+    auto now = std::time(nullptr);
+    char buf[32];
+    std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    return buf;
+}
+
+void write_json(std::ostream &out, const Options &opts, std::vector<PhaseResult> &results) {
+    bench::json::Writer json(out);
+    json.begin_object()
+        .field("format", uint64_t(1))
+        .field("tool", "bench")
+        .field("revision", BENCH_REVISION)
+        .field("date", utc_now())
+        .field("hardware_threads", uint64_t(std::thread::hardware_concurrency()));
+    std::ostringstream key_size, value_size;
+    key_size << opts.key_size;
+    value_size << opts.value_size;
+    json.begin_object("config")
+        .field("n", opts.n)
+        .field("ops", opts.ops)
+        .field("key_size", key_size.str())
+        .field("value_size", value_size.str())
+        .field("access", bench::AccessPattern::parse(opts.access).name())
+        .field("hit_ratio", opts.hit_ratio)
+        .field("cache", opts.cold ? "cold" : "warm")
+        .field("reps", uint64_t(opts.reps))
+        .field("page_length", opts.page_length)
+        .field("seed", opts.seed)
+        .field("batch", opts.batch)
+        .field("resident", opts.resident)
+        .field("dir", opts.dir)
+        .field("latency_stats", details::latency_stats_t::enabled)
+        .end_object();
+
+    json.begin_array("phases");
+    for (auto &result : results) {
+        json.begin_object()
+            .field("name", result.name)
+            .field("ops_per_rep", result.ops_per_rep);
+        json.begin_array("reps");
+        for (auto &rep : result.reps) {
+            json.begin_object()
+                .field("seconds", rep.seconds)
+                .field("ops_per_sec", double(result.ops_per_rep) / rep.seconds)
+                .field("mean_us", rep.mean_ns / 1000.0)
+                .field("p50_us", double(rep.p50_ns) / 1000.0)
+                .field("p99_us", double(rep.p99_ns) / 1000.0)
+                .end_object();
+        }
+        json.end_array();
+        auto us = [&](double q) { return double(result.latencies.percentile(q)) / 1000.0; };
+        json.begin_object("latency_us")
+            .field("mean", result.latencies.mean() / 1000.0)
+            .field("p50", us(0.5))
+            .field("p99", us(0.99))
+            .field("p999", us(0.999))
+            .field("max", us(1.0))
+            .end_object();
+        auto &io = result.io;
+        json.begin_object("io")
+            .field("pages_read", io.pages_read)
+            .field("pages_written", io.pages_written)
+            .field("key_compares", io.key_compares)
+            .field("false_positives", io.false_positives)
+            .field("values_read", io.values_read)
+            .field("values_written", io.values_written)
+            .field("sys_reads", io.sys_reads)
+            .field("sys_writes", io.sys_writes)
+            .field("sys_bytes_read", io.sys_bytes_read)
+            .field("sys_bytes_written", io.sys_bytes_written)
+            .end_object();
+        json.end_object();
+    }
+    json.end_array();
+    json.end_object();
+}
+
+int main(int argc, char **argv) {
+    try {
+        auto opts = parse_options(argc, argv);
+        std::cout << "n: " << opts.n << ", ops: " << opts.ops
+                  << ", key size: " << opts.key_size << ", value size: " << opts.value_size
+                  << ", access: " << bench::AccessPattern::parse(opts.access).name()
+                  << ", hit ratio: " << opts.hit_ratio
+                  << ", cache: " << (opts.cold ? "cold" : "warm")
+                  << ", page length: " << opts.page_length
+                  << ", batch: " << opts.batch
+                  << ", resident: " << opts.resident
+                  << ", reps: " << opts.reps << std::endl;
+        auto results = run_with_page_length(opts);
+        print_results(std::cout, results);
+        if (!opts.json.empty()) {
+            std::ofstream out(opts.json);
+            write_json(out, opts, results);
+            if (!out) { throw std::runtime_error("cannot write [" + opts.json + "]"); }
+        }
+    }
+    catch (const bench::BadOption &err) {
+        std::cerr << err.what() << std::endl;
+        print_usage(std::cerr);
+        return 1;
+    }
+    catch (const std::exception &err) {
+        std::cerr << "Exception: " << err.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
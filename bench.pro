@@ -0,0 +1,32 @@
+TEMPLATE = app
+TARGET = bench
+CONFIG += console c++11 thread
+CONFIG -= app_bundle
+CONFIG -= qt
+
+QMAKE_CXXFLAGS_RELEASE *= -O3
+
+# goes to json results, so it's known what exactly was measured
+BENCH_REVISION = $$system(git -C $$PWD describe --always --dirty 2>/dev/null)
+isEmpty(BENCH_REVISION): BENCH_REVISION = unknown
+DEFINES += BENCH_REVISION=\\\"$$BENCH_REVISION\\\"
+
+SOURCES += bench.cpp
+
+HEADERS += \
+    bench_json.hpp \
+    bench_utils.hpp \
+    binschema.hpp \
+    binstreamwrap.hpp \
+    binstreamwrapfwd.hpp \
+    crc32c.hpp \
+    fdstream.hpp \
+    hash_file_storage.hpp \
+    latency_histogram.hpp \
+    stable_hash.hpp \
+    trace.hpp \
+    value_cache.hpp
+
+LIBPATH += /usr/local/lib/
+LIBS += $${LIBPATH}libboost_system.a \
+    $${LIBPATH}libboost_filesystem.a
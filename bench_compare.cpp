@@ -0,0 +1,234 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "bench_json.hpp"
+#include "bench_utils.hpp"
+
+
+// compares two results of `bench --json`: every metric of every phase is tested by welch's
+// t-test over repetitions, a regression is a significant change for the worse which is
+// also big enough to care. exit code is 2 if there is any, so it can gate an upgrade
+struct Options {
+    std::string base;
+    std::string current;
+    double alpha = 0.05;
+    double threshold = 0.05; // relative change which is too small to care about
+};
+
+void print_usage(std::ostream &out) {
+    out << "usage: bench_compare [options] BASE.json NEW.json\n"
+        << "  --alpha A       significance level of welch's t-test (0.05)\n"
+        << "  --threshold T   smaller relative changes are never regressions (0.05)\n"
+        << "exit code: 0 - no regressions, 2 - there are some, 1 - something is wrong\n";
+}
+
+Options parse_options(int argc, char **argv) {
+    Options opts;
+    bench::setters_t setters = {
+        { "--alpha", [&](const std::string &v) { opts.alpha = std::stod(v); } },
+        { "--threshold", [&](const std::string &v) { opts.threshold = std::stod(v); } },
+    };
+
+    std::vector<std::string> files;
+    bench::parse_options(argc, argv, setters, {}, print_usage, &files);
+
+    if (files.size() != 2) { throw bench::BadOption("two result files are needed"); }
+    if (opts.alpha <= 0 || opts.alpha >= 1) { throw bench::BadOption("--alpha must be in (0, 1)"); }
+    if (opts.threshold < 0) { throw bench::BadOption("--threshold must not be negative"); }
+    opts.base = files[0];
+    opts.current = files[1];
+    return opts;
+}
+
+bench::json::Value load(const std::string &path) {
+    std::ifstream in(path);
+    if (!in) { throw std::runtime_error("cannot read [" + path + "]"); }
+    std::stringstream text;
+    text << in.rdbuf();
+    auto result = bench::json::parse(text.str());
+    if (result["tool"].is_null() || result["tool"].string() != "bench" || result["format"].number() != 1) {
+        throw std::runtime_error("[" + path + "] isn't a result of bench");
+    }
+    return result;
+}
+
+// regularized incomplete beta function I_x(a, b) by its continued fraction (modified Lentz)
+double incomplete_beta(double a, double b, double x) {
+    if (x <= 0) { return 0; }
+    if (x >= 1) { return 1; }
+    // the fraction converges fast only for x < (a + 1) / (a + b + 2)
+    if (x > (a + 1) / (a + b + 2)) { return 1 - incomplete_beta(b, a, 1 - x); }
+
+    constexpr double tiny = 1e-300;
+    auto front = std::exp(std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b)
+                          + a * std::log(x) + b * std::log(1 - x)) / a;
+    double f = 1, c = 1, d = 0;
+    for (int i = 0; i <= 300; ++i) {
+        int m = i / 2;
+        double numerator;
+        if (i == 0) { numerator = 1; }
+        else if (i % 2 == 0) { numerator = m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m)); }
+        else { numerator = -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1)); }
+        d = 1 + numerator * d;
+        d = 1 / (std::fabs(d) < tiny ? tiny : d);
+        c = 1 + numerator / c;
+        c = std::fabs(c) < tiny ? tiny : c;
+        f *= c * d;
+        if (std::fabs(1 - c * d) < 1e-12) { break; }
+    }
+    return front * (f - 1);
+}
+
+struct Sample {
+    double mean = 0;
+    double variance = 0; // unbiased
+    size_t n = 0;
+
+    explicit Sample(const std::vector<double> &values) : n(values.size()) {
+        for (auto v : values) { mean += v; }
+        mean /= double(std::max<size_t>(n, 1));
+        for (auto v : values) { variance += (v - mean) * (v - mean); }
+        variance /= double(std::max<size_t>(n, 2) - 1);
+    }
+};
+
+// two-sided p-value of welch's t-test: are the means different?
+double welch_p_value(const Sample &a, const Sample &b) {
+    auto va = a.variance / double(a.n), vb = b.variance / double(b.n);
+    if (va + vb == 0) { return a.mean == b.mean ? 1.0 : 0.0; }
+    auto t = (a.mean - b.mean) / std::sqrt(va + vb);
+    auto df = (va + vb) * (va + vb) / (va * va / double(a.n - 1) + vb * vb / double(b.n - 1));
+    return incomplete_beta(df / 2, 0.5, df / (df + t * t));
+}
+
+struct Metric {
+    const char *name;
+    bool higher_is_better;
+};
+
+const Metric metrics[] = {
+    { "ops_per_sec", true },
+    { "mean_us", false },
+    { "p50_us", false },
+    { "p99_us", false },
+};
+
+// they are the same on every run of the same code with the same seed,
+// so any growth is real, no test is needed
+const char *io_counters[] = {
+    "pages_read", "pages_written", "key_compares", "false_positives", "values_read", "values_written",
+    "sys_reads", "sys_writes", "sys_bytes_read", "sys_bytes_written",
+};
+
+int compare(const Options &opts) {
+    auto base = load(opts.base);
+    auto current = load(opts.current);
+    std::cout << "base: " << base["revision"].string() << " (" << base["date"].string() << ")\n"
+              << "new:  " << current["revision"].string() << " (" << current["date"].string() << ")\n";
+
+    for (const auto &field : base["config"].fields()) {
+        if (field.first == "dir") { continue; }
+        const auto &other = current["config"][field.first];
+        bool same = other.type() == field.second.type()
+            && (other.type() != bench::json::Value::Type::boolean || other.boolean() == field.second.boolean())
+            && (other.type() != bench::json::Value::Type::number || other.number() == field.second.number())
+            && (other.type() != bench::json::Value::Type::string || other.string() == field.second.string());
+        if (!same) { std::cout << "warning: configs differ in " << field.first << "\n"; }
+    }
+
+    std::map<std::string, const bench::json::Value *> base_phases;
+    for (const auto &phase : base["phases"].items()) { base_phases[phase["name"].string()] = &phase; }
+
+    std::cout << "\n" << std::left << std::setw(8) << "phase" << std::setw(18) << "metric" << std::right
+              << std::setw(14) << "base" << std::setw(14) << "new" << std::setw(10) << "change"
+              << std::setw(10) << "p" << "  verdict\n" << std::fixed;
+    size_t regressions = 0;
+    auto row = [&](const std::string &phase, const std::string &metric, double a, double b,
+                   double change, const std::string &p, const std::string &verdict) {
+        std::cout << std::left << std::setw(8) << phase << std::setw(18) << metric << std::right
+                  << std::setprecision(2) << std::setw(14) << a << std::setw(14) << b
+                  << std::setprecision(1) << std::setw(9) << change * 100 << "%"
+                  << std::setw(10) << p << "  " << verdict << "\n";
+    };
+
+    for (const auto &phase : current["phases"].items()) {
+        auto name = phase["name"].string();
+        auto found = base_phases.find(name);
+        if (found == base_phases.end()) {
+            std::cout << name << ": not in base results\n";
+            continue;
+        }
+        const auto &old = *found->second;
+
+        for (const auto &metric : metrics) {
+            auto values = [&](const bench::json::Value &p) {
+                std::vector<double> result;
+                for (const auto &rep : p["reps"].items()) { result.push_back(rep[metric.name].number()); }
+                return result;
+            };
+            Sample a(values(old)), b(values(phase));
+            if (a.n == 0 || b.n == 0) { continue; }
+            auto change = a.mean == 0 ? 0.0 : (b.mean - a.mean) / a.mean;
+            auto worse = metric.higher_is_better ? -change : change;
+            std::string p = "-", verdict = "same";
+            if (a.n < 2 || b.n < 2) {
+                verdict = "too few reps";
+            }
+            else {
+                auto p_value = welch_p_value(a, b);
+                std::ostringstream str;
+                str << std::setprecision(3) << std::fixed << p_value;
+                p = str.str();
+                if (p_value < opts.alpha && std::fabs(change) >= opts.threshold) {
+                    verdict = worse > 0 ? "REGRESSION" : "better";
+                    if (worse > 0) { regressions++; }
+                }
+                else if (p_value < opts.alpha) {
+                    verdict = "within threshold";
+                }
+            }
+            row(name, metric.name, a.mean, b.mean, change, p, verdict);
+        }
+
+        for (auto counter : io_counters) {
+            const auto &a = old["io"][counter], &b = phase["io"][counter];
+            if (a.is_null() || b.is_null()) { continue; }
+            auto per_op = [](const bench::json::Value &p, const bench::json::Value &v) {
+                auto ops = p["ops_per_rep"].number() * double(p["reps"].items().size());
+                return ops == 0 ? 0.0 : v.number() / ops;
+            };
+            auto x = per_op(old, a), y = per_op(phase, b);
+            if (x == y) { continue; }
+            auto change = x == 0 ? std::numeric_limits<double>::infinity() : (y - x) / x;
+            std::string verdict = change > opts.threshold ? "REGRESSION" : (change < -opts.threshold ? "better" : "same");
+            if (change > opts.threshold) { regressions++; }
+            row(name, std::string(counter) + "/op", x, y, change, "-", verdict);
+        }
+    }
+
+    std::cout << "\n" << regressions << " regressions\n";
+    return regressions == 0 ? 0 : 2;
+}
+
+int main(int argc, char **argv) {
+    try {
+        return compare(parse_options(argc, argv));
+    }
+    catch (const bench::BadOption &err) {
+        std::cerr << err.what() << std::endl;
+        print_usage(std::cerr);
+        return 1;
+    }
+    catch (const std::exception &err) {
+        std::cerr << "Exception: " << err.what() << std::endl;
+        return 1;
+    }
+}
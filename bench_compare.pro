@@ -0,0 +1,17 @@
+TEMPLATE = app
+TARGET = bench_compare
+CONFIG += console c++11 thread
+CONFIG -= app_bundle
+CONFIG -= qt
+
+QMAKE_CXXFLAGS_RELEASE *= -O3
+
+SOURCES += bench_compare.cpp
+
+HEADERS += \
+    bench_json.hpp \
+    bench_utils.hpp
+
+LIBPATH += /usr/local/lib/
+LIBS += $${LIBPATH}libboost_system.a \
+    $${LIBPATH}libboost_filesystem.a
@@ -0,0 +1,333 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <cmath>
+#include <cctype>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <ostream>
+#include <iomanip>
+
+// just enough of json to write results of benchmarks and read them back for comparison
+namespace bench {
+namespace json {
+    class ParseError : public std::runtime_error {
+    public:
+        ParseError(const std::string &what, size_t pos)
+            : std::runtime_error("bad json at " + std::to_string(pos) + ": " + what) {}
+    };
+
+    class Value {
+    public:
+        enum class Type { null, boolean, number, string, array, object };
+
+        Value() = default;
+        Value(bool b) : m_type(Type::boolean), m_bool(b) {}
+        Value(double d) : m_type(Type::number), m_number(d) {}
+        Value(std::string s) : m_type(Type::string), m_string(std::move(s)) {}
+        Value(const char *s) : Value(std::string(s)) {}
+
+        static Value array() {
+            Value v;
+            v.m_type = Type::array;
+            return v;
+        }
+
+        static Value object() {
+            Value v;
+            v.m_type = Type::object;
+            return v;
+        }
+
+        Type type() const {
+            return m_type;
+        }
+
+        bool is_null() const {
+            return m_type == Type::null;
+        }
+
+        bool boolean() const {
+            expect(Type::boolean);
+            return m_bool;
+        }
+
+        double number() const {
+            expect(Type::number);
+            return m_number;
+        }
+
+        const std::string &string() const {
+            expect(Type::string);
+            return m_string;
+        }
+
+        const std::vector<Value> &items() const {
+            expect(Type::array);
+            return m_items;
+        }
+
+        std::vector<Value> &items() {
+            expect(Type::array);
+            return m_items;
+        }
+
+        const std::map<std::string, Value> &fields() const {
+            expect(Type::object);
+            return m_fields;
+        }
+
+        std::map<std::string, Value> &fields() {
+            expect(Type::object);
+            return m_fields;
+        }
+
+        // a missing field is null, so optional ones are easy to check
+        const Value &operator [](const std::string &name) const {
+            static const Value null;
+            auto it = fields().find(name);
+            return it == m_fields.end() ? null : it->second;
+        }
+
+    private:
+        Type m_type = Type::null;
+        bool m_bool = false;
+        double m_number = 0;
+        std::string m_string;
+        std::vector<Value> m_items;
+        std::map<std::string, Value> m_fields;
+
+        void expect(Type type) const {
+            if (m_type != type) { throw std::runtime_error("unexpected type of json value"); }
+        }
+    };
+
+    class Parser {
+    public:
+        explicit Parser(const std::string &text) : m_text(text) {}
+
+        Value parse() {
+            auto value = parse_value();
+            skip_spaces();
+            if (m_pos != m_text.size()) { fail("garbage after the value"); }
+            return value;
+        }
+
+    private:
+        const std::string &m_text;
+        size_t m_pos = 0;
+
+        [[noreturn]] void fail(const std::string &what) const {
+            throw ParseError(what, m_pos);
+        }
+
+        void skip_spaces() {
+            while (m_pos < m_text.size() && std::isspace(static_cast<unsigned char>(m_text[m_pos]))) { m_pos++; }
+        }
+
+        bool take(char ch) {
+            skip_spaces();
+            if (m_pos < m_text.size() && m_text[m_pos] == ch) {
+                m_pos++;
+                return true;
+            }
+            return false;
+        }
+
+        void take_word(const char *word) {
+            for (; *word != 0; ++word, ++m_pos) {
+                if (m_pos >= m_text.size() || m_text[m_pos] != *word) { fail("unknown word"); }
+            }
+        }
+
+        Value parse_value() {
+            skip_spaces();
+            if (m_pos >= m_text.size()) { fail("unexpected end"); }
+            switch (m_text[m_pos]) {
+            case '{': return parse_object();
+            case '[': return parse_array();
+            case '"': return Value(parse_string());
+            case 't': take_word("true"); return Value(true);
+            case 'f': take_word("false"); return Value(false);
+            case 'n': take_word("null"); return Value();
+            }
+            return parse_number();
+        }
+
+        Value parse_object() {
+            auto object = Value::object();
+            take('{');
+            if (take('}')) { return object; }
+            do {
+                skip_spaces();
+                auto name = parse_string();
+                if (!take(':')) { fail("':' expected"); }
+                object.fields()[name] = parse_value();
+            } while (take(','));
+            if (!take('}')) { fail("'}' expected"); }
+            return object;
+        }
+
+        Value parse_array() {
+            auto array = Value::array();
+            take('[');
+            if (take(']')) { return array; }
+            do {
+                array.items().push_back(parse_value());
+            } while (take(','));
+            if (!take(']')) { fail("']' expected"); }
+            return array;
+        }
+
+        // \u escapes are kept as they are: nobody writes them here
+        std::string parse_string() {
+            if (m_pos >= m_text.size() || m_text[m_pos] != '"') { fail("string expected"); }
+            m_pos++;
+            std::string str;
+            while (m_pos < m_text.size() && m_text[m_pos] != '"') {
+                char ch = m_text[m_pos++];
+                if (ch == '\\' && m_pos < m_text.size()) {
+                    char esc = m_text[m_pos++];
+                    switch (esc) {
+                    case 'n': ch = '\n'; break;
+                    case 't': ch = '\t'; break;
+                    case 'r': ch = '\r'; break;
+                    case 'u': str += "\\u"; continue;
+                    default: ch = esc;
+                    }
+                }
+                str += ch;
+            }
+            if (m_pos >= m_text.size()) { fail("unterminated string"); }
+            m_pos++;
+            return str;
+        }
+
+        Value parse_number() {
+            const char *begin = m_text.c_str() + m_pos;
+            char *end = nullptr;
+            double number = std::strtod(begin, &end);
+            if (end == begin) { fail("value expected"); }
+            m_pos += size_t(end - begin);
+            return Value(number);
+        }
+    };
+
+    inline Value parse(const std::string &text) {
+        return Parser(text).parse();
+    }
+
+    // writes values one by one, commas and indents are its business
+    class Writer {
+    public:
+        explicit Writer(std::ostream &out) : m_out(out) {}
+
+        Writer &begin_object(const char *name = nullptr) {
+            return open(name, '{');
+        }
+
+        Writer &end_object() {
+            return close('}');
+        }
+
+        Writer &begin_array(const char *name = nullptr) {
+            return open(name, '[');
+        }
+
+        Writer &end_array() {
+            return close(']');
+        }
+
+        Writer &field(const char *name, const std::string &value) {
+            next(name);
+            m_out << '"';
+            for (char ch : value) {
+                switch (ch) {
+                case '"': m_out << "\\\""; break;
+                case '\\': m_out << "\\\\"; break;
+                case '\n': m_out << "\\n"; break;
+                case '\t': m_out << "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(ch) < 0x20) {
+                        char buf[8];
+                        std::snprintf(buf, sizeof(buf), "\\u%04x", unsigned(ch));
+                        m_out << buf;
+                    }
+                    else {
+                        m_out << ch;
+                    }
+                }
+            }
+            m_out << '"';
+            return *this;
+        }
+
+        Writer &field(const char *name, const char *value) {
+            return field(name, std::string(value));
+        }
+
+        Writer &field(const char *name, double value) {
+            next(name);
+            if (!std::isfinite(value)) {
+                m_out << "null";
+            }
+            else {
+                m_out << std::setprecision(15) << std::defaultfloat << value;
+            }
+            return *this;
+        }
+
+        Writer &field(const char *name, uint64_t value) {
+            next(name);
+            m_out << value;
+            return *this;
+        }
+
+        Writer &field(const char *name, bool value) {
+            next(name);
+            m_out << (value ? "true" : "false");
+            return *this;
+        }
+
+        // for arrays
+        template <typename T>
+        Writer &item(const T &value) {
+            return field(nullptr, value);
+        }
+
+    private:
+        std::ostream &m_out;
+        std::vector<bool> m_first; // per open container: nothing is written there yet
+
+        void next(const char *name) {
+            if (!m_first.empty()) {
+                m_out << (m_first.back() ? "\n" : ",\n");
+                m_first.back() = false;
+                m_out << std::string(2 * m_first.size(), ' ');
+            }
+            if (name) { m_out << '"' << name << "\": "; }
+        }
+
+        Writer &open(const char *name, char bracket) {
+            next(name);
+            m_out << bracket;
+            m_first.push_back(true);
+            return *this;
+        }
+
+        Writer &close(char bracket) {
+            bool empty = m_first.back();
+            m_first.pop_back();
+            if (!empty) { m_out << '\n' << std::string(2 * m_first.size(), ' '); }
+            m_out << bracket;
+            if (m_first.empty()) { m_out << '\n'; }
+            return *this;
+        }
+    };
+}
+}
@@ -0,0 +1,353 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
+#include <ostream>
+#include <iostream>
+#include <iomanip>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+// things which every benchmark here needs: workload generators, latency percentiles
+// and a way to make the page cache forget our files
+namespace bench {
+    namespace fs = boost::filesystem;
+
+    using bench_clock_t = std::chrono::steady_clock;
+    using rng_t = std::mt19937_64;
+
+    class BadOption : public std::runtime_error {
+    public:
+        BadOption(const std::string &what) : std::runtime_error("bad option: " + what) {}
+    };
+
+    using setters_t = std::map<std::string, std::function<void (const std::string &)>>;
+    using flags_t = std::map<std::string, std::function<void ()>>;
+
+    // "--name value" goes to its setter, "--name" alone to its flag, "--help" prints usage and
+    // exits. other arguments are bad ones, unless there is `positional` for them
+    inline void parse_options(
+            int argc, char **argv,
+            const setters_t &setters,
+            const flags_t &flags,
+            void (*print_usage)(std::ostream &),
+            std::vector<std::string> *positional = nullptr) {
+        for (int i = 1; i < argc; ++i) {
+            std::string name = argv[i];
+            if (name == "--help" || name == "-h") {
+                print_usage(std::cout);
+                std::exit(0);
+            }
+            auto flag = flags.find(name);
+            if (flag != flags.end()) {
+                flag->second();
+                continue;
+            }
+            if (positional && name.compare(0, 2, "--") != 0) {
+                positional->push_back(name);
+                continue;
+            }
+            auto it = setters.find(name);
+            if (it == setters.end() || i + 1 == argc) { throw BadOption(name); }
+            try {
+                it->second(argv[++i]);
+            }
+            catch (const std::logic_error &) { // from stoull and friends
+                throw BadOption(name + " " + argv[i]);
+            }
+        }
+    }
+
+    // "8" means exactly 8, "4:32" means uniformly from 4 to 32
+    struct SizeRange {
+        size_t min = 0;
+        size_t max = 0;
+
+        static SizeRange parse(const std::string &str) {
+            SizeRange range;
+            auto colon = str.find(':');
+            try {
+                range.min = std::stoul(str.substr(0, colon));
+                range.max = colon == std::string::npos ? range.min : std::stoul(str.substr(colon + 1));
+            }
+            catch (const std::logic_error &) {
+                throw BadOption("size range [" + str + "]");
+            }
+            if (range.min > range.max) { throw BadOption("size range [" + str + "]"); }
+            return range;
+        }
+
+        size_t operator ()(rng_t &rng) const {
+            return std::uniform_int_distribution<size_t>(min, max)(rng);
+        }
+    };
+
+    inline std::ostream &operator <<(std::ostream &out, const SizeRange &range) {
+        if (range.min == range.max) { return out << range.min; }
+        return out << range.min << ":" << range.max;
+    }
+
+    // key number `i` always gives the same key and different numbers never give equal keys:
+    // it's a fixed-width base-62 number padded with random tail up to the length from `lengths`
+    class KeyGenerator {
+    public:
+        KeyGenerator(uint64_t max_keys, SizeRange lengths, uint64_t seed)
+            : m_lengths(lengths), m_seed(seed) {
+            while (max_keys > 1) {
+                max_keys = (max_keys + alphabet_size - 1) / alphabet_size;
+                m_width++;
+            }
+            m_width = std::max<size_t>(m_width, 1);
+        }
+
+        std::string operator ()(uint64_t i) const {
+            rng_t rng(m_seed ^ (i * 0x9e3779b97f4a7c15ull));
+            auto length = std::max(m_width, m_lengths(rng));
+            std::string key(length, '0');
+            for (size_t pos = 0; pos < m_width; ++pos, i /= alphabet_size) {
+                key[pos] = alphabet()[i % alphabet_size];
+            }
+            std::uniform_int_distribution<size_t> letter(0, alphabet_size - 1);
+            for (size_t pos = m_width; pos < length; ++pos) {
+                key[pos] = alphabet()[letter(rng)];
+            }
+            return key;
+        }
+
+    private:
+        static constexpr size_t alphabet_size = 62;
+
+        static const char *alphabet() {
+            return "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+        }
+
+        SizeRange m_lengths;
+        uint64_t m_seed;
+        size_t m_width = 0;
+    };
+
+    inline std::string random_string(rng_t &rng, size_t length) {
+        std::uniform_int_distribution<int> letter('a', 'z');
+        std::string str(length, ' ');
+        for (auto &ch : str) { ch = char(letter(rng)); }
+        return str;
+    }
+
+    // which of `n` existing items the next operation touches
+    class AccessPattern {
+    public:
+        enum class Kind { uniform, zipf, latest, hotspot };
+
+        // "uniform", "zipf[:theta]" (0.99 by default, like ycsb), "latest[:theta]" (zipf, where
+        // the last items are the most popular ones) or "hotspot[:hot_fraction[:hot_ops]]"
+        // (0.2 of items get 0.8 of operations by default)
+        static AccessPattern parse(const std::string &str) {
+            AccessPattern pattern;
+            auto colon = str.find(':');
+            auto name = str.substr(0, colon);
+            std::vector<double> args;
+            while (colon != std::string::npos) {
+                auto next = str.find(':', colon + 1);
+                try {
+                    args.push_back(std::stod(str.substr(colon + 1, next - colon - 1)));
+                }
+                catch (const std::logic_error &) {
+                    throw BadOption("access pattern [" + str + "]");
+                }
+                colon = next;
+            }
+
+            if (name == "uniform" && args.empty()) {
+                pattern.m_kind = Kind::uniform;
+            }
+            else if ((name == "zipf" || name == "latest") && args.size() <= 1) {
+                pattern.m_kind = name == "zipf" ? Kind::zipf : Kind::latest;
+                if (!args.empty()) { pattern.m_theta = args[0]; }
+                if (pattern.m_theta <= 0 || pattern.m_theta >= 1) { throw BadOption("zipf theta must be in (0, 1)"); }
+            }
+            else if (name == "hotspot" && args.size() <= 2) {
+                pattern.m_kind = Kind::hotspot;
+                if (args.size() > 0) { pattern.m_hot_fraction = args[0]; }
+                if (args.size() > 1) { pattern.m_hot_ops = args[1]; }
+                if (pattern.m_hot_fraction <= 0 || pattern.m_hot_fraction > 1
+                        || pattern.m_hot_ops < 0 || pattern.m_hot_ops > 1) {
+                    throw BadOption("hotspot fractions must be in (0, 1]");
+                }
+            }
+            else {
+                throw BadOption("access pattern [" + str + "]");
+            }
+            return pattern;
+        }
+
+        // zipf needs to know `n` in advance: it's O(n) to prepare
+        void prepare(uint64_t n) {
+            m_n = std::max<uint64_t>(n, 1);
+            if (m_kind == Kind::zipf || m_kind == Kind::latest) {
+                m_zeta_n = zeta(m_n, m_theta);
+                m_alpha = 1.0 / (1.0 - m_theta);
+                m_eta = (1.0 - std::pow(2.0 / double(m_n), 1.0 - m_theta))
+                      / (1.0 - zeta(2, m_theta) / m_zeta_n);
+            }
+        }
+
+        uint64_t operator ()(rng_t &rng) const {
+            std::uniform_real_distribution<double> unit(0.0, 1.0);
+            switch (m_kind) {
+            case Kind::uniform:
+                return std::uniform_int_distribution<uint64_t>(0, m_n - 1)(rng);
+            case Kind::zipf:
+                return scramble(zipf_rank(rng));
+            case Kind::latest:
+                return m_n - 1 - zipf_rank(rng);
+            case Kind::hotspot: {
+                auto hot = std::max<uint64_t>(uint64_t(double(m_n) * m_hot_fraction), 1);
+                if (hot >= m_n || unit(rng) < m_hot_ops) {
+                    return std::uniform_int_distribution<uint64_t>(0, hot - 1)(rng);
+                }
+                return std::uniform_int_distribution<uint64_t>(hot, m_n - 1)(rng);
+            }
+            }
+            return 0;
+        }
+
+        std::string name() const {
+            switch (m_kind) {
+            case Kind::uniform: return "uniform";
+            case Kind::zipf: return "zipf:" + std::to_string(m_theta);
+            case Kind::latest: return "latest:" + std::to_string(m_theta);
+            case Kind::hotspot:
+                return "hotspot:" + std::to_string(m_hot_fraction) + ":" + std::to_string(m_hot_ops);
+            }
+            return "";
+        }
+
+    private:
+        Kind m_kind = Kind::uniform;
+        uint64_t m_n = 1;
+        double m_theta = 0.99;
+        double m_hot_fraction = 0.2;
+        double m_hot_ops = 0.8;
+        double m_zeta_n = 0, m_alpha = 0, m_eta = 0;
+
+        static double zeta(uint64_t n, double theta) {
+            double sum = 0;
+            for (uint64_t i = 1; i <= n; ++i) { sum += 1.0 / std::pow(double(i), theta); }
+            return sum;
+        }
+
+        // Gray et al. "Quickly generating billion-record synthetic databases"
+        uint64_t zipf_rank(rng_t &rng) const {
+            auto u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+            auto uz = u * m_zeta_n;
+            if (uz < 1.0) { return 0; }
+            if (uz < 1.0 + std::pow(0.5, m_theta)) { return std::min<uint64_t>(1, m_n - 1); }
+            auto rank = uint64_t(double(m_n) * std::pow(m_eta * u - m_eta + 1.0, m_alpha));
+            return std::min(rank, m_n - 1);
+        }
+
+        // popular ranks shouldn't be just the first inserted keys
+        uint64_t scramble(uint64_t rank) const {
+            auto x = rank * 0x9e3779b97f4a7c15ull;
+            x ^= x >> 31;
+            return x % m_n;
+        }
+    };
+
+    // latencies of one phase in nanoseconds
+    class Latencies {
+    public:
+        void reserve(size_t n) {
+            m_samples.reserve(n);
+        }
+
+        void add(bench_clock_t::duration d) {
+            m_samples.push_back(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()));
+        }
+
+        void merge(const Latencies &other) {
+            m_samples.insert(m_samples.end(), other.m_samples.begin(), other.m_samples.end());
+            m_sorted = false;
+        }
+
+        size_t count() const {
+            return m_samples.size();
+        }
+
+        // `q` in [0, 1]
+        uint64_t percentile(double q) {
+            if (m_samples.empty()) { return 0; }
+            sort();
+            auto rank = size_t(std::ceil(q * double(m_samples.size())));
+            return m_samples[std::min(std::max<size_t>(rank, 1), m_samples.size()) - 1];
+        }
+
+        double mean() const {
+            if (m_samples.empty()) { return 0; }
+            double sum = 0;
+            for (auto s : m_samples) { sum += double(s); }
+            return sum / double(m_samples.size());
+        }
+
+        const std::vector<uint64_t> &samples() const {
+            return m_samples;
+        }
+
+    private:
+        std::vector<uint64_t> m_samples;
+        bool m_sorted = false;
+
+        void sort() {
+            if (m_sorted) { return; }
+            std::sort(m_samples.begin(), m_samples.end());
+            m_sorted = true;
+        }
+    };
+
+    // times every call of `op(i)` for i in [0, n)
+    template <typename F>
+    double run_timed(size_t n, Latencies &latencies, F op) {
+        latencies.reserve(latencies.count() + n);
+        auto start = bench_clock_t::now();
+        for (size_t i = 0; i < n; ++i) {
+            auto op_start = bench_clock_t::now();
+            op(i);
+            latencies.add(bench_clock_t::now() - op_start);
+        }
+        return std::chrono::duration<double>(bench_clock_t::now() - start).count();
+    }
+
+    // writes dirty pages of the files down and asks kernel to drop them from the page cache,
+    // so the next reads really go to the disk. it's per file, so root isn't needed
+    inline void drop_page_cache(const fs::path &dir) {
+        for (fs::directory_iterator it(dir), end; it != end; ++it) {
+            if (!fs::is_regular_file(it->path())) { continue; }
+            int fd = ::open(it->path().c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) { continue; }
+            ::fdatasync(fd);
+#if defined(POSIX_FADV_DONTNEED)
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+            ::close(fd);
+        }
+    }
+
+    // a fresh directory for one run, nobody else writes there
+    inline fs::path make_run_dir(const fs::path &base) {
+        auto dir = base / fs::unique_path("hash-file-bench-%%%%-%%%%-%%%%");
+        fs::create_directories(dir);
+        return dir;
+    }
+}
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <list>
+#include <tuple>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <type_traits>
+#include "binstreamwrapfwd.hpp"
+
+/*!
+ * Compile-time field list of an aggregate, which makes it storable by BinIStreamWrap/BinOStreamWrap:
+ *
+ *     struct Record { uint32_t id; std::string name; double score; };
+ *     FCL_SCHEMA(Record, id, name, score);
+ *
+ * It must be used at namespace scope, in the namespace of the type (it declares a function,
+ * which is found by ADL). Fields are stored one after another in the listed order without padding,
+ * but neighbouring trivially copyable fields are copied by one write/read, so a struct
+ * without padding and listed in declaration order costs exactly one memcpy.
+ */
+#define FCL_SCHEMA(Type, ...) \
+    constexpr auto fcl_schema_of(const Type *) { \
+        return ::fcl::details::make_schema<Type>( \
+            FCL_DETAIL_FOR_EACH(FCL_DETAIL_SCHEMA_FIELD, Type, __VA_ARGS__)); \
+    } \
+    static_assert(true, "")
+
+#define FCL_DETAIL_SCHEMA_FIELD(Type, field) ::fcl::details::make_field(#field, &Type::field)
+
+#define FCL_DETAIL_EXPAND(x) x
+#define FCL_DETAIL_CAT(a, b) FCL_DETAIL_CAT_IMPL(a, b)
+#define FCL_DETAIL_CAT_IMPL(a, b) a##b
+#define FCL_DETAIL_NARGS(...) FCL_DETAIL_EXPAND(FCL_DETAIL_NARGS_IMPL( \
+    __VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define FCL_DETAIL_NARGS_IMPL( \
+    _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define FCL_DETAIL_FOR_EACH(M, T, ...) \
+    FCL_DETAIL_EXPAND(FCL_DETAIL_CAT(FCL_DETAIL_FE_, FCL_DETAIL_NARGS(__VA_ARGS__))(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_1(M, T, x) M(T, x)
+#define FCL_DETAIL_FE_2(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_1(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_3(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_2(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_4(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_3(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_5(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_4(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_6(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_5(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_7(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_6(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_8(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_7(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_9(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_8(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_10(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_9(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_11(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_10(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_12(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_11(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_13(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_12(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_14(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_13(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_15(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_14(M, T, __VA_ARGS__))
+#define FCL_DETAIL_FE_16(M, T, x, ...) M(T, x), FCL_DETAIL_EXPAND(FCL_DETAIL_FE_15(M, T, __VA_ARGS__))
+
+namespace fcl {
+
+namespace details {
+    template <typename T, typename F>
+    struct Field {
+        using type = F;
+        const char *name;
+        F T::*member;
+    };
+
+    template <typename T, typename F>
+    constexpr Field<T, F> make_field(const char *name, F T::*member) {
+        return { name, member };
+    }
+
+    template <typename T, typename... F>
+    struct Schema {
+        std::tuple<Field<T, F>...> fields;
+    };
+
+    template <typename T, typename... F>
+    constexpr Schema<T, F...> make_schema(Field<T, F>... fields) {
+        return { std::make_tuple(fields...) };
+    }
+
+    template <typename T, typename = void>
+    struct has_schema : std::false_type {};
+
+    template <typename T>
+    struct has_schema<T, decltype(fcl_schema_of(static_cast<const T *>(nullptr)), void())>
+        : std::true_type {};
+
+    constexpr uint64_t fnv_prime = 0x100000001b3ull;
+    constexpr uint64_t fnv_basis = 0xcbf29ce484222325ull;
+
+    constexpr uint64_t hash_mix(uint64_t seed, uint64_t val) {
+        for (int i = 0; i < 8; ++i) {
+            seed = (seed ^ ((val >> (i * 8)) & 0xff)) * fnv_prime;
+        }
+        return seed;
+    }
+
+    constexpr uint64_t hash_mix(uint64_t seed, const char *str) {
+        while (*str) {
+            seed = (seed ^ uint64_t(static_cast<unsigned char>(*str++))) * fnv_prime;
+        }
+        return (seed ^ 0xff) * fnv_prime; // terminator, so "ab","c" != "a","bc"
+    }
+
+    // what is stored on disk for the type: two types with equal signatures are stored equally
+    // (modulo bugs of hashing). zero means "unknown"
+    template <typename T, typename = void>
+    struct TypeSignature {
+        static constexpr uint64_t value = std::is_trivially_copyable<T>::value
+            ? hash_mix(hash_mix(fnv_basis, "pod"), sizeof(T))
+            : 0;
+    };
+
+    template <typename CharT, typename Traits, typename Alloc>
+    struct TypeSignature<std::basic_string<CharT, Traits, Alloc>> {
+        static constexpr uint64_t value = hash_mix(hash_mix(fnv_basis, "string"), sizeof(CharT));
+    };
+
+    template <typename T, typename Alloc>
+    struct TypeSignature<std::vector<T, Alloc>> {
+        static constexpr uint64_t value = hash_mix(hash_mix(fnv_basis, "sequence"), TypeSignature<T>::value);
+    };
+
+    template <typename T, typename Alloc>
+    struct TypeSignature<std::list<T, Alloc>> {
+        static constexpr uint64_t value = hash_mix(hash_mix(fnv_basis, "sequence"), TypeSignature<T>::value);
+    };
+
+    template <typename... Tp>
+    struct TypeSignature<std::tuple<Tp...>> {
+        static constexpr uint64_t combine() {
+            uint64_t seed = hash_mix(fnv_basis, "tuple");
+            uint64_t sigs[] = { TypeSignature<Tp>::value..., 0 };
+            for (auto sig : sigs) { seed = hash_mix(seed, sig); }
+            return seed;
+        }
+        static constexpr uint64_t value = combine();
+    };
+
+    template <typename T, typename... F, size_t... I>
+    constexpr uint64_t schema_signature(const Schema<T, F...> &schema, std::index_sequence<I...>) {
+        uint64_t seed = hash_mix(fnv_basis, "schema");
+        const char *names[] = { std::get<I>(schema.fields).name..., "" };
+        uint64_t sigs[] = { TypeSignature<F>::value..., 0 };
+        for (size_t i = 0; i < sizeof...(F); ++i) {
+            seed = hash_mix(hash_mix(seed, names[i]), sigs[i]);
+        }
+        return seed;
+    }
+
+    template <typename T, typename... F>
+    constexpr uint64_t schema_signature(const Schema<T, F...> &schema) {
+        return schema_signature(schema, std::index_sequence_for<F...>());
+    }
+
+    template <typename T>
+    struct TypeSignature<T, typename std::enable_if<has_schema<T>::value>::type> {
+        static constexpr uint64_t value = schema_signature(fcl_schema_of(static_cast<const T *>(nullptr)));
+    };
+
+    template <typename T, typename Enable>
+    constexpr uint64_t TypeSignature<T, Enable>::value;
+
+    template <typename F>
+    struct is_plain_field
+        : std::integral_constant<
+            bool,
+            std::is_trivially_copyable<F>::value && !has_schema<F>::value> {};
+
+    // glues neighbouring plain fields into one piece of memory
+    template <typename Buffer>
+    class FieldRuns {
+    public:
+        template <typename Fn>
+        void add(Buffer *ptr, size_t size, Fn flush_to) {
+            if (m_size != 0 && ptr == m_begin + m_size) {
+                m_size += size;
+                return;
+            }
+            flush(flush_to);
+            m_begin = ptr;
+            m_size = size;
+        }
+
+        template <typename Fn>
+        void flush(Fn flush_to) {
+            if (m_size != 0) { flush_to(m_begin, m_size); }
+            m_size = 0;
+        }
+
+    private:
+        Buffer *m_begin = nullptr;
+        size_t m_size = 0;
+    };
+
+    template <class Wrap, class StreamTy, typename T>
+    struct SchemaWriter {
+        Wrap &os;
+        StreamTy &stream;
+        const T &obj;
+        FieldRuns<const char> runs;
+
+        void flush_to(const char *ptr, size_t size) {
+            stream.write(ptr, static_cast<std::streamsize>(size));
+        }
+
+        template <typename F>
+        auto write(const Field<T, F> &field) -> typename std::enable_if<is_plain_field<F>::value>::type {
+            runs.add(
+                reinterpret_cast<const char *>(&(obj.*field.member)), sizeof(F),
+                [this](const char *ptr, size_t size) { flush_to(ptr, size); }
+            );
+        }
+
+        template <typename F>
+        auto write(const Field<T, F> &field) -> typename std::enable_if<!is_plain_field<F>::value>::type {
+            runs.flush([this](const char *ptr, size_t size) { flush_to(ptr, size); });
+            os << obj.*field.member;
+        }
+
+        template <typename... F, size_t... I>
+        void write_all(const Schema<T, F...> &schema, std::index_sequence<I...>) {
+            int dummy[] = { (write(std::get<I>(schema.fields)), 0)..., 0 };
+            (void)dummy;
+            runs.flush([this](const char *ptr, size_t size) { flush_to(ptr, size); });
+        }
+    };
+
+    template <class Wrap, class StreamTy, typename T>
+    struct SchemaReader {
+        Wrap &is;
+        StreamTy &stream;
+        T &obj;
+        FieldRuns<char> runs;
+
+        void read_to(char *ptr, size_t size) {
+            stream.read(ptr, static_cast<std::streamsize>(size));
+        }
+
+        template <typename F>
+        auto read(const Field<T, F> &field) -> typename std::enable_if<is_plain_field<F>::value>::type {
+            runs.add(
+                reinterpret_cast<char *>(&(obj.*field.member)), sizeof(F),
+                [this](char *ptr, size_t size) { read_to(ptr, size); }
+            );
+        }
+
+        template <typename F>
+        auto read(const Field<T, F> &field) -> typename std::enable_if<!is_plain_field<F>::value>::type {
+            runs.flush([this](char *ptr, size_t size) { read_to(ptr, size); });
+            is >> obj.*field.member;
+        }
+
+        template <typename... F, size_t... I>
+        void read_all(const Schema<T, F...> &schema, std::index_sequence<I...>) {
+            int dummy[] = { (read(std::get<I>(schema.fields)), 0)..., 0 };
+            (void)dummy;
+            runs.flush([this](char *ptr, size_t size) { read_to(ptr, size); });
+        }
+    };
+
+    template <class Wrap, class StreamTy, typename T>
+    void write_schema(Wrap &os, StreamTy &stream, const T &obj) {
+        constexpr auto schema = fcl_schema_of(static_cast<const T *>(nullptr));
+        SchemaWriter<Wrap, StreamTy, T> writer{ os, stream, obj, {} };
+        writer.write_all(schema, std::make_index_sequence<std::tuple_size<decltype(schema.fields)>::value>());
+    }
+
+    template <class Wrap, class StreamTy, typename T>
+    void read_schema(Wrap &is, StreamTy &stream, T &obj) {
+        constexpr auto schema = fcl_schema_of(static_cast<const T *>(nullptr));
+        SchemaReader<Wrap, StreamTy, T> reader{ is, stream, obj, {} };
+        reader.read_all(schema, std::make_index_sequence<std::tuple_size<decltype(schema.fields)>::value>());
+    }
+}
+
+// signature of the on-disk representation of T, it goes to file headers to catch mismatches
+template <typename T>
+constexpr uint64_t type_signature() {
+    return details::TypeSignature<T>::value;
+}
+
+} // namespace fcl
@@ -5,6 +5,8 @@
 #include <vector>
 #include <list>
 #include <string>
+#include <memory>
+#include <cstring>
 #include <tuple>
 #include <cstdint>
 #include <type_traits>
@@ -13,6 +15,7 @@
 #   include <QString>
 #endif // QT_VERSION
 #include "binstreamwrapfwd.hpp"
+#include "binschema.hpp"
 
 namespace fcl {
 #ifdef _MSC_VER
@@ -36,6 +39,12 @@ enum class UseExceptions {
     yes, no
 };
 
+// how sizes of strings and containers are stored: full uint64_t or 1-9 bytes prefix varint
+// (first byte's leading ones tell how many bytes follow, so it's decoded with two reads at most)
+enum class LengthPrefix {
+    fixed64, varint
+};
+
 namespace details {
     template <typename Type, unsigned N, unsigned Last>
     struct Reader {
@@ -56,6 +65,238 @@ namespace details {
             return is;
         }
     };
+
+    constexpr size_t max_varint_size = 9;
+
+    inline size_t put_varint(uint64_t val, uint8_t *out) {
+        // k extra bytes keep 7 + 7 * k bits, 8 extra bytes keep all the 64
+        size_t extra = 0;
+        while (extra < 8 && (val >> (7 + 7 * extra)) != 0) { ++extra; }
+        uint8_t lead = extra == 8 ? 0xff : uint8_t(~(0xffu >> extra) | (val >> (8 * extra)));
+        out[0] = lead;
+        for (size_t i = 0; i < extra; ++i) {
+            out[extra - i] = uint8_t(val >> (8 * i));
+        }
+        return extra + 1;
+    }
+
+    // number of bytes after the first one
+    inline size_t varint_extra(uint8_t lead) {
+#if defined(__GNUC__)
+        return size_t(__builtin_clz(~(uint32_t(lead) << 24)));
+#else
+        size_t extra = 0;
+        while (extra < 8 && (lead & (0x80u >> extra))) { ++extra; }
+        return extra;
+#endif
+    }
+
+    inline uint64_t get_varint(uint8_t lead, const uint8_t *rest, size_t extra) {
+        uint64_t val = extra == 8 ? 0 : lead & (0x7fu >> extra);
+        for (size_t i = 0; i < extra; ++i) {
+            val = (val << 8) | rest[i];
+        }
+        return val;
+    }
+
+    template <class StreamTy>
+    void write_varint(StreamTy &stream, uint64_t val) {
+        uint8_t buf[max_varint_size];
+        auto size = put_varint(val, buf);
+        stream.write(reinterpret_cast<const char *>(buf), static_cast<std::streamsize>(size));
+    }
+
+    // returns 0 at eof
+    template <class StreamTy>
+    uint64_t read_varint(StreamTy &stream) {
+        uint8_t buf[max_varint_size];
+        stream.read(reinterpret_cast<char *>(buf), 1);
+        if (stream.eof()) { return 0; }
+        auto extra = varint_extra(buf[0]);
+        if (extra == 0) { return buf[0]; } // the most common case: < 128
+        stream.read(reinterpret_cast<char *>(buf + 1), static_cast<std::streamsize>(extra));
+        if (stream.eof()) { return 0; }
+        return get_varint(buf[0], buf + 1, extra);
+    }
+
+    // contiguous sequence of trivially copyable units (strings, vectors of pods):
+    // containers of them are stored as [count][count lengths][all the units together]
+    template <typename T>
+    struct is_flat_sequence : std::false_type {};
+
+    template <typename CharT, typename Traits, typename Alloc>
+    struct is_flat_sequence<std::basic_string<CharT, Traits, Alloc>> : std::true_type {};
+
+    template <typename T, typename Alloc>
+    struct is_flat_sequence<std::vector<T, Alloc>>
+        : std::integral_constant<
+            bool,
+            std::is_trivially_copyable<T>::value && !std::is_same<T, bool>::value> {};
+
+    struct ConstBuffer {
+        const char *data;
+        size_t size;
+    };
+
+    // stream can do gather write by itself (e.g. with writev)
+    template <class StreamTy>
+    auto write_gather(StreamTy &stream, const std::vector<ConstBuffer> &bufs, int)
+        -> decltype(stream.write_gather(bufs.data(), bufs.size()), void()) {
+        stream.write_gather(bufs.data(), bufs.size());
+    }
+
+    // ...or it can't, then one copy and one write is still better than many small writes
+    template <class StreamTy>
+    void write_gather(StreamTy &stream, const std::vector<ConstBuffer> &bufs, long) {
+        size_t total = 0;
+        for (auto &buf : bufs) { total += buf.size; }
+        std::unique_ptr<char[]> joined(new char[total]);
+        auto out = joined.get();
+        for (auto &buf : bufs) {
+            std::memcpy(out, buf.data, buf.size);
+            out += buf.size;
+        }
+        stream.write(joined.get(), static_cast<std::streamsize>(total));
+    }
+
+    template <class StreamTy, typename Container>
+    void write_flat_sequences(StreamTy &stream, const Container &items, LengthPrefix prefix) {
+        using unit_t = typename Container::value_type::value_type;
+
+        // count and then all the lengths: as is, or varints with the table size in front of them
+        std::vector<uint64_t> table;
+        std::vector<uint8_t> packed;
+        ConstBuffer head;
+        if (prefix == LengthPrefix::fixed64) {
+            table.reserve(items.size() + 1);
+            table.push_back(static_cast<uint64_t>(items.size()));
+            for (auto &item : items) {
+                table.push_back(static_cast<uint64_t>(item.size()));
+            }
+            head = { reinterpret_cast<const char *>(table.data()), table.size() * sizeof(uint64_t) };
+        }
+        else {
+            std::vector<uint8_t> lengths(items.size() * max_varint_size);
+            size_t lengths_size = 0;
+            for (auto &item : items) {
+                lengths_size += put_varint(static_cast<uint64_t>(item.size()), &lengths[lengths_size]);
+            }
+            packed.resize(2 * max_varint_size + lengths_size);
+            size_t packed_size = put_varint(static_cast<uint64_t>(items.size()), packed.data());
+            packed_size += put_varint(static_cast<uint64_t>(lengths_size), &packed[packed_size]);
+            std::copy(lengths.begin(), lengths.begin() + lengths_size, packed.begin() + packed_size);
+            head = { reinterpret_cast<const char *>(packed.data()), packed_size + lengths_size };
+        }
+
+        std::vector<ConstBuffer> bufs;
+        bufs.reserve(items.size() + 1);
+        bufs.push_back(head);
+        for (auto &item : items) {
+            if (item.empty()) { continue; }
+            bufs.push_back({
+                reinterpret_cast<const char *>(item.data()),
+                item.size() * sizeof(unit_t)
+            });
+        }
+        write_gather(stream, bufs, 0);
+    }
+
+    // how many bytes can still be read, -1 if the stream can't tell
+    template <class StreamTy>
+    int64_t bytes_left(StreamTy &stream) {
+        auto pos = static_cast<int64_t>(stream.tellg());
+        if (pos < 0) { return -1; }
+        stream.seekg(0, stream.end);
+        auto end = static_cast<int64_t>(stream.tellg());
+        stream.seekg(pos);
+        return end < pos ? -1 : end - pos;
+    }
+
+    // what is read is broken: the stream is left at its end, so it's seen as a read at eof
+    template <class StreamTy>
+    bool give_up(StreamTy &stream) {
+        stream.seekg(0, stream.end);
+        char past_end;
+        stream.read(&past_end, 1);
+        return false;
+    }
+
+    // sizes which the rest of the stream can't hold are garbage, nothing is allocated for them
+    template <class StreamTy>
+    bool fits(StreamTy &stream, uint64_t count, uint64_t unit, int64_t left) {
+        return left < 0 || count <= static_cast<uint64_t>(left) / unit || give_up(stream);
+    }
+
+    // two reads for the whole container: lengths table and then payload into one arena.
+    // false if the stream ends before it or its sizes are broken, `items` are empty then
+    template <class StreamTy, typename Container>
+    bool read_flat_sequences(StreamTy &stream, Container &items, LengthPrefix prefix) {
+        using unit_t = typename Container::value_type::value_type;
+
+        items.clear();
+        std::vector<uint64_t> lengths;
+        if (prefix == LengthPrefix::fixed64) {
+            uint64_t count = 0;
+            stream.read(reinterpret_cast<char *>(&count), sizeof(count));
+            if (stream.eof()) { return false; }
+            if (!fits(stream, count, sizeof(uint64_t), bytes_left(stream))) { return false; }
+
+            lengths.resize(static_cast<size_t>(count));
+            stream.read(
+                reinterpret_cast<char *>(lengths.data()),
+                static_cast<std::streamsize>(lengths.size() * sizeof(uint64_t))
+            );
+            if (stream.eof()) { return false; }
+        }
+        else {
+            auto count = read_varint(stream);
+            auto table_size = read_varint(stream);
+            if (stream.eof()) { return false; }
+            // every length takes a byte at least
+            if (!fits(stream, table_size, 1, bytes_left(stream)) || count > table_size) {
+                return give_up(stream);
+            }
+
+            std::vector<uint8_t> table(static_cast<size_t>(table_size) + max_varint_size);
+            stream.read(
+                reinterpret_cast<char *>(table.data()),
+                static_cast<std::streamsize>(table_size)
+            );
+            if (stream.eof()) { return false; }
+
+            lengths.resize(static_cast<size_t>(count));
+            auto in = table.data();
+            auto table_end = table.data() + table_size;
+            for (auto &len : lengths) {
+                auto extra = varint_extra(*in);
+                if (in + extra + 1 > table_end) { return give_up(stream); }
+                len = get_varint(*in, in + 1, extra);
+                in += extra + 1;
+            }
+        }
+
+        auto left = bytes_left(stream);
+        uint64_t total = 0;
+        for (auto len : lengths) {
+            if (!fits(stream, len, sizeof(unit_t), left)) { return false; }
+            total += len * sizeof(unit_t);
+            if (!fits(stream, total, 1, left)) { return false; }
+        }
+        std::unique_ptr<char[]> arena(new char[static_cast<size_t>(total)]);
+        stream.read(arena.get(), static_cast<std::streamsize>(total));
+        if (stream.eof()) { return false; }
+
+        items.resize(lengths.size());
+        auto in = arena.get();
+        auto len = lengths.begin();
+        for (auto &item : items) {
+            item.resize(static_cast<size_t>(*len));
+            if (*len != 0) { std::memcpy(&item[0], in, item.size() * sizeof(unit_t)); }
+            in += item.size() * sizeof(unit_t);
+            ++len;
+        }
+        return true;
+    }
 }
 //namespace from {
 //    struct begin_t {} begin;
@@ -96,6 +337,19 @@ public:
         return m_istr.tellg();
     }
 
+    // the way to check end of file if you use UseExceptions::no
+    bool at_eof() const {
+        return m_istr.eof();
+    }
+
+    LengthPrefix length_prefix() const {
+        return m_lengthPrefix;
+    }
+
+    void set_length_prefix(LengthPrefix prefix) {
+        m_lengthPrefix = prefix;
+    }
+
     void set_ipos(int64_t pos) const {
         m_istr.seekg(pos);
     }
@@ -136,8 +390,7 @@ public:
 
     template <typename T>
     friend BinIStreamWrap &operator >>(BinIStreamWrap &is, T &t) {
-        static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
-        is.m_istr.read(reinterpret_cast<char *>(&t), sizeof(t));
+        is.read_value(t, details::has_schema<T>());
         if (is.m_istr.eof() && is.m_useExceptions) {
             throw ReadingAtEOF();
         }
@@ -175,8 +428,7 @@ public:
         -> typename std::enable_if<
             std::is_trivially_copyable<T>::value,
             BinIStreamWrap &>::type {
-        uint64_t size;
-        is >> size;
+        uint64_t size = is.read_length();
         vec.resize(static_cast<size_t>(size));
         is.m_istr.read(
             reinterpret_cast<char *>(vec.data()),
@@ -192,10 +444,9 @@ public:
     template <typename T, typename Alloc>
     friend auto operator >>(BinIStreamWrap &is, std::vector<T, Alloc> &vec)
         -> typename std::enable_if<
-            !std::is_trivially_copyable<T>::value,
+            !std::is_trivially_copyable<T>::value && !details::is_flat_sequence<T>::value,
             BinIStreamWrap &>::type {
-        uint64_t size;
-        is >> size;
+        uint64_t size = is.read_length();
         vec.resize(static_cast<size_t>(size));
 
         for (auto &el : vec) {
@@ -208,9 +459,23 @@ public:
     }
 
     template <typename T, typename Alloc>
-    friend BinIStreamWrap &operator >>(BinIStreamWrap &is, std::list<T, Alloc> &list) {
-        uint64_t size;
-        is >> size;
+    friend auto operator >>(BinIStreamWrap &is, std::vector<T, Alloc> &vec)
+        -> typename std::enable_if<
+            details::is_flat_sequence<T>::value,
+            BinIStreamWrap &>::type {
+        auto read = details::read_flat_sequences(is.m_istr, vec, is.m_lengthPrefix);
+        if (!read && is.m_useExceptions) {
+            throw ReadingAtEOF();
+        }
+        return is;
+    }
+
+    template <typename T, typename Alloc>
+    friend auto operator >>(BinIStreamWrap &is, std::list<T, Alloc> &list)
+        -> typename std::enable_if<
+            !details::is_flat_sequence<T>::value,
+            BinIStreamWrap &>::type {
+        uint64_t size = is.read_length();
         list.resize(static_cast<size_t>(size));
 
         for (auto &el: list) {
@@ -223,12 +488,23 @@ public:
         return is;
     }
 
+    template <typename T, typename Alloc>
+    friend auto operator >>(BinIStreamWrap &is, std::list<T, Alloc> &list)
+        -> typename std::enable_if<
+            details::is_flat_sequence<T>::value,
+            BinIStreamWrap &>::type {
+        auto read = details::read_flat_sequences(is.m_istr, list, is.m_lengthPrefix);
+        if (!read && is.m_useExceptions) {
+            throw ReadingAtEOF();
+        }
+        return is;
+    }
+
     template <typename CharT, typename Traits, typename Alloc>
     friend BinIStreamWrap &operator >>(
             BinIStreamWrap &is,
             std::basic_string< CharT, Traits, Alloc> &s) {
-        uint64_t size;
-        is >> size;
+        uint64_t size = is.read_length();
         s.resize(static_cast<size_t>(size));
         is.m_istr.read(
             reinterpret_cast<char *>(&s.front()),
@@ -274,13 +550,40 @@ public:
 
     template <typename... Tp>
     friend BinIStreamWrap &operator >>(BinIStreamWrap &is, std::tuple<Tp ...> &tpl) {
-        details::Reader<std::tuple<Tp...>, 0, sizeof...(Tp) - 1>::read_tuple(is, tpl);
+        details::Reader<std::tuple<Tp...>, 0, sizeof...(Tp)>::read_tuple(is, tpl);
         return is;
     }
 
 private:
     StreamTy &m_istr;
     bool m_useExceptions;
+    LengthPrefix m_lengthPrefix = LengthPrefix::fixed64;
+
+    uint64_t read_length() {
+        uint64_t size = 0;
+        if (m_lengthPrefix == LengthPrefix::fixed64) {
+            m_istr.read(reinterpret_cast<char *>(&size), sizeof(size));
+        }
+        else {
+            size = details::read_varint(m_istr);
+        }
+        if (m_istr.eof()) {
+            if (m_useExceptions) { throw ReadingAtEOF(); }
+            return 0;
+        }
+        return size;
+    }
+
+    template <typename T>
+    void read_value(T &t, std::false_type /*has schema*/) {
+        static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable or have FCL_SCHEMA");
+        m_istr.read(reinterpret_cast<char *>(&t), sizeof(t));
+    }
+
+    template <typename T>
+    void read_value(T &t, std::true_type /*has schema*/) {
+        details::read_schema(*this, m_istr, t);
+    }
 };
 
 template <class StreamTy>
@@ -329,6 +632,14 @@ public:
         return m_ostr.tellp();
     }
 
+    LengthPrefix length_prefix() const {
+        return m_lengthPrefix;
+    }
+
+    void set_length_prefix(LengthPrefix prefix) {
+        m_lengthPrefix = prefix;
+    }
+
     void set_opos(int64_t pos) {
         m_ostr.seekp(pos);
     }
@@ -384,8 +695,7 @@ public:
 
     template <typename T>
     friend BinOStreamWrap &operator <<(BinOStreamWrap &os, const T &t) {
-        static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
-        os.m_ostr.write(reinterpret_cast<const char *>(&t), sizeof(t));
+        os.write_value(t, details::has_schema<T>());
         return os;
     }
 
@@ -409,11 +719,14 @@ public:
     }
 
     template <typename T, typename Alloc>
-    friend BinOStreamWrap &operator <<(
+    friend auto operator <<(
             BinOStreamWrap &os,
-            const std::vector<T, Alloc> &vec) {
+            const std::vector<T, Alloc> &vec)
+        -> typename std::enable_if<
+            std::is_trivially_copyable<T>::value,
+            BinOStreamWrap &>::type {
         const auto size = static_cast<uint64_t>(vec.size());
-        os << size;
+        os.write_length(size);
         os.m_ostr.write(
             reinterpret_cast<const char *>(vec.data()),
             sizeof(T) * static_cast<size_t>(size)
@@ -422,11 +735,40 @@ public:
     }
 
     template <typename T, typename Alloc>
-    friend BinOStreamWrap &operator <<(
+    friend auto operator <<(
+            BinOStreamWrap &os,
+            const std::vector<T, Alloc> &vec)
+        -> typename std::enable_if<
+            !std::is_trivially_copyable<T>::value && !details::is_flat_sequence<T>::value,
+            BinOStreamWrap &>::type {
+        const auto size = static_cast<uint64_t>(vec.size());
+        os.write_length(size);
+        for (auto &el: vec) {
+            os << el;
+        }
+        return os;
+    }
+
+    template <typename T, typename Alloc>
+    friend auto operator <<(
             BinOStreamWrap &os,
-            const std::list<T, Alloc> &list) {
+            const std::vector<T, Alloc> &vec)
+        -> typename std::enable_if<
+            details::is_flat_sequence<T>::value,
+            BinOStreamWrap &>::type {
+        details::write_flat_sequences(os.m_ostr, vec, os.m_lengthPrefix);
+        return os;
+    }
+
+    template <typename T, typename Alloc>
+    friend auto operator <<(
+            BinOStreamWrap &os,
+            const std::list<T, Alloc> &list)
+        -> typename std::enable_if<
+            !details::is_flat_sequence<T>::value,
+            BinOStreamWrap &>::type {
         const auto size = static_cast<uint64_t>(list.size());
-        os << size;
+        os.write_length(size);
         for (auto &el: list) {
             os << el;
         }
@@ -434,12 +776,23 @@ public:
         return os;
     }
 
+    template <typename T, typename Alloc>
+    friend auto operator <<(
+            BinOStreamWrap &os,
+            const std::list<T, Alloc> &list)
+        -> typename std::enable_if<
+            details::is_flat_sequence<T>::value,
+            BinOStreamWrap &>::type {
+        details::write_flat_sequences(os.m_ostr, list, os.m_lengthPrefix);
+        return os;
+    }
+
     template <typename CharT, typename Traits, typename Alloc>
     friend BinOStreamWrap &operator <<(
             BinOStreamWrap &os,
             const std::basic_string< CharT, Traits, Alloc> &s) {
         const auto size = static_cast<uint64_t>(s.size());
-        os << size;
+        os.write_length(size);
         os.m_ostr.write(s.data(), sizeof(CharT) * static_cast<size_t>(size));
         return os;
     }
@@ -472,12 +825,33 @@ public:
     friend BinOStreamWrap &operator <<(
             BinOStreamWrap &os,
             const std::tuple<Tp ...> &tpl) {
-        details::Writer<std::tuple<Tp...>, 0, sizeof...(Tp) - 1>::write_tuple(os, tpl);
+        details::Writer<std::tuple<Tp...>, 0, sizeof...(Tp)>::write_tuple(os, tpl);
         return os;
     }
 
 private:
     StreamTy &m_ostr;
+    LengthPrefix m_lengthPrefix = LengthPrefix::fixed64;
+
+    void write_length(uint64_t size) {
+        if (m_lengthPrefix == LengthPrefix::fixed64) {
+            m_ostr.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        }
+        else {
+            details::write_varint(m_ostr, size);
+        }
+    }
+
+    template <typename T>
+    void write_value(const T &t, std::false_type /*has schema*/) {
+        static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable or have FCL_SCHEMA");
+        m_ostr.write(reinterpret_cast<const char *>(&t), sizeof(t));
+    }
+
+    template <typename T>
+    void write_value(const T &t, std::true_type /*has schema*/) {
+        details::write_schema(*this, m_ostr, t);
+    }
 };
 
 template <class StreamTy>
@@ -509,6 +883,15 @@ public:
         this->set_ipos(pos); // just 'cause
     }
 
+    LengthPrefix length_prefix() const {
+        return BinIStreamWrap<StreamTy>::length_prefix();
+    }
+
+    void set_length_prefix(LengthPrefix prefix) {
+        BinIStreamWrap<StreamTy>::set_length_prefix(prefix);
+        BinOStreamWrap<StreamTy>::set_length_prefix(prefix);
+    }
+
     int64_t get_pos() const {
         return this->get_opos(); // to be fair
     }
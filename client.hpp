@@ -0,0 +1,198 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <exception>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "fdstream.hpp"
+#include "protocol.hpp"
+
+namespace fcl {
+
+// the server couldn't do a request, it's still fine to send others
+class ServerError : public std::exception {
+public:
+    ServerError(const std::string &what) : m_message("server error: " + what) {}
+
+    virtual const char *what() const noexcept override {
+        return m_message.c_str();
+    }
+private:
+    const std::string m_message;
+};
+
+/*!
+ * \brief Connection to a table served by `server` over a unix socket. One connection is for
+ * one thread, open one per thread.
+ *
+ * Plain calls (`get`, `insert`...) wait for their answers. For high rates pipeline them:
+ * `send_*` only queue requests, `flush` sends all of them at once and `receive` returns
+ * responses one by one in the order of requests.
+ */
+class Client {
+public:
+    explicit Client(const std::string &socket_path) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(addr.sun_path)) {
+            throw proto::ProtocolError("socket path is too long [" + socket_path + "]");
+        }
+        std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+        m_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (m_fd < 0) { throw IOError("socket", errno); }
+        if (::connect(m_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+            auto error = errno;
+            ::close(m_fd);
+            throw IOError("cannot connect to [" + socket_path + "]", error);
+        }
+    }
+
+    ~Client() {
+        ::close(m_fd);
+    }
+
+    Client(const Client &) = delete;
+    Client &operator =(const Client &) = delete;
+
+    void send_get(const std::string &key) {
+        request(proto::Op::get).string(key).end();
+    }
+
+    void send_has(const std::string &key) {
+        request(proto::Op::has).string(key).end();
+    }
+
+    void send_insert(const std::string &key, const std::string &val) {
+        request(proto::Op::insert).string(key).string(val).end();
+    }
+
+    void send_insert_or_assign(const std::string &key, const std::string &val) {
+        request(proto::Op::insert_or_assign).string(key).string(val).end();
+    }
+
+    void send_erase(const std::string &key) {
+        request(proto::Op::erase).string(key).end();
+    }
+
+    // applied atomically, see HashedFile::write
+    void send_batch(const std::vector<proto::BatchOp> &ops) {
+        auto &writer = request(proto::Op::batch).u32(uint32_t(ops.size()));
+        for (const auto &op : ops) {
+            writer.u8(uint8_t(op.action)).string(op.key);
+            if (op.action != proto::Action::erase) { writer.string(op.value); }
+        }
+        writer.end();
+    }
+
+    // requests which are sent (or queued) but not answered yet
+    size_t pending() const {
+        return m_pending;
+    }
+
+    void flush() {
+        size_t done = 0;
+        while (done < m_out.size()) {
+            auto n = ::send(m_fd, m_out.data() + done, m_out.size() - done, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) { continue; }
+                throw IOError("send", errno);
+            }
+            done += size_t(n);
+        }
+        m_out.clear();
+    }
+
+    // the answer to the oldest pending request, errors are returned, not thrown
+    proto::Response receive() {
+        if (m_pending == 0) { throw proto::ProtocolError("nothing to receive"); }
+        if (!m_out.empty()) { flush(); }
+
+        size_t frame;
+        while ((frame = proto::complete_frame(m_in.data() + m_in_pos, m_in.size() - m_in_pos)) == 0) {
+            // keep the start of the buffer for the next frames
+            if (m_in_pos > 0) {
+                m_in.erase(0, m_in_pos);
+                m_in_pos = 0;
+            }
+            char buf[64 * 1024];
+            auto n = ::recv(m_fd, buf, sizeof(buf), 0);
+            if (n < 0) {
+                if (errno == EINTR) { continue; }
+                throw IOError("recv", errno);
+            }
+            if (n == 0) { throw proto::ProtocolError("server has closed the connection"); }
+            m_in.append(buf, size_t(n));
+        }
+
+        proto::FrameReader reader(m_in.data() + m_in_pos + 4, frame - 4);
+        m_in_pos += frame;
+        m_pending--;
+        proto::Response response;
+        response.status = proto::Status(reader.u8());
+        if (!reader.at_end()) { response.value = reader.string(); }
+        return response;
+    }
+
+    bool get(const std::string &key, std::string &val) {
+        send_get(key);
+        auto response = wait();
+        if (response.status == proto::Status::ok) { val = std::move(response.value); }
+        return response.status == proto::Status::ok;
+    }
+
+    bool has(const std::string &key) {
+        send_has(key);
+        return wait().status == proto::Status::ok;
+    }
+
+    bool insert(const std::string &key, const std::string &val) {
+        send_insert(key, val);
+        return wait().status == proto::Status::ok;
+    }
+
+    bool insert_or_assign(const std::string &key, const std::string &val) {
+        send_insert_or_assign(key, val);
+        return wait().status == proto::Status::ok;
+    }
+
+    bool erase(const std::string &key) {
+        send_erase(key);
+        return wait().status == proto::Status::ok;
+    }
+
+    void write(const std::vector<proto::BatchOp> &ops) {
+        send_batch(ops);
+        wait();
+    }
+
+private:
+    int m_fd = -1;
+    std::string m_out;
+    std::string m_in;
+    size_t m_in_pos = 0;
+    size_t m_pending = 0;
+    proto::FrameWriter m_writer{ m_out };
+
+    proto::FrameWriter &request(proto::Op op) {
+        m_pending++;
+        return m_writer.begin(uint8_t(op));
+    }
+
+    // answer to the request just sent, everything queued before it is thrown away
+    proto::Response wait() {
+        while (m_pending > 1) { receive(); }
+        auto response = receive();
+        if (response.status == proto::Status::error) { throw ServerError(response.value); }
+        return response;
+    }
+};
+
+} // namespace fcl
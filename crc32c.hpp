@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#   define FCL_CRC32C_X86
+#   include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#   define FCL_CRC32C_ARM
+#   include <arm_acle.h>
+#endif
+
+namespace fcl {
+
+namespace details {
+    // CRC-32C (Castagnoli), reflected polynomial. it's what SSE 4.2 `crc32` instruction computes
+    constexpr uint32_t crc32c_poly = 0x82f63b78u;
+
+    // slicing-by-8 tables for cpus without crc instruction
+    struct Crc32cTable {
+        uint32_t t[8][256] = {};
+
+        constexpr Crc32cTable() {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t crc = i;
+                for (int k = 0; k < 8; ++k) {
+                    crc = (crc & 1) ? (crc >> 1) ^ crc32c_poly : crc >> 1;
+                }
+                t[0][i] = crc;
+            }
+            for (uint32_t i = 0; i < 256; ++i) {
+                for (int k = 1; k < 8; ++k) {
+                    t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+                }
+            }
+        }
+    };
+
+    inline uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+        static constexpr Crc32cTable table{};
+        const auto &t = table.t;
+        while (len >= 8) {
+            uint32_t lo, hi;
+            std::memcpy(&lo, p, 4);
+            std::memcpy(&hi, p + 4, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            lo = __builtin_bswap32(lo);
+            hi = __builtin_bswap32(hi);
+#endif
+            lo ^= crc;
+            crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+                ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+            p += 8;
+            len -= 8;
+        }
+        while (len-- != 0) {
+            crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+#if defined(FCL_CRC32C_X86)
+    // compiled for sse 4.2 regardless of -m flags, called only if cpu really has it
+    __attribute__((target("sse4.2")))
+    inline uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+#   if defined(__x86_64__)
+        uint64_t crc64 = crc;
+        while (len >= 8) {
+            uint64_t v;
+            std::memcpy(&v, p, 8);
+            crc64 = _mm_crc32_u64(crc64, v);
+            p += 8;
+            len -= 8;
+        }
+        crc = uint32_t(crc64);
+#   endif
+        while (len-- != 0) {
+            crc = _mm_crc32_u8(crc, *p++);
+        }
+        return crc;
+    }
+
+    inline bool has_hw_crc32c() {
+        static const bool result = __builtin_cpu_supports("sse4.2");
+        return result;
+    }
+#elif defined(FCL_CRC32C_ARM)
+    inline uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+        while (len >= 8) {
+            uint64_t v;
+            std::memcpy(&v, p, 8);
+            crc = __crc32cd(crc, v);
+            p += 8;
+            len -= 8;
+        }
+        while (len-- != 0) {
+            crc = __crc32cb(crc, *p++);
+        }
+        return crc;
+    }
+
+    inline bool has_hw_crc32c() {
+        return true;
+    }
+#else
+    inline uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+        return crc32c_sw(crc, p, len);
+    }
+
+    inline bool has_hw_crc32c() {
+        return false;
+    }
+#endif
+}
+
+// `crc` is a result of the previous call, so a checksum of several pieces can be built step by step
+inline uint32_t crc32c(const void *data, size_t len, uint32_t crc = 0) {
+    auto p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    crc = details::has_hw_crc32c() ? details::crc32c_hw(crc, p, len)
+                                   : details::crc32c_sw(crc, p, len);
+    return ~crc;
+}
+
+} // namespace fcl
@@ -0,0 +1,453 @@
+#pragma once
+
+#include <ios>
+#include <string>
+#include <memory>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <exception>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace fcl {
+
+class IOError : public std::exception {
+public:
+    IOError(const std::string &what, int error)
+        : m_message(what + ": " + std::strerror(error)) {}
+
+    virtual const char *what() const noexcept override {
+        return m_message.c_str();
+    }
+private:
+    const std::string m_message;
+};
+
+/*!
+ * \brief Binary file stream on top of a raw file descriptor, which can be used as `StreamTy` of
+ * BinIStreamWrap, BinOStreamWrap and BinIOStreamWrap.
+ *
+ * Unlike std::fstream it has exactly one position for both reading and writing, all I/O is done by
+ * pread/pwrite (so seek is just an assignment) and goes through one user-space buffer: writes are
+ * collected there until the position leaves the buffer, reads fill it with a block around the
+ * position, which grows twice on sequential access up to the buffer size.
+ * Reading after the end of file never throws, it just sets `eof()` until the next seek.
+ */
+class FdStream {
+public:
+    enum seekdir { beg, cur, end };
+
+    static constexpr size_t default_buffer_size = 1 << 16;
+    static constexpr size_t block_size = 1 << 12;
+
+    // what was asked from the stream and what it has asked from the kernel
+    struct Counters {
+        uint64_t bytes_read = 0;
+        uint64_t bytes_written = 0;
+        uint64_t sys_reads = 0;  // pread calls
+        uint64_t sys_writes = 0; // pwrite and pwritev calls
+        uint64_t sys_bytes_read = 0;
+        uint64_t sys_bytes_written = 0;
+    };
+
+    explicit FdStream(size_t buffer_size = default_buffer_size)
+        : m_capacity(std::max(buffer_size, size_t(block_size))) {}
+
+    FdStream(const std::string &path, std::ios::openmode mode, size_t buffer_size = default_buffer_size)
+        : FdStream(buffer_size) {
+        open(path, mode);
+    }
+
+    ~FdStream() {
+        try {
+            close();
+        }
+        catch (const IOError &) {} // nothing to do with it here
+    }
+
+    FdStream(const FdStream &) = delete;
+    FdStream &operator =(const FdStream &) = delete;
+
+    FdStream(FdStream &&other) noexcept {
+        swap(other);
+    }
+
+    FdStream &operator =(FdStream &&other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    // `in` alone opens file read-only, `trunc` creates it if needed (just like fstream does)
+    void open(const std::string &path, std::ios::openmode mode) {
+        close();
+        int flags = (mode & std::ios::out) ? O_RDWR : O_RDONLY;
+        if (mode & std::ios::trunc) { flags |= O_CREAT | O_TRUNC; }
+        m_fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+        if (m_fd < 0) {
+            m_fail = true;
+            return;
+        }
+
+        struct stat st;
+        if (::fstat(m_fd, &st) != 0) {
+            int error = errno;
+            ::close(m_fd);
+            m_fd = -1;
+            throw IOError("cannot stat [" + path + "]", error);
+        }
+        m_file_size = st.st_size;
+        m_pos = 0;
+        m_fail = m_eof = false;
+        m_win_pos = m_win_len = 0;
+        m_dirty_lo = m_dirty_hi = 0;
+        m_fill_size = block_size;
+        if (!m_buf) { m_buf.reset(new char[m_capacity]); }
+    }
+
+    void close() {
+        if (m_fd < 0) { return; }
+        auto fd = m_fd;
+        auto closer = [&] { ::close(fd); m_fd = -1; };
+        try {
+            flush();
+        }
+        catch (...) {
+            closer();
+            throw;
+        }
+        closer();
+    }
+
+    bool is_open() const {
+        return m_fd >= 0;
+    }
+
+    explicit operator bool() const {
+        return is_open() && !m_fail;
+    }
+
+    bool operator !() const {
+        return !bool(*this);
+    }
+
+    bool eof() const {
+        return m_eof;
+    }
+
+    int fd() const {
+        return m_fd;
+    }
+
+    int64_t size() const {
+        return m_file_size;
+    }
+
+    FdStream &read(char *dst, std::streamsize count) {
+        if (m_fd < 0 || m_fail) {
+            m_eof = true;
+            return *this;
+        }
+        size_t n = size_t(count);
+        m_counters.bytes_read += n;
+        while (n != 0) {
+            if (m_pos >= m_win_pos && m_pos < m_win_pos + int64_t(m_win_len)) {
+                size_t offset = size_t(m_pos - m_win_pos);
+                size_t chunk = std::min(n, m_win_len - offset);
+                std::memcpy(dst, m_buf.get() + offset, chunk);
+                dst += chunk;
+                n -= chunk;
+                m_pos += chunk;
+                continue;
+            }
+
+            flush();
+            if (n >= m_capacity) { // buffer won't help here
+                m_win_len = 0;
+                auto got = pread_all(dst, n, m_pos);
+                m_pos += got;
+                if (got != n) { m_eof = true; }
+                return *this;
+            }
+
+            fill_window();
+            if (m_pos >= m_win_pos + int64_t(m_win_len)) {
+                m_eof = true;
+                return *this;
+            }
+        }
+        return *this;
+    }
+
+    FdStream &write(const char *src, std::streamsize count) {
+        if (m_fd < 0 || m_fail) {
+            return *this;
+        }
+        size_t n = size_t(count);
+        m_counters.bytes_written += n;
+        while (n != 0) {
+            bool fits_window = m_pos >= m_win_pos
+                && m_pos <= m_win_pos + int64_t(m_win_len) // no holes inside of window
+                && m_pos < m_win_pos + int64_t(m_capacity);
+            if (fits_window) {
+                size_t offset = size_t(m_pos - m_win_pos);
+                size_t chunk = std::min(n, m_capacity - offset);
+                std::memcpy(m_buf.get() + offset, src, chunk);
+                mark_dirty(offset, offset + chunk);
+                m_win_len = std::max(m_win_len, offset + chunk);
+                src += chunk;
+                n -= chunk;
+                advance(chunk);
+                continue;
+            }
+
+            flush();
+            if (n >= m_capacity) {
+                m_win_len = 0;
+                pwrite_all(src, n, m_pos);
+                advance(n);
+                return *this;
+            }
+            m_win_pos = m_pos;
+            m_win_len = 0;
+        }
+        return *this;
+    }
+
+    // `Buffer` is anything with `data` and `size` fields. small portions go through the buffer,
+    // big ones are written directly with pwritev (flushing the buffer first)
+    template <typename Buffer>
+    FdStream &write_gather(const Buffer *bufs, size_t count) {
+        if (m_fd < 0 || m_fail) {
+            return *this;
+        }
+        size_t total = 0;
+        for (size_t i = 0; i < count; ++i) { total += bufs[i].size; }
+        if (total < m_capacity) {
+            for (size_t i = 0; i < count; ++i) {
+                write(bufs[i].data, static_cast<std::streamsize>(bufs[i].size));
+            }
+            return *this;
+        }
+
+        flush();
+        m_win_len = 0;
+        m_counters.bytes_written += total;
+        constexpr size_t max_batch = 64;
+        struct iovec iov[max_batch];
+        for (size_t first = 0; first < count; first += max_batch) {
+            auto batch = std::min(max_batch, count - first);
+            for (size_t i = 0; i < batch; ++i) {
+                iov[i].iov_base = const_cast<char *>(bufs[first + i].data);
+                iov[i].iov_len = bufs[first + i].size;
+            }
+            auto written = pwritev_some(iov, int(batch), m_pos);
+            advance(written);
+            // short write: finish the rest of this batch one buffer at a time
+            for (size_t i = 0; i < batch; ++i) {
+                if (written >= iov[i].iov_len) {
+                    written -= iov[i].iov_len;
+                    continue;
+                }
+                auto rest = iov[i].iov_len - written;
+                pwrite_all(static_cast<const char *>(iov[i].iov_base) + written, rest, m_pos);
+                advance(rest);
+                written = 0;
+            }
+        }
+        return *this;
+    }
+
+    int64_t tellg() const {
+        return m_fail ? -1 : m_pos;
+    }
+
+    int64_t tellp() const {
+        return tellg();
+    }
+
+    FdStream &seekg(int64_t pos) {
+        m_pos = pos;
+        m_eof = false;
+        return *this;
+    }
+
+    FdStream &seekg(int64_t offset, seekdir dir) {
+        switch (dir) {
+        case beg: return seekg(offset);
+        case cur: return seekg(m_pos + offset);
+        case end: return seekg(m_file_size + offset);
+        }
+        return *this;
+    }
+
+    FdStream &seekp(int64_t pos) {
+        return seekg(pos);
+    }
+
+    FdStream &seekp(int64_t offset, seekdir dir) {
+        return seekg(offset, dir);
+    }
+
+    void flush() {
+        if (m_dirty_hi == m_dirty_lo) { return; }
+        auto lo = m_dirty_lo, hi = m_dirty_hi;
+        m_dirty_lo = m_dirty_hi = 0;
+        pwrite_all(m_buf.get() + lo, hi - lo, m_win_pos + int64_t(lo));
+    }
+
+    // flush and make sure it's on the disk, not only in the page cache
+    void sync() {
+        flush();
+        if (m_fd >= 0 && ::fdatasync(m_fd) != 0) {
+            m_fail = true;
+            throw IOError("fdatasync failed", errno);
+        }
+    }
+
+    // cuts the file to `size` bytes (or grows it with zeros)
+    void truncate(int64_t size) {
+        flush();
+        if (::ftruncate(m_fd, size) != 0) {
+            m_fail = true;
+            throw IOError("ftruncate failed", errno);
+        }
+        m_file_size = size;
+        m_win_pos = 0;
+        m_win_len = 0;
+    }
+
+    // they survive reopening, so the whole life of a stream object is counted
+    const Counters &counters() const {
+        return m_counters;
+    }
+
+    void reset_counters() {
+        m_counters = Counters();
+    }
+
+    // just a hint for the kernel: "i will read it soon"
+    void will_need(int64_t pos, int64_t length) const {
+#if defined(POSIX_FADV_WILLNEED)
+        if (m_fd >= 0) { ::posix_fadvise(m_fd, pos, length, POSIX_FADV_WILLNEED); }
+#else
+        (void)pos; (void)length;
+#endif
+    }
+
+private:
+    int m_fd = -1;
+    size_t m_capacity = default_buffer_size;
+    std::unique_ptr<char[]> m_buf;
+    int64_t m_pos = 0;
+    int64_t m_file_size = 0;
+    bool m_eof = false;
+    bool m_fail = false;
+
+    // buffer holds file bytes [m_win_pos, m_win_pos + m_win_len),
+    // and [m_dirty_lo, m_dirty_hi) of them (relative to m_win_pos) aren't written yet
+    int64_t m_win_pos = 0;
+    size_t m_win_len = 0;
+    size_t m_dirty_lo = 0;
+    size_t m_dirty_hi = 0;
+    size_t m_fill_size = block_size;
+
+    Counters m_counters;
+
+    void swap(FdStream &other) noexcept {
+        std::swap(m_fd, other.m_fd);
+        std::swap(m_capacity, other.m_capacity);
+        std::swap(m_buf, other.m_buf);
+        std::swap(m_pos, other.m_pos);
+        std::swap(m_file_size, other.m_file_size);
+        std::swap(m_eof, other.m_eof);
+        std::swap(m_fail, other.m_fail);
+        std::swap(m_win_pos, other.m_win_pos);
+        std::swap(m_win_len, other.m_win_len);
+        std::swap(m_dirty_lo, other.m_dirty_lo);
+        std::swap(m_dirty_hi, other.m_dirty_hi);
+        std::swap(m_fill_size, other.m_fill_size);
+        std::swap(m_counters, other.m_counters);
+    }
+
+    void advance(size_t count) {
+        m_pos += count;
+        m_file_size = std::max(m_file_size, m_pos);
+    }
+
+    void mark_dirty(size_t lo, size_t hi) {
+        if (m_dirty_lo == m_dirty_hi) {
+            m_dirty_lo = lo;
+            m_dirty_hi = hi;
+        }
+        else {
+            m_dirty_lo = std::min(m_dirty_lo, lo);
+            m_dirty_hi = std::max(m_dirty_hi, hi);
+        }
+    }
+
+    // window must be flushed already
+    void fill_window() {
+        bool sequential = m_win_len != 0 && m_pos == m_win_pos + int64_t(m_win_len);
+        m_fill_size = sequential ? std::min(m_fill_size * 2, m_capacity) : block_size;
+        auto aligned_pos = m_pos - m_pos % int64_t(block_size);
+        m_win_pos = aligned_pos;
+        m_win_len = 0;
+        m_win_len = pread_all(m_buf.get(), m_fill_size, aligned_pos);
+    }
+
+    size_t pread_all(char *dst, size_t count, int64_t pos) {
+        size_t done = 0;
+        while (done != count) {
+            auto got = ::pread(m_fd, dst + done, count - done, pos + int64_t(done));
+            m_counters.sys_reads++;
+            if (got < 0) {
+                if (errno == EINTR) { continue; }
+                m_fail = true;
+                throw IOError("pread failed", errno);
+            }
+            if (got == 0) { break; }
+            done += size_t(got);
+            m_counters.sys_bytes_read += size_t(got);
+        }
+        return done;
+    }
+
+    size_t pwritev_some(const struct iovec *iov, int count, int64_t pos) {
+        while (true) {
+            auto put = ::pwritev(m_fd, iov, count, pos);
+            m_counters.sys_writes++;
+            if (put >= 0) {
+                m_counters.sys_bytes_written += size_t(put);
+                return size_t(put);
+            }
+            if (errno != EINTR) {
+                m_fail = true;
+                throw IOError("pwritev failed", errno);
+            }
+        }
+    }
+
+    void pwrite_all(const char *src, size_t count, int64_t pos) {
+        size_t done = 0;
+        while (done != count) {
+            auto put = ::pwrite(m_fd, src + done, count - done, pos + int64_t(done));
+            m_counters.sys_writes++;
+            if (put < 0) {
+                if (errno == EINTR) { continue; }
+                m_fail = true;
+                throw IOError("pwrite failed", errno);
+            }
+            done += size_t(put);
+            m_counters.sys_bytes_written += size_t(put);
+        }
+    }
+};
+
+} // namespace fcl
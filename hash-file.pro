@@ -1,16 +1,28 @@
 TEMPLATE = app
-CONFIG += console c++11
+CONFIG += console c++11 thread
 CONFIG -= app_bundle
 CONFIG -= qt
 
 QMAKE_CXXFLAGS_RELEASE *= -O3
 
+# per-operation latency histograms for `stats`
+DEFINES += FCL_LATENCY_STATS
+# trace points of the index, `trace` dumps them for chrome://tracing
+DEFINES += FCL_TRACING
+
 SOURCES += main.cpp
 
 HEADERS += \
+    binschema.hpp \
     binstreamwrap.hpp \
     binstreamwrapfwd.hpp \
-    hash_file_storage.hpp
+    crc32c.hpp \
+    fdstream.hpp \
+    hash_file_storage.hpp \
+    latency_histogram.hpp \
+    stable_hash.hpp \
+    trace.hpp \
+    value_cache.hpp
 
 LIBPATH += /usr/local/lib/
 LIBS += $${LIBPATH}libboost_system.a \
@@ -1,11 +1,24 @@
 #pragma once
 #include <string>
-#include <fstream>
+#include <ios>
 #include <tuple>
 #include <utility>
 #include <memory>
 #include <cstdint>
+#include <cstddef>
+#include <cmath>
 #include <algorithm>
+#include <thread>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <exception>
+#include <stdexcept>
+#include <chrono>
+#include <array>
+#include <limits>
+#include <new>
+#include <cstdlib>
 
 #include <boost/optional.hpp>
 #include <boost/filesystem.hpp>
@@ -14,6 +27,12 @@
 #include <wheels/scope.h++>
 
 #include "binstreamwrap.hpp"
+#include "crc32c.hpp"
+#include "fdstream.hpp"
+#include "latency_histogram.hpp"
+#include "stable_hash.hpp"
+#include "trace.hpp"
+#include "value_cache.hpp"
 
 
 namespace details {
@@ -31,6 +50,35 @@ namespace details {
         const std::string m_message;
     };
 
+    // bump it on any change of hash_idx layout
+    constexpr uint64_t index_format_version = 9;
+    // ...and this one on any change of `data` layout
+    constexpr uint64_t storage_format_version = 2;
+    // ...and this one on any change of batch_log layout
+    constexpr uint64_t batch_log_format_version = 2;
+    // ...and this one on any change of frozen files (see FrozenFile)
+    constexpr uint64_t frozen_format_version = 1;
+    // ...and this one on any change of order_idx layout
+    constexpr uint64_t order_format_version = 1;
+
+    // optional features of a file, they are kept in its header
+    namespace format_flags {
+        constexpr uint64_t varint_lengths = 1 << 0;
+        // set while the table is being modified and cleared by the destructor,
+        // so it is still there after a crash
+        constexpr uint64_t unclean = 1 << 1;
+        constexpr uint64_t known = varint_lengths | unclean;
+    }
+
+    inline uint64_t length_prefix_flags(const fcl::LengthPrefix prefix) {
+        return prefix == fcl::LengthPrefix::varint ? format_flags::varint_lengths : 0;
+    }
+
+    inline fcl::LengthPrefix flags_length_prefix(const uint64_t flags) {
+        return (flags & format_flags::varint_lengths) ? fcl::LengthPrefix::varint
+                                                      : fcl::LengthPrefix::fixed64;
+    }
+
     class IncompatableFormat : public std::exception {
     public:
         virtual const char *what() const noexcept override {
@@ -38,19 +86,198 @@ namespace details {
         }
     };
 
+    class CorruptedPage : public std::exception {
+    public:
+        CorruptedPage(const std::string &filename, int64_t pos)
+            : m_message("checksum mismatch at " + std::to_string(pos) + " in [" + filename + "]") {}
+
+        virtual const char *what() const noexcept override {
+            return m_message.c_str();
+        }
+    private:
+        const std::string m_message;
+    };
+
+    class UncleanShutdown : public std::exception {
+    public:
+        UncleanShutdown(const std::string &filename)
+            : m_message("[" + filename + "] was not closed properly, verify_and_recover it first") {}
+
+        virtual const char *what() const noexcept override {
+            return m_message.c_str();
+        }
+    private:
+        const std::string m_message;
+    };
+
+    // a perfect hash can't tell keys apart, if their 64-bit hashes are equal.
+    // it's unlikely (~n^2 / 2^65), but then the table can't be frozen
+    class HashCollision : public std::exception {
+    public:
+        virtual const char *what() const noexcept override {
+            return "two keys have the same hash, the table can't be frozen";
+        }
+    };
+
+    class NoOrderedIndex : public std::exception {
+    public:
+        virtual const char *what() const noexcept override {
+            return "the table has no ordered index, build_ordered_index first";
+        }
+    };
+
+    // what `verify_and_recover` has found (and fixed)
+    struct RecoveryReport {
+        uint64_t pages = 0;
+        uint64_t corrupted_pages = 0; // replaced by empty ones, their records are lost
+        uint64_t cut_links = 0;       // chains cut before a bad page or a bad link
+        uint64_t size = 0;            // alive records, header gets it
+        uint64_t torn_bytes = 0;      // a partial page at the end of the file, cut off
+        uint64_t dropped_segments = 0; // pointed past the end of keys_idx or data, they are lost
+        bool was_clean = true;
+        bool rehash_undone = false;   // a cut rehash is rolled back, the table grows again later
+    };
+
+    // what the index has done since it was opened (or since `reset_counters`)
+    struct IndexCounters {
+        static constexpr size_t max_probe_depth = 16;
+
+        uint64_t pages_read = 0;
+        uint64_t pages_resident = 0;  // of pages read, those found in memory (see set_resident_memory)
+        uint64_t pages_written = 0;
+        uint64_t key_compares = 0;    // a stored key was loaded (from keys_idx, if there is one)...
+        uint64_t false_positives = 0; // ...and it was another key with the same hash
+        // [d] is how many lookups have read d + 1 pages of a chain, the last one counts longer ones too
+        std::array<uint64_t, max_probe_depth> probe_depth{};
+
+        void record_probe(const uint64_t pages) {
+            probe_depth[std::min(std::max(pages, uint64_t(1)), uint64_t(max_probe_depth)) - 1]++;
+        }
+    };
+
+    // what a storage of values has done
+    struct StorageCounters {
+        uint64_t values_read = 0;
+        uint64_t values_written = 0;
+    };
+
     namespace seg_state {
         constexpr char dead = 'd';
         constexpr char alive = 'a';
         constexpr char empty = 'e';
     }
 
+    enum class Insertion {
+        inserted, assigned, rejected
+    };
+
+    // what a write batch does with a key, all its operations on the key are folded into one
+    enum class BatchAction : uint8_t {
+        insert, // only if there is no such key, like `insert`
+        assign, // like `insert_or_assign`
+        erase
+    };
+
+    // what is timed by latency stats
+    enum class Operation {
+        insert, upsert, update, get, has, erase, rehash, compaction, batch
+    };
+
+    constexpr size_t operation_count = 9;
+
+    inline const char *operation_name(const Operation op) {
+        static const char *names[operation_count] = {
+            "insert", "upsert", "update", "get", "has", "erase", "rehash", "compaction", "batch"
+        };
+        return names[size_t(op)];
+    }
+
+    // latency of every operation in nanoseconds, it costs two clock reads per operation
+    class LatencyStats {
+    public:
+        static constexpr bool enabled = true;
+
+        // records time from its creation to its destruction
+        class Timer {
+        public:
+            Timer(fcl::LatencyHistogram &histogram)
+                : m_histogram(&histogram), m_start(std::chrono::steady_clock::now()) {}
+
+            Timer(Timer &&other)
+                : m_histogram(other.m_histogram), m_start(other.m_start) {
+                other.m_histogram = nullptr;
+            }
+
+            Timer(const Timer &) = delete;
+            Timer &operator =(const Timer &) = delete;
+
+            ~Timer() {
+                if (!m_histogram) { return; }
+                auto elapsed = std::chrono::steady_clock::now() - m_start;
+                m_histogram->record(uint64_t(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()
+                ));
+            }
+
+        private:
+            fcl::LatencyHistogram *m_histogram;
+            std::chrono::steady_clock::time_point m_start;
+        };
+
+        Timer start(const Operation op) {
+            return Timer(m_histograms[size_t(op)]);
+        }
+
+        const fcl::LatencyHistogram &operator [](const Operation op) const {
+            return m_histograms[size_t(op)];
+        }
+
+        void reset() {
+            for (auto &histogram : m_histograms) { histogram.reset(); }
+        }
+
+    private:
+        std::array<fcl::LatencyHistogram, operation_count> m_histograms;
+    };
+
+    // the same interface, but measures nothing, so the compiler throws it away
+    class NoLatencyStats {
+    public:
+        static constexpr bool enabled = false;
+
+        struct Timer {
+            ~Timer() {} // user-provided, so `auto timer = ...` isn't an unused variable
+        };
+
+        Timer start(const Operation) {
+            return {};
+        }
+
+        const fcl::LatencyHistogram &operator [](const Operation) const {
+            static const fcl::LatencyHistogram empty;
+            return empty;
+        }
+
+        void reset() {}
+    };
+
+    // define FCL_LATENCY_STATS to get them, otherwise they cost nothing
+#if defined(FCL_LATENCY_STATS)
+    using latency_stats_t = LatencyStats;
+#else
+    using latency_stats_t = NoLatencyStats;
+#endif
+
     namespace flags {
         constexpr auto bin_io = std::ios::in | std::ios::out | std::ios::binary;
         constexpr auto bin_io_overwrite = bin_io | std::ios::trunc;
         constexpr auto bin_io_reopen = bin_io;
     }
 
-    inline void try_to_open(const std::string &path, std::fstream &file, bool overwrite) {
+    using file_t = fcl::FdStream;
+
+    template <typename File>
+    void try_to_open(const std::string &path, File &file, bool overwrite) {
         if (overwrite) {
             file.open(path, flags::bin_io_overwrite);
         }
@@ -63,7 +290,346 @@ namespace details {
         }
     }
 
-    template <typename Key, typename Value, uint64_t PageLength>
+    // segments point to records of files which are only appended to (keys_idx, data). a crash
+    // may cut such a file: records starting after its end are gone, and the last one starting
+    // before it may be cut too. the others end before the next ones start, so they are whole
+    template <typename T>
+    class RecordsCheck {
+    public:
+        RecordsCheck(const fs::path &path, const int64_t first, const fcl::LengthPrefix prefix)
+            : m_path(path.string())
+            , m_first(first)
+            , m_end(fs::exists(path) ? int64_t(fs::file_size(path)) : 0)
+            , m_prefix(prefix) {}
+
+        int64_t position(const int64_t ref) const {
+            return ref;
+        }
+
+        bool starts_inside(const int64_t pos) const {
+            return pos >= m_first && pos < m_end;
+        }
+
+        // reads it, so it's only for the last one
+        bool is_whole(const int64_t pos) const {
+            file_t file(m_path, std::ios::in | std::ios::binary);
+            if (!file) { return false; }
+            fcl::BinIStreamWrap<file_t> stream(file, fcl::UseExceptions::no);
+            stream.set_length_prefix(m_prefix);
+            stream.set_ipos(pos);
+            T record;
+            stream >> record;
+            return !stream.at_eof();
+        }
+
+    private:
+        std::string m_path;
+        int64_t m_first;
+        int64_t m_end;
+        fcl::LengthPrefix m_prefix;
+    };
+
+    // for what is kept right in segments
+    struct NoRecordsCheck {
+        template <typename Ref>
+        int64_t position(const Ref &) const {
+            return -1;
+        }
+
+        bool starts_inside(const int64_t) const {
+            return true;
+        }
+
+        bool is_whole(const int64_t) const {
+            return true;
+        }
+    };
+
+    // keys live in their own file (keys_idx), segments keep only positions of them
+    template <typename Key>
+    class KeyFile {
+    public:
+        using key_t = Key;
+        using key_ref_t = int64_t;
+        using bin_stream_t = fcl::BinIOStreamWrap<file_t>;
+
+        KeyFile(const fs::path &keys_path, const bool overwrite) {
+            try_to_open(keys_path.string(), m_keys_file, overwrite);
+        }
+
+        KeyFile(KeyFile &&) = default;
+        KeyFile &operator =(KeyFile &&) = default;
+
+        KeyFile(const KeyFile &) = delete;
+        KeyFile &operator =(const KeyFile &) = delete;
+
+        key_ref_t store(const key_t &key) {
+            return m_keys.append(key);
+        }
+
+        key_t load(const key_ref_t ref) const {
+            fcl::trace::span_t span("keys_idx.read", uint64_t(ref));
+            return m_keys.template read_at<key_t>(ref);
+        }
+
+        bool equals(const key_ref_t ref, const key_t &key) const {
+            return load(ref) == key;
+        }
+
+        // what keys_idx still has after a crash, see verify_and_recover
+        static RecordsCheck<key_t> records_check(const fs::path &keys_path, const fcl::LengthPrefix prefix) {
+            return RecordsCheck<key_t>(keys_path, 0, prefix);
+        }
+
+        void set_length_prefix(const fcl::LengthPrefix prefix) {
+            m_keys.set_length_prefix(prefix);
+        }
+
+        void sync() {
+            m_keys_file.sync();
+        }
+
+        const file_t::Counters &io() const {
+            return m_keys_file.counters();
+        }
+
+        void reset_counters() {
+            m_keys_file.reset_counters();
+        }
+
+    private:
+        mutable file_t m_keys_file;
+        mutable bin_stream_t m_keys{ m_keys_file };
+    };
+
+    // small trivially copyable keys (integers, ids) are kept right in segments: no keys_idx at all
+    template <typename Key>
+    class InlineKeys {
+        static_assert(
+            std::is_trivially_copyable<Key>::value,
+            "only trivially copyable keys can be kept in the index"
+        );
+
+    public:
+        using key_t = Key;
+        using key_ref_t = Key;
+
+        InlineKeys(const fs::path &, const bool) {}
+
+        key_ref_t store(const key_t &key) {
+            return key;
+        }
+
+        key_t load(const key_ref_t ref) const {
+            return ref;
+        }
+
+        bool equals(const key_ref_t ref, const key_t &key) const {
+            return ref == key;
+        }
+
+        static NoRecordsCheck records_check(const fs::path &, const fcl::LengthPrefix) {
+            return {};
+        }
+
+        void set_length_prefix(const fcl::LengthPrefix) {}
+
+        void sync() {}
+
+        const file_t::Counters &io() const {
+            static const file_t::Counters nothing;
+            return nothing;
+        }
+
+        void reset_counters() {}
+    };
+
+    template <typename Key>
+    using key_store_t = typename std::conditional<
+        std::is_trivially_copyable<Key>::value && sizeof(Key) <= 2 * sizeof(int64_t),
+        InlineKeys<Key>,
+        KeyFile<Key>
+    >::type;
+
+    // segments don't keep 64-bit hashes: bucket number is the low bits of the hash, and a few
+    // high ones (a fingerprint) are enough to skip almost all other keys without loading them.
+    // the state is in two bits of the same word, zeroed segment is an empty one
+    namespace seg_state {
+        inline uint64_t to_bits(const char state) {
+            return state == alive ? 1 : state == dead ? 2 : 0;
+        }
+
+        inline char from_bits(const uint64_t bits) {
+            return bits == 1 ? alive : bits == 2 ? dead : empty;
+        }
+    }
+
+    // keys_idx positions take 40 bits of a segment, so it can't grow beyond 1 TiB
+    class KeysFileTooBig : public std::exception {
+    public:
+        virtual const char *what() const noexcept override {
+            return "keys_idx is too big for the index (1 TiB at most)";
+        }
+    };
+
+    // for keys in keys_idx: state, position of the key and a fingerprint share one word,
+    // 16 bytes with a 64-bit value (instead of 32)
+    template <typename Data>
+    struct PackedSegment {
+        using key_ref_t = int64_t;
+
+        static constexpr unsigned state_bits = 2;
+        static constexpr unsigned key_ref_bits = 40;
+        static constexpr unsigned fingerprint_bits = 64 - state_bits - key_ref_bits;
+        static constexpr uint64_t state_mask = (uint64_t(1) << state_bits) - 1;
+        static constexpr uint64_t key_ref_mask = (uint64_t(1) << key_ref_bits) - 1;
+
+        Data value;
+        // fingerprint (high bits), key_ref, state (low bits): use the methods
+        uint64_t word;
+
+        char state() const {
+            return seg_state::from_bits(word & state_mask);
+        }
+
+        void set_state(const char state) {
+            word = (word & ~state_mask) | seg_state::to_bits(state);
+        }
+
+        // the same fingerprint, the key still has to be compared
+        bool has_hash(const uint64_t hash) const {
+            return ((word ^ hash) >> (64 - fingerprint_bits)) == 0;
+        }
+
+        key_ref_t key_ref() const {
+            return key_ref_t((word >> state_bits) & key_ref_mask);
+        }
+
+        void assign(const uint64_t hash, const key_ref_t key_ref, const char state) {
+            if (uint64_t(key_ref) > key_ref_mask) { throw KeysFileTooBig(); }
+            word = (hash >> (64 - fingerprint_bits) << (64 - fingerprint_bits))
+                | (uint64_t(key_ref) << state_bits) | seg_state::to_bits(state);
+        }
+    };
+
+    // for keys kept in segments (see InlineKeys): comparing them is as cheap as comparing
+    // fingerprints, so a short one is kept next to the state just to skip most of them early
+    template <typename KeyRef, typename Data>
+    struct InlineSegment {
+        using key_ref_t = KeyRef;
+
+        static constexpr unsigned state_bits = 2;
+        static constexpr unsigned fingerprint_bits = 32 - state_bits;
+        static constexpr uint32_t state_mask = (uint32_t(1) << state_bits) - 1;
+
+        Data value;
+        uint32_t tag; // fingerprint (high bits) and state (low bits)
+        key_ref_t key;
+
+        char state() const {
+            return seg_state::from_bits(tag & state_mask);
+        }
+
+        void set_state(const char state) {
+            tag = (tag & ~state_mask) | uint32_t(seg_state::to_bits(state));
+        }
+
+        bool has_hash(const uint64_t hash) const {
+            return (tag >> state_bits) == uint32_t(hash >> (64 - fingerprint_bits));
+        }
+
+        key_ref_t key_ref() const {
+            return key;
+        }
+
+        void assign(const uint64_t hash, const key_ref_t key_ref, const char state) {
+            tag = uint32_t(hash >> (64 - fingerprint_bits) << state_bits) | uint32_t(seg_state::to_bits(state));
+            key = key_ref;
+        }
+    };
+
+    template <typename Key, typename Data>
+    using segment_t = typename std::conditional<
+        std::is_same<key_store_t<Key>, KeyFile<Key>>::value,
+        PackedSegment<Data>,
+        InlineSegment<typename key_store_t<Key>::key_ref_t, Data>
+    >::type;
+
+    // buffers for pages, which are too big for the stack when they are long (PageLength = 1000
+    // takes ~16 KB with keys in keys_idx). they are aligned to cache lines and reused, so probes
+    // allocate nothing
+    template <typename Page>
+    class PageBufferPool {
+    public:
+        static constexpr size_t alignment = 64;
+
+        // goes back to the pool when it's destroyed
+        class Buffer {
+        public:
+            Buffer(PageBufferPool &pool, Page *page) : m_pool(&pool), m_page(page) {}
+
+            Buffer(Buffer &&other) noexcept : m_pool(other.m_pool), m_page(other.m_page) {
+                other.m_page = nullptr;
+            }
+
+            Buffer &operator =(Buffer &&) = delete;
+
+            ~Buffer() {
+                if (m_page) { m_pool->release(m_page); }
+            }
+
+            Page &operator *() const {
+                return *m_page;
+            }
+
+            Page *operator ->() const {
+                return m_page;
+            }
+
+        private:
+            PageBufferPool *m_pool;
+            Page *m_page;
+        };
+
+        Buffer acquire() {
+            if (m_free.empty()) { return Buffer(*this, allocate()); }
+            auto page = m_free.back().release();
+            m_free.pop_back();
+            return Buffer(*this, page);
+        }
+
+    private:
+        struct Free {
+            void operator()(Page *page) const {
+                std::free(page);
+            }
+        };
+        using owned_t = std::unique_ptr<Page, Free>;
+
+        std::vector<owned_t> m_free;
+
+        static Page *allocate() {
+            void *memory = nullptr;
+            if (::posix_memalign(&memory, alignment, sizeof(Page)) != 0) { throw std::bad_alloc(); }
+            return new (memory) Page(Page::get_empty());
+        }
+
+        void release(Page *page) noexcept {
+            owned_t owned(page);
+            try {
+                m_free.push_back(std::move(owned));
+            }
+            catch (const std::bad_alloc &) {} // it's freed then
+        }
+    };
+
+    // `DataSignature` tells what segments keep: values themselves or where they are (see storages)
+    template <
+        typename Key,
+        typename Value,
+        uint64_t PageLength,
+        typename Hasher = fcl::WyHash<Key>,
+        uint64_t DataSignature = fcl::type_signature<Value>()>
     class FileHashIndex {
         static_assert(
             std::is_trivially_copyable<Value>::value,
@@ -75,55 +641,94 @@ namespace details {
         using key_t = Key;
         using hash_t = uint64_t;
         using data_t = Value;
-        using hasher_t = std::hash<key_t>;
+        using hasher_t = Hasher;
         using opt_data_t = boost::optional<data_t>;
         using pos_t = int64_t;
         using state_t = char;
-        using bin_stream_t = fcl::BinIOStreamWrap<std::fstream>;
-        using key_info_t = std::pair<hash_t, pos_t>;
+        using bin_stream_t = fcl::BinIOStreamWrap<file_t>;
+        using key_store_t = details::key_store_t<key_t>;
+        using key_ref_t = typename key_store_t::key_ref_t; // position in keys_idx or the key itself
+        using key_info_t = std::pair<hash_t, key_ref_t>;
         using key_variant_t = boost::variant<key_t, key_info_t>;
         //    ^ i need it to process both new records and old ones (which already in table)
 
     public:
+        struct Header {
+            uint64_t bucket_count;
+            uint64_t size;
+            uint64_t page_length;
+            uint64_t format_version;
+            uint64_t hasher_id;
+            // fcl::type_signature of what is stored in keys_idx and in segments
+            uint64_t key_signature;
+            uint64_t data_signature;
+            uint64_t flags;
+        };
+
         struct Page {
-            struct Segment {
-                state_t state;
-                hash_t hash;
-                pos_t key_adress;
-                data_t value;
-
-                constexpr static Segment get_default() {
-                    return { seg_state::empty, {}, {}, {} };
-                }
-            };
+            using Segment = details::segment_t<Key, Value>;
 
-            Segment segs[PageLength];
+            // meta fields go first: they tell how much of the page is worth reading
             uint64_t seg_count;
             pos_t next_page_pos;
+            // how many pages right after this one are already reserved for this chain
+            uint64_t spare_pages;
+            // crc32c of the fields above and occupied segments, see `seal` and `is_sound`
+            uint32_t checksum;
+            uint32_t reserved;
+            Segment segs[PageLength];
 
             constexpr static Page get_empty() {
-                return { {}, 0, 0 };
+                return { 0, 0, 0, 0, 0, {} };
+            }
+
+            uint32_t calc_checksum() const {
+                constexpr auto meta_length = sizeof(seg_count) + sizeof(next_page_pos) + sizeof(spare_pages);
+                auto crc = fcl::crc32c(&seg_count, meta_length);
+                return fcl::crc32c(segs, sizeof(Segment) * seg_count, crc);
+            }
+
+            // must be called right before the page goes to the file
+            void seal() {
+                checksum = calc_checksum();
+            }
+
+            bool is_sound() const {
+                return seg_count <= PageLength && checksum == calc_checksum();
             }
         };
 
+        static_assert(
+            offsetof(Page, next_page_pos) == offsetof(Page, seg_count) + sizeof(uint64_t)
+                && offsetof(Page, spare_pages) == offsetof(Page, next_page_pos) + sizeof(pos_t),
+            "page meta fields must be contiguous to be checksummed at once"
+        );
+
         using Segment = typename Page::Segment;
+        using page_buffer_t = typename PageBufferPool<Page>::Buffer;
+
+        // pages are read and written by parts: meta fields, then segments
+        static constexpr size_t page_meta_size = offsetof(Page, segs);
 
     public:
+        // `key_lengths` matters only for a new table, an existing one knows it from its header
         FileHashIndex(
                 const fs::path &table_path,
                 const fs::path &keys_path,
-                const bool overwrite)
+                const bool overwrite,
+                const fcl::LengthPrefix key_lengths = fcl::LengthPrefix::fixed64)
             : m_table_path(table_path.string())
-            , m_keys_path(keys_path.string()) {
-            init_keys(overwrite);
+            , m_keys(keys_path, overwrite)
+            , m_flags(length_prefix_flags(key_lengths)) {
             init_table(2, overwrite);
         }
 
         ~FileHashIndex() {
             if (m_table_file) {
                 // it's important: save structure's state before exit
-                m_table.goto_begin();
-                m_table << m_bucket_count << m_size << PageLength;
+                m_table_file.flush();
+                m_unclean = false;
+                write_header();
             }
         }
 
@@ -151,13 +756,52 @@ namespace details {
 
         // useful if you don't want to give me any data when unable to insert it
         bool insert(const key_t &key, std::function<data_t ()> get_data) {
-            if (insert(key, get_data, seg_state::alive)) {
+            fcl::trace::span_t span("index.insert");
+            auto result = insert(
+                key, [&](const data_t *) { return get_data(); }, seg_state::alive, false
+            );
+            if (result == Insertion::inserted) {
+                m_size++;
+                return true;
+            }
+            return false;
+        }
+
+        // returns true if the key was inserted and false if it was already here and got new data
+        bool insert_or_assign(const key_t &key, const data_t &data) {
+            return upsert(key, [&](const data_t *) { return data; });
+        }
+
+        // single probe: `make_data` gets current data of the key or nullptr if there is no such key
+        bool upsert(const key_t &key, std::function<data_t (const data_t *old)> make_data) {
+            fcl::trace::span_t span("index.upsert");
+            auto result = insert(key, make_data, seg_state::alive, true);
+            if (result == Insertion::inserted) {
                 m_size++;
                 return true;
             }
             return false;
         }
 
+        // unlike `insert_or_assign`, it won't add anything: returns false if there is no such key
+        bool update(const key_t &key, const data_t &data) {
+            return update(key, [&](const data_t &) { return data; });
+        }
+
+        bool update(const key_t &key, std::function<data_t (const data_t &old)> make_data) {
+            return inspect(
+                key,
+                m_hasher(key),
+                [&](Segment *seg) {
+                    if (seg) {
+                        seg->value = make_data(seg->value);
+                        return true;
+                    }
+                    return false;
+                }
+            );
+        }
+
         bool erase(const key_t &key) {
             auto hash = m_hasher(key);
             // to erase just turn `state` to `dead` and decrease counter
@@ -166,7 +810,7 @@ namespace details {
                 hash,
                 [this](Segment *seg) {
                     if (seg) {
-                        seg->state = seg_state::dead;
+                        seg->set_state(seg_state::dead);
                         m_size--;
                         return true;
                     }
@@ -203,6 +847,34 @@ namespace details {
             m_load_factor_threshold = val;
         }
 
+        uint64_t max_overflow_extent() const {
+            return m_max_overflow_extent;
+        }
+
+        // hybrid mode: first pages of chains (as many buckets as `bytes` take) stay in memory,
+        // overflow pages stay on the disk only. so a lookup which ends in its bucket page
+        // reads nothing from hash_idx. pages are written through, the file is what it was.
+        // the buckets are recounted when the table grows, 0 turns it off
+        void set_resident_memory(const uint64_t bytes) {
+            m_resident_limit = bytes;
+            load_resident_pages();
+        }
+
+        uint64_t resident_memory() const {
+            return m_resident_limit;
+        }
+
+        uint64_t resident_buckets() const {
+            return m_resident_pages.size();
+        }
+
+        // overflow pages are reserved by extents which grow twice with each one
+        // (1, 2, 4, ... pages) up to this limit, so chain stays (almost) contiguous
+        void set_max_overflow_extent(const uint64_t val) {
+            assert(val >= 1u);
+            m_max_overflow_extent = val;
+        }
+
         bool rehash_if_need() {
             constexpr bool bad_case = sizeof(data_t) < sizeof(hash_t);
             bool bad_cond = false;
@@ -217,16 +889,177 @@ namespace details {
         }
 
         void shrink_to_fit() {
+            auto timer = m_latencies.start(Operation::compaction);
             auto pseudo_size = std::max(size(), uint64_t(1)); // cause i don't want to get 0
             rehash(uint64_t( // to exactly fill the new storage
                 std::ceil(float(pseudo_size)) / m_load_factor_threshold
             ));
         }
 
-        void rehash(const uint64_t new_bucket_count) {
+        // grows the table at once, so it takes `count` records without rehashing on the way
+        void reserve(const uint64_t count) {
+            auto needed = bucket_count();
+            while (float(count) / float(needed) >= max_load_factor()) { needed *= 2; }
+            if (needed != bucket_count()) { rehash(needed); }
+        }
+
+        struct BatchItem {
+            const key_t *key;
+            BatchAction action;
+        };
+
+        // applies `items` (at most one per key) so that every touched chain is read and written
+        // once: the table grows beforehand, then items are taken bucket by bucket.
+        // `make_data(i, old)` gives data of i-th item, `old` is null if the key isn't alive.
+        // changed pages are written in groups, each one after keys and `sync_data()`, so a page
+        // on the disk never points to a record which isn't there
+        template <typename F, typename S> // Functors: Fn<data_t (size_t i, const data_t *old)>, Fn<void ()>
+        void apply_batch(const std::vector<BatchItem> &items, F make_data, S sync_data) {
+            fcl::trace::span_t span("index.batch", items.size());
+            uint64_t growth = 0;
+            for (const auto &item : items) {
+                if (item.action != BatchAction::erase) { growth++; }
+            }
+            reserve(m_size + growth);
+
+            std::vector<hash_t> hashes(items.size());
+            std::vector<std::pair<uint64_t, size_t>> order; // bucket and item
+            order.reserve(items.size());
+            for (size_t i = 0; i < items.size(); ++i) {
+                hashes[i] = m_hasher(*items[i].key);
+                order.emplace_back(calc_bucket_number(hashes[i]), i);
+            }
+            std::sort(order.begin(), order.end());
+
+            // segments [first, last) of a page are changed, its meta fields are if `first` isn't max
+            struct Dirty {
+                size_t first = std::numeric_limits<size_t>::max();
+                size_t last = 0;
+
+                void add(size_t i) {
+                    first = std::min(first, i);
+                    last = std::max(last, i + 1);
+                }
+
+                void add_meta() {
+                    first = std::min(first, size_t(PageLength));
+                }
+
+                bool any() const {
+                    return first != std::numeric_limits<size_t>::max();
+                }
+            };
+
+            std::vector<std::pair<pos_t, page_buffer_t>> chain, pending;
+            std::vector<Dirty> dirty, pending_dirty;
+            auto write_pending = [&] {
+                if (pending.empty()) { return; }
+                m_keys.sync();
+                sync_data();
+                for (size_t p = 0; p < pending.size(); ++p) {
+                    auto first_seg = std::min(pending_dirty[p].first, pending_dirty[p].last);
+                    write_page(pending[p].first, *pending[p].second, first_seg, pending_dirty[p].last);
+                }
+                pending.clear();
+                pending_dirty.clear();
+            };
+            for (size_t first = 0, last = 0; first < order.size(); first = last) {
+                auto bucket = order[first].first;
+                while (last < order.size() && order[last].first == bucket) { last++; }
+
+                chain.clear();
+                dirty.clear();
+                auto page_pos = get_page_pos(bucket);
+                do {
+                    chain.emplace_back(page_pos, m_page_buffers.acquire());
+                    read_page(page_pos, *chain.back().second);
+                    dirty.emplace_back();
+                    page_pos = chain.back().second->next_page_pos;
+                } while (page_pos != 0);
+                m_counters.record_probe(chain.size());
+
+                for (auto k = first; k < last; ++k) {
+                    auto i = order[k].second;
+                    const auto &key = *items[i].key;
+                    auto hash = hashes[i];
+
+                    Segment *found = nullptr;
+                    size_t found_page = 0;
+                    for (size_t p = 0; p < chain.size() && !found; ++p) {
+                        auto &page = *chain[p].second;
+                        for (size_t j = 0; j < page.seg_count; ++j) {
+                            if (page.segs[j].has_hash(hash) && keys_equal(page.segs[j].key_ref(), key)) {
+                                found = &page.segs[j];
+                                found_page = p;
+                                break;
+                            }
+                        }
+                    }
+
+                    bool alive = found && found->state() == seg_state::alive;
+                    auto found_index = found ? size_t(found - chain[found_page].second->segs) : 0;
+                    if (items[i].action == BatchAction::erase) {
+                        if (alive) {
+                            found->set_state(seg_state::dead);
+                            m_size--;
+                            dirty[found_page].add(found_index);
+                        }
+                        continue;
+                    }
+                    if (found) {
+                        found->value = make_data(i, alive ? &found->value : nullptr);
+                        if (!alive) { // resurrection
+                            found->set_state(seg_state::alive);
+                            m_size++;
+                        }
+                        dirty[found_page].add(found_index);
+                        continue;
+                    }
+
+                    // a new one goes to the tail, which gets a next page if it's full
+                    if (chain.back().second->seg_count == PageLength) {
+                        auto &tail = chain.back();
+                        auto next_pos = allocate_overflow(tail.first, tail.second->spare_pages, chain.size());
+                        tail.second->next_page_pos = next_pos;
+                        tail.second->spare_pages = 0;
+                        dirty.back().add_meta();
+                        chain.emplace_back(next_pos, m_page_buffers.acquire());
+                        read_page(next_pos, *chain.back().second);
+                        dirty.emplace_back();
+                    }
+                    auto &tail = *chain.back().second;
+                    dirty.back().add(size_t(tail.seg_count));
+                    Segment &seg = tail.segs[tail.seg_count++];
+                    seg.assign(hash, m_keys.store(key), seg_state::alive);
+                    seg.value = make_data(i, nullptr);
+                    m_size++;
+                }
+
+                for (size_t p = 0; p < chain.size(); ++p) {
+                    if (!dirty[p].any()) { continue; }
+                    pending.push_back(std::move(chain[p]));
+                    pending_dirty.push_back(dirty[p]);
+                }
+                if (pending.size() >= batch_pages_per_sync) { write_pending(); }
+            }
+            write_pending();
+        }
+
+        // pages and keys go to the disk. header doesn't: the destructor rewrites it anyway
+        void sync() {
+            m_keys.sync();
+            m_table_file.sync();
+        }
+
+        // actual bucket count will be rounded up to the nearest power of two
+        void rehash(uint64_t new_bucket_count) {
+            auto timer = m_latencies.start(Operation::rehash);
             assert(new_bucket_count > 0u);
+            new_bucket_count = round_up_to_power_of_two(new_bucket_count);
+            fcl::trace::span_t span("index.rehash", new_bucket_count);
 
             if (!m_table_file.is_open()) { return; } // there is nothing to do here
+            mark_unclean();
 
             // close current table, rename it to old, open it, create fresh table to replace old one
             m_table_file.close();
@@ -236,105 +1069,392 @@ namespace details {
 
             init_table(new_bucket_count, true);
 
-            std::fstream old_table_file(old_table_path, flags::bin_io_reopen);
+            file_t old_table_file(old_table_path, flags::bin_io_reopen);
             if (!old_table_file) { throw CannotOpenFile(old_table_path); }
-            bin_stream_t old_table(old_table_file);
+            bin_stream_t old_table(old_table_file, fcl::UseExceptions::no);
             // ^ done
 
-            // don't care about old table's parameters
-            old_table.skip_n<uint64_t, uint64_t, uint64_t>();
-
-            try {
-                Page current_page;
-                while (true) {
-                    old_table >> current_page;
-                    assert(current_page.seg_count <= PageLength); // smth wrong!
-                    for (size_t i = 0; i < current_page.seg_count; ++i) {
-                        Segment &seg = current_page.segs[i];
-                        bool insertion_succeed = insert(
-                            std::make_pair(seg.hash, seg.key_adress),
-                            [&]() { return seg.value; },
-                            seg.state
+            // don't care about old table's parameters, just go through all the pages
+            auto pages_end = old_table_file.size();
+            old_table.skip<Header>();
+            {
+                // segments keep only fingerprints, so keys are loaded for whole hashes: a chunk of
+                // segments is taken at once and its keys are loaded in the order of keys_idx, so
+                // the file is read forward and not at random. segments go in their own order
+                std::vector<Segment> segs;
+                std::vector<hash_t> hashes;
+                std::vector<size_t> by_key_ref;
+                auto move_segments = [&] {
+                    hashes.resize(segs.size());
+                    by_key_ref.resize(segs.size());
+                    for (size_t i = 0; i < segs.size(); ++i) { by_key_ref[i] = i; }
+                    if (keys_in_file) {
+                        std::sort(by_key_ref.begin(), by_key_ref.end(), [&](size_t a, size_t b) {
+                            return segs[a].key_ref() < segs[b].key_ref();
+                        });
+                    }
+                    for (auto i : by_key_ref) { hashes[i] = hash_of(segs[i]); }
+                    for (size_t i = 0; i < segs.size(); ++i) {
+                        auto insertion = insert(
+                            std::make_pair(hashes[i], segs[i].key_ref()),
+                            [&](const data_t *) { return segs[i].value; },
+                            segs[i].state(),
+                            false
                         );
-                        if (!insertion_succeed) {
+                        if (insertion != Insertion::inserted) {
                             assert(!"Shit happense");
                         }
                     }
+                    segs.clear();
+                };
+
+                auto current_page = m_page_buffers.acquire();
+                while (old_table.get_pos() + pos_t(sizeof(Page)) <= pages_end) {
+                    auto page_pos = old_table.get_pos();
+                    old_table >> *current_page;
+                    m_counters.pages_read++;
+                    if (!current_page->is_sound()) { throw CorruptedPage(old_table_path, page_pos); }
+                    segs.insert(segs.end(), current_page->segs, current_page->segs + current_page->seg_count);
+                    if (segs.size() >= rehash_chunk) { move_segments(); }
+                }
+                move_segments();
+            }
+            old_table_file.close();
+            fs::remove(old_table_path);
+        }
+
+        // times the caller's scope, for those who wrap the index (see HashedFile)
+        typename latency_stats_t::Timer latencies_timer(const Operation op) const {
+            return m_latencies.start(op);
+        }
+
+        const latency_stats_t &latencies() const {
+            return m_latencies;
+        }
+
+        void reset_latencies() {
+            m_latencies.reset();
+        }
+
+        const IndexCounters &counters() const {
+            return m_counters;
+        }
+
+        const file_t::Counters &table_io() const {
+            return m_table_file.counters();
+        }
+
+        const file_t::Counters &keys_io() const {
+            return m_keys.io();
+        }
+
+        void reset_counters() {
+            m_counters = IndexCounters();
+            m_table_file.reset_counters();
+            m_keys.reset_counters();
+        }
+
+        // [n] is how many buckets have chains of n + 1 pages. it reads the whole table,
+        // which is seen in `table_io`, but not in `counters`
+        std::vector<uint64_t> chain_lengths() const {
+            auto saved = m_counters;
+            std::vector<uint64_t> lengths;
+            auto page = m_page_buffers.acquire();
+            for (uint64_t bucket = 0; bucket < m_bucket_count; ++bucket) {
+                auto page_pos = get_page_pos(bucket);
+                size_t length = 0;
+                do {
+                    read_page(page_pos, *page);
+                    length++;
+                    page_pos = page->next_page_pos;
+                } while (page_pos != 0);
+                if (lengths.size() < length) { lengths.resize(length); }
+                lengths[length - 1]++;
+            }
+            m_counters = saved;
+            return lengths;
+        }
+
+        // what `for_each` shows of a record: the key is loaded only if it's asked for
+        class RecordView {
+        public:
+            RecordView(const Segment &seg, const FileHashIndex &index) : m_seg(seg), m_index(index) {}
+
+            // segments keep only fingerprints, so the key is loaded for it
+            hash_t hash() const {
+                return m_index.hash_of(m_seg);
+            }
+
+            const data_t &data() const {
+                return m_seg.value;
+            }
+
+            key_t key() const {
+                return m_index.m_keys.load(m_seg.key_ref());
+            }
+
+        private:
+            const Segment &m_seg;
+            const FileHashIndex &m_index;
+        };
+
+        // every alive record, bucket by bucket. chains are followed, so pages which no chain
+        // reaches (verify_and_recover may leave some) aren't seen
+        template <typename F> // Functor: Fn<void (const RecordView &)>
+        void for_each(F f) const {
+            auto page = m_page_buffers.acquire();
+            for (uint64_t bucket = 0; bucket < m_bucket_count; ++bucket) {
+                auto page_pos = get_page_pos(bucket);
+                do {
+                    read_page(page_pos, *page);
+                    prefetch_next(*page);
+                    for (size_t i = 0; i < page->seg_count; ++i) {
+                        if (page->segs[i].state() == seg_state::alive) { f(RecordView(page->segs[i], *this)); }
+                    }
+                    page_pos = page->next_page_pos;
+                } while (page_pos != 0);
+            }
+        }
+
+        // checks every page of the table (closed or not), replaces broken buckets with empty ones,
+        // cuts chains before broken pages and bad links, drops segments pointing past the ends
+        // of keys_idx and data, recounts size and clears `unclean` mark.
+        // pages are checked by `threads` threads, each one reads its own part of the file
+        template <typename DataCheck> // RecordsCheck or NoRecordsCheck, see storages
+        static RecoveryReport verify_and_recover(
+                const fs::path &table_path,
+                const fs::path &keys_path,
+                const DataCheck &data_check,
+                unsigned threads = std::thread::hardware_concurrency()) {
+            auto path = table_path.string();
+            RecoveryReport report;
+            // the old table of a cut rehash is whole (it was only read), the new one may be not
+            if (fs::exists(path + "_old")) {
+                if (fs::exists(path)) { fs::remove(path); }
+                fs::rename(path + "_old", path);
+                report.rehash_undone = true;
+            }
+
+            file_t table_file(path, flags::bin_io_reopen);
+            if (!table_file) { throw CannotOpenFile(path); }
+            bin_stream_t table(table_file);
+
+            auto header = fcl::read_val<Header>(table);
+            if (!is_compatible(header)) { throw IncompatableFormat(); }
+
+            report.was_clean = (header.flags & format_flags::unclean) == 0;
+            auto body = uint64_t(table_file.size() - pos_t(sizeof(Header)));
+            auto page_count = body / sizeof(Page);
+            // a torn page goes away, or pages appended after it would be misaligned
+            report.torn_bytes = body % sizeof(Page);
+            if (report.torn_bytes != 0) { table_file.truncate(get_page_pos(page_count)); }
+
+            auto key_check = key_store_t::records_check(keys_path, flags_length_prefix(header.flags));
+            LastRecord last_key, last_data;
+            auto pages = scan_pages(path, page_count, key_check, data_check, last_key, last_data, threads);
+            report.pages = page_count;
+
+            // the last records may be cut by the ends of their files, the others end before them
+            auto cut_key = last_key.pos, cut_data = last_data.pos;
+            if (cut_key >= 0 && key_check.is_whole(cut_key)) { cut_key = -1; }
+            if (cut_data >= 0 && data_check.is_whole(cut_data)) { cut_data = -1; }
+            if (cut_key >= 0) { pages[last_key.page].drop(last_key.alive); }
+            if (cut_data >= 0 && !(cut_key >= 0 && last_data.is_in(last_key))) {
+                pages[last_data.page].drop(last_data.alive);
+            }
+            auto is_sane = [&](const Segment &seg) {
+                auto key_pos = key_check.position(seg.key_ref());
+                auto data_pos = data_check.position(seg.value);
+                return (key_pos < 0 || (key_check.starts_inside(key_pos) && key_pos != cut_key))
+                    && (data_pos < 0 || (data_check.starts_inside(data_pos) && data_pos != cut_data));
+            };
+            for (auto &info : pages) {
+                if (!info.sound) { report.corrupted_pages++; }
+            }
+
+            // overflow page number by its position, if the position is a sane one
+            auto overflow_index = [&](pos_t pos) -> boost::optional<uint64_t> {
+                auto first = get_page_pos(header.bucket_count);
+                if (pos < first || (pos - first) % pos_t(sizeof(Page)) != 0) { return boost::none; }
+                auto index = header.bucket_count + uint64_t(pos - first) / sizeof(Page);
+                if (index >= page_count) { return boost::none; }
+                return index;
+            };
+
+            struct PageFix {
+                bool reset = false;         // write an empty page instead
+                bool drop_links = false;    // forget next page and spare ones
+                bool drop_segments = false; // leave only sane segments
+            };
+            std::map<uint64_t, PageFix> fixes; // ordered, so a torn file grows without holes
+            std::vector<bool> reached(page_count, false);
+            for (uint64_t bucket = 0; bucket < header.bucket_count; ++bucket) {
+                if (bucket >= page_count || !pages[bucket].sound) {
+                    fixes[bucket].reset = true;
+                    continue;
+                }
+                auto current = bucket;
+                while (true) {
+                    const auto &info = pages[current];
+                    report.size += info.alive;
+                    if (info.bad_segments != 0) {
+                        fixes[current].drop_segments = true;
+                        report.dropped_segments += info.bad_segments;
+                    }
+                    if (info.next_page_pos == 0) {
+                        // tail keeps its spare pages only if they are really reserved and empty
+                        if (info.spare_pages != 0) {
+                            auto spare = current + 1;
+                            bool reserved = current >= header.bucket_count && spare < page_count
+                                && pages[spare].sound && pages[spare].seg_count == 0
+                                && pages[spare].next_page_pos == 0
+                                && pages[spare].spare_pages + 1 == info.spare_pages
+                                && !reached[spare];
+                            if (!reserved) { fixes[current].drop_links = true; }
+                        }
+                        break;
+                    }
+                    auto next = overflow_index(info.next_page_pos);
+                    if (!next || reached[*next] || !pages[*next].sound) {
+                        fixes[current].drop_links = true;
+                        report.cut_links++;
+                        break;
+                    }
+                    reached[*next] = true;
+                    current = *next;
+                }
+            }
+
+            for (const auto &fix : fixes) {
+                auto page_pos = get_page_pos(fix.first);
+                Page page = Page::get_empty();
+                if (!fix.second.reset) {
+                    table.set_pos(page_pos);
+                    table >> page;
+                }
+                if (fix.second.drop_links) {
+                    page.next_page_pos = 0;
+                    page.spare_pages = 0;
                 }
-            } // it's strange to use exceptions as eof check, but it's simpliest way here
-            catch (const fcl::ReadingAtEOF &) { // it's ok, end of file successfully reached
-                old_table_file.close();
-                fs::remove(old_table_path);
+                if (fix.second.drop_segments) {
+                    auto sane = std::stable_partition(page.segs, page.segs + page.seg_count, is_sane);
+                    std::fill(sane, page.segs + page.seg_count, Segment{});
+                    page.seg_count = uint64_t(sane - page.segs);
+                }
+                page.seal();
+                table.write_at(page_pos, page);
             }
+
+            header.size = report.size;
+            header.flags &= ~format_flags::unclean;
+            table_file.flush(); // pages first, header last
+            table.goto_begin();
+            table << header;
+            return report;
         }
 
     private:
-        std::hash<key_t> m_hasher{};
+        hasher_t m_hasher{};
         std::string m_table_path;
-        std::string m_keys_path;
 
         // they mutable 'cause i want to make get(...) and has(...) const
-        mutable std::fstream m_table_file;
-        mutable std::fstream m_keys_file;
+        mutable file_t m_table_file;
         mutable bin_stream_t m_table{ m_table_file };
-        mutable bin_stream_t m_keys{ m_keys_file };
+        key_store_t m_keys;
 
          // bad for speed, but good for memory (~80mb against 3.5+ gb on the last test!)
         float m_load_factor_threshold = float(PageLength) * 0.75f;
+        uint64_t m_max_overflow_extent = 16;
+
+        mutable PageBufferPool<Page> m_page_buffers;
+
+        // copies of pages of the first buckets, see `set_resident_memory`
+        uint64_t m_resident_limit = 0;
+        std::vector<Page> m_resident_pages;
 
         uint64_t m_size = 0;
         uint64_t m_bucket_count = 0;
+        uint64_t m_flags = 0; // format flags only, `unclean` one is added by `write_header`
+        bool m_unclean = false;
+
+        // it's mutable 'cause get(...) and has(...) are timed too
+        mutable latency_stats_t m_latencies;
+        mutable IndexCounters m_counters;
+
+        // a part of file is too small to bother another thread with it
+        static constexpr uint64_t min_pages_per_thread = 1024;
+        // changed pages of a batch wait for one sync of keys and data, see apply_batch
+        static constexpr size_t batch_pages_per_sync = 1024;
+        // segments whose keys rehash loads at once, in the order of keys_idx
+        static constexpr size_t rehash_chunk = size_t(1) << 20;
+        static constexpr bool keys_in_file = std::is_same<key_store_t, KeyFile<key_t>>::value;
 
     private:
         // in the name of fun and performance
-        struct get_key_pos_visitor : boost::static_visitor<pos_t> {
-            bin_stream_t &m_keys;
-            get_key_pos_visitor(bin_stream_t &keys) : m_keys(keys) {}
-            pos_t operator()(key_info_t val) { return val.second; }
-            pos_t operator()(key_t key) { return m_keys.append(key); }
+        struct get_key_ref_visitor : boost::static_visitor<key_ref_t> {
+            key_store_t &m_keys;
+            get_key_ref_visitor(key_store_t &keys) : m_keys(keys) {}
+            key_ref_t operator()(key_info_t val) { return val.second; }
+            key_ref_t operator()(key_t key) { return m_keys.store(key); }
         };
 
         struct cmp_keys_visitor : boost::static_visitor<bool> {
-            pos_t m_key_pos;
-            bin_stream_t &m_keys;
-            cmp_keys_visitor(pos_t key_pos, bin_stream_t &keys) : m_key_pos(key_pos), m_keys(keys) {}
-            bool operator()(key_t key) { return key == m_keys.read_at<key_t>(m_key_pos); }
-            bool operator()(key_info_t p) { return p.second == m_key_pos; }
+            key_ref_t m_key_ref;
+            const FileHashIndex &m_index;
+            cmp_keys_visitor(key_ref_t key_ref, const FileHashIndex &index) : m_key_ref(key_ref), m_index(index) {}
+            bool operator()(key_t key) { return m_index.keys_equal(m_key_ref, key); }
+            bool operator()(key_info_t p) { return p.second == m_key_ref; }
         };
 
         struct get_hash_visitor : boost::static_visitor<hash_t> {
-            hash_t operator()(key_t key) const { return hasher_t()(key); }
+            const hasher_t &m_hasher;
+            get_hash_visitor(const hasher_t &hasher) : m_hasher(hasher) {}
+            hash_t operator()(key_t key) const { return m_hasher(key); }
             hash_t operator()(key_info_t p) const { return p.first; }
         };
 
-        bool insert(
+        // `value` gets current data only if `assign_existing` and the key is already alive
+        Insertion insert(
                 key_variant_t key,
-                std::function<data_t ()> value,
-                state_t initial_state) {
+                std::function<data_t (const data_t *old)> value,
+                state_t initial_state,
+                bool assign_existing) {
             rehash_if_need();
 
-            hash_t hash = boost::apply_visitor(get_hash_visitor(), key);
+            hash_t hash = boost::apply_visitor(get_hash_visitor(m_hasher), key);
             auto page_pos = get_bucket_pos(hash);
-            Page current_page;
+            uint64_t chain_length = 0;
+            // moving of old records by rehash isn't a lookup
+            auto probed = [&](const Insertion result) {
+                if (key.which() == 0) { m_counters.record_probe(chain_length); }
+                return result;
+            };
+            auto buffer = m_page_buffers.acquire();
+            Page &current_page = *buffer;
             while (true) {
-                m_table.set_pos(page_pos);
-                m_table >> current_page;
+                read_page(page_pos, current_page);
+                chain_length++;
+                prefetch_next(current_page);
 
-                assert(current_page.seg_count <= PageLength);
                 for (size_t i = 0; i < current_page.seg_count; ++i) {
                     Segment &seg = current_page.segs[i];
-                    if (seg.hash == hash) {
-                        auto keys_eq = cmp_keys_visitor(seg.key_adress, m_keys);
+                    if (seg.has_hash(hash)) {
+                        auto keys_eq = cmp_keys_visitor(seg.key_ref(), *this);
                         // if we already have one with such key, let's resurrect it
                         if (boost::apply_visitor(keys_eq, key)) {
-                            if (seg.state == seg_state::dead) { // resurrection
+                            if (seg.state() == seg_state::dead) { // resurrection
                                 // other data are the same
-                                seg.value = value();
-                                seg.state = initial_state;
-                                m_table.write_at(page_pos, current_page);
-                                return true;
+                                seg.value = value(nullptr);
+                                seg.set_state(initial_state);
+                                write_page(page_pos, current_page, seg);
+                                return probed(Insertion::inserted);
                             }
-                            return false;
+                            if (assign_existing) {
+                                seg.value = value(&seg.value);
+                                write_page(page_pos, current_page, seg);
+                                return probed(Insertion::assigned);
+                            }
+                            return probed(Insertion::rejected);
                         }
                     }
                 }
@@ -342,14 +1462,12 @@ namespace details {
                 // ok, it isn't the end of page, we can go on
                 if (current_page.seg_count != PageLength) {
                     Segment &seg = current_page.segs[current_page.seg_count];
-                    auto get_key_pos = get_key_pos_visitor(m_keys);
-                    seg.hash = hash;
-                    seg.key_adress = boost::apply_visitor(get_key_pos, key);
-                    seg.value = value();
-                    seg.state = initial_state;
+                    auto get_key_ref = get_key_ref_visitor(m_keys);
+                    seg.assign(hash, boost::apply_visitor(get_key_ref, key), initial_state);
+                    seg.value = value(nullptr);
                     current_page.seg_count++;
-                    m_table.write_at(page_pos, current_page);
-                    return true;
+                    write_page(page_pos, current_page, seg);
+                    return probed(Insertion::inserted);
                 }
                 else {
                     if (current_page.next_page_pos != 0) {
@@ -357,61 +1475,318 @@ namespace details {
                     }
                     else {
                         // next page need to know where it can put it's adress
-                        pos_t pos_to_connect = page_pos + offsetof(Page, next_page_pos);
-                        page_pos = m_table.append(Page::get_empty());
-                        m_table.write_at(pos_to_connect, page_pos);
+                        current_page.next_page_pos = allocate_overflow(
+                            page_pos, current_page.spare_pages, chain_length
+                        );
+                        current_page.spare_pages = 0;
+                        write_page(page_pos, current_page, 0, 0);
+                        page_pos = current_page.next_page_pos;
                     }
                 }
             }
             assert(!"unreachable code!");
-            return false;
+            return Insertion::rejected;
+        }
+
+        // returns position of a fresh page for the chain which ends at `tail_pos`
+        pos_t allocate_overflow(pos_t tail_pos, uint64_t tail_spare_pages, uint64_t chain_length) {
+            if (tail_spare_pages != 0) {
+                // already reserved by extent and written as empty one with right `spare_pages`
+                return tail_pos + pos_t(sizeof(Page));
+            }
+
+            mark_unclean();
+            auto extent = std::min(chain_length, m_max_overflow_extent);
+            fcl::trace::span_t span("index.overflow", extent);
+            Page page = Page::get_empty();
+            page.spare_pages = extent - 1;
+            page.seal();
+            auto extent_pos = m_table.append(page);
+            while (page.spare_pages != 0) {
+                page.spare_pages--;
+                page.seal();
+                m_table << page;
+            }
+            m_counters.pages_written += extent;
+            return extent_pos;
+        }
+
+        // starts fetching the next page of a chain while we are busy with the current one
+        void prefetch_next(const Page &page) const {
+            if (page.next_page_pos != 0) {
+                m_table_file.will_need(page.next_page_pos, sizeof(Page));
+            }
         }
 
         void init_table(uint64_t initial_bucket_count, const bool overwrite) {
+            // a rehash was cut, verify_and_recover rolls it back
+            if (!overwrite && fs::exists(m_table_path + "_old")) { throw UncleanShutdown(m_table_path); }
             try_to_open(m_table_path, m_table_file, overwrite);
 
             if (overwrite) {
                 m_bucket_count = initial_bucket_count;
-                m_table.goto_begin();
-                m_table << m_bucket_count << m_size << PageLength;
+                write_header();
 
                 // init a number of empty buckets
+                auto empty_page = Page::get_empty();
+                empty_page.seal();
                 for (uint64_t i = 0; i < initial_bucket_count; ++i) {
-                    m_table << Page::get_empty();
+                    m_table << empty_page;
                 }
+                m_counters.pages_written += initial_bucket_count;
+                m_resident_pages.assign(resident_bucket_count(), empty_page);
             }
             else {
                 m_table.goto_begin();
-                m_table >> m_bucket_count >> m_size;
-                auto pageLength = fcl::read_val<uint64_t>(m_table);
-                if (pageLength != PageLength) {
-                    throw IncompatableFormat();
-                }
+                auto header = fcl::read_val<Header>(m_table);
+                if (!is_compatible(header)) { throw IncompatableFormat(); }
+                // a header of another layout may pass by chance, its buckets won't be there then
+                if (m_table_file.size() < get_page_pos(header.bucket_count)) { throw IncompatableFormat(); }
+                if (header.flags & format_flags::unclean) { throw UncleanShutdown(m_table_path); }
+                m_bucket_count = header.bucket_count;
+                m_size = header.size;
+                m_flags = header.flags;
             }
+            m_keys.set_length_prefix(flags_length_prefix(m_flags));
         }
 
-        void init_keys(const bool overwrite) {
-            try_to_open(m_keys_path, m_keys_file, overwrite);
+        void write_header() {
+            m_table.goto_begin();
+            m_table << Header{
+                m_bucket_count, m_size, PageLength, index_format_version, hasher_t::id,
+                fcl::type_signature<key_t>(), DataSignature,
+                m_flags | (m_unclean ? format_flags::unclean : 0)
+            };
+        }
+
+        static bool is_compatible(const Header &header) {
+            return header.page_length == PageLength
+                && header.format_version == index_format_version
+                && header.hasher_id == hasher_t::id
+                && header.key_signature == fcl::type_signature<key_t>()
+                && header.data_signature == DataSignature
+                && (header.flags & ~format_flags::known) == 0
+                && is_power_of_two(header.bucket_count);
+        }
+
+        // header goes to disk marked before the first change of pages and stays so until
+        // the destructor, so a crash in between can't be missed on the next open
+        void mark_unclean() {
+            if (m_unclean) { return; }
+            m_unclean = true;
+            write_header();
+            m_table_file.flush();
+        }
+
+        uint64_t resident_bucket_count() const {
+            return std::min(m_bucket_count, m_resident_limit / sizeof(Page));
+        }
+
+        // buckets are first in the file, so resident pages are from its start
+        bool is_resident(const pos_t page_pos) const {
+            return page_pos < get_page_pos(m_resident_pages.size());
+        }
+
+        static uint64_t page_number(const pos_t page_pos) {
+            return uint64_t(page_pos - get_page_pos(0)) / sizeof(Page);
+        }
+
+        // they are read at once, sequentially
+        void load_resident_pages() {
+            fcl::trace::span_t span("index.load_resident", resident_bucket_count());
+            m_resident_pages.clear();
+            std::vector<Page> pages(resident_bucket_count());
+            for (uint64_t bucket = 0; bucket < pages.size(); ++bucket) {
+                read_page(get_page_pos(bucket), pages[bucket]);
+            }
+            m_resident_pages = std::move(pages);
+        }
+
+        // meta fields and occupied segments, nothing after them is used
+        static void copy_page(const Page &from, Page &to) {
+            std::memcpy(&to, &from, page_meta_size + sizeof(Segment) * from.seg_count);
+        }
+
+        // meta fields first, then only occupied segments: a sparse long page costs a few bytes
+        void read_page(const pos_t page_pos, Page &page) const {
+            m_counters.pages_read++;
+            if (is_resident(page_pos)) {
+                copy_page(m_resident_pages[page_number(page_pos)], page);
+                m_counters.pages_resident++;
+                return;
+            }
+            read_bytes(page_pos, &page, page_meta_size);
+            if (page.seg_count > PageLength) { throw CorruptedPage(m_table_path, page_pos); }
+            read_bytes(page_pos + pos_t(page_meta_size), page.segs, sizeof(Segment) * page.seg_count);
+            if (!page.is_sound()) { throw CorruptedPage(m_table_path, page_pos); }
+        }
+
+        // meta fields and segments [first, last): the rest of the page is in the file already
+        void write_page(const pos_t page_pos, Page &page, const size_t first, const size_t last) {
+            mark_unclean();
+            page.seal();
+            write_bytes(page_pos, &page, page_meta_size);
+            if (first < last) {
+                auto segs_pos = page_pos + pos_t(page_meta_size + sizeof(Segment) * first);
+                write_bytes(segs_pos, &page.segs[first], sizeof(Segment) * (last - first));
+            }
+            m_counters.pages_written++;
+            if (is_resident(page_pos)) { copy_page(page, m_resident_pages[page_number(page_pos)]); }
+        }
+
+        // only meta fields and one segment are changed
+        void write_page(const pos_t page_pos, Page &page, const Segment &seg) {
+            auto i = size_t(&seg - page.segs);
+            write_page(page_pos, page, i, i + 1);
+        }
+
+        void read_bytes(const pos_t pos, void *dst, const size_t count) const {
+            m_table_file.seekg(pos);
+            m_table_file.read(static_cast<char *>(dst), std::streamsize(count));
+            if (m_table_file.eof()) { throw fcl::ReadingAtEOF(); }
+        }
+
+        void write_bytes(const pos_t pos, const void *src, const size_t count) {
+            m_table_file.seekp(pos);
+            m_table_file.write(static_cast<const char *>(src), std::streamsize(count));
+        }
+
+        // segments have only fingerprints, rehash and RecordView need whole hashes
+        hash_t hash_of(const Segment &seg) const {
+            return m_hasher(m_keys.load(seg.key_ref()));
+        }
+
+        bool keys_equal(const key_ref_t &key_ref, const key_t &key) const {
+            m_counters.key_compares++;
+            if (m_keys.equals(key_ref, key)) { return true; }
+            m_counters.false_positives++;
+            return false;
+        }
+
+        // what `verify_and_recover` needs to know about a page to walk through chains
+        struct PageInfo {
+            bool sound = false;
+            uint64_t seg_count = 0;
+            uint64_t alive = 0;
+            pos_t next_page_pos = 0;
+            uint64_t spare_pages = 0;
+            uint64_t bad_segments = 0; // point past the ends of files, they aren't `alive` ones
+
+            void drop(const bool was_alive) {
+                bad_segments++;
+                if (was_alive) { alive--; }
+            }
+        };
+
+        // the segment which points to the last record of keys_idx or data
+        struct LastRecord {
+            int64_t pos = -1;
+            uint64_t page = 0;
+            size_t seg = 0;
+            bool alive = false;
+
+            bool is_in(const LastRecord &other) const {
+                return page == other.page && seg == other.seg;
+            }
+        };
+
+        template <typename KeyCheck, typename DataCheck>
+        static std::vector<PageInfo> scan_pages(
+                const std::string &path,
+                const uint64_t page_count,
+                const KeyCheck &key_check,
+                const DataCheck &data_check,
+                LastRecord &last_key,
+                LastRecord &last_data,
+                unsigned threads) {
+            std::vector<PageInfo> pages(page_count);
+            threads = unsigned(std::max(uint64_t(1), std::min(
+                uint64_t(threads), page_count / min_pages_per_thread
+            )));
+
+            std::vector<LastRecord> last_keys(threads), last_datas(threads);
+            std::vector<std::exception_ptr> errors(threads);
+            auto scan_part = [&](const unsigned part) {
+                try {
+                    auto first = page_count * part / threads;
+                    auto last = page_count * (part + 1) / threads;
+                    file_t file(path, std::ios::in | std::ios::binary);
+                    if (!file) { throw CannotOpenFile(path); }
+                    bin_stream_t stream(file);
+                    stream.set_pos(get_page_pos(first));
+                    Page page;
+                    for (auto i = first; i < last; ++i) {
+                        stream >> page;
+                        auto &info = pages[i];
+                        info.sound = page.is_sound();
+                        if (!info.sound) { continue; }
+                        info.seg_count = page.seg_count;
+                        info.next_page_pos = page.next_page_pos;
+                        info.spare_pages = page.spare_pages;
+                        for (size_t j = 0; j < page.seg_count; ++j) {
+                            const auto &seg = page.segs[j];
+                            auto key_pos = key_check.position(seg.key_ref());
+                            auto data_pos = data_check.position(seg.value);
+                            if ((key_pos >= 0 && !key_check.starts_inside(key_pos))
+                                    || (data_pos >= 0 && !data_check.starts_inside(data_pos))) {
+                                info.bad_segments++;
+                                continue;
+                            }
+                            bool alive = seg.state() == seg_state::alive;
+                            if (alive) { info.alive++; }
+                            if (key_pos > last_keys[part].pos) { last_keys[part] = { key_pos, i, j, alive }; }
+                            if (data_pos > last_datas[part].pos) { last_datas[part] = { data_pos, i, j, alive }; }
+                        }
+                    }
+                }
+                catch (...) {
+                    errors[part] = std::current_exception();
+                }
+            };
+
+            std::vector<std::thread> workers;
+            for (unsigned part = 1; part < threads; ++part) {
+                workers.emplace_back(scan_part, part);
+            }
+            scan_part(0);
+            for (auto &worker : workers) { worker.join(); }
+            for (auto &error : errors) {
+                if (error) { std::rethrow_exception(error); }
+            }
+            for (unsigned part = 0; part < threads; ++part) {
+                if (last_keys[part].pos > last_key.pos) { last_key = last_keys[part]; }
+                if (last_datas[part].pos > last_data.pos) { last_data = last_datas[part]; }
+            }
+            return pages;
         }
 
         // this one different from `const` version in: it's remembers any modifications in segment
         template <typename F> // Functor: Fn<auto (data_t *rec)>
         auto inspect(const key_t &key, const hash_t &hash, F f) {
+            fcl::trace::span_t span("index.inspect");
             auto page_pos = get_bucket_pos(hash);
-            Page current_page;
-            auto nothing = [&f] () { return f(static_cast<Segment *>(nullptr)); };
+            auto buffer = m_page_buffers.acquire();
+            Page &current_page = *buffer;
+            uint64_t depth = 0;
+            auto nothing = [&] () {
+                m_counters.record_probe(depth);
+                span.set_arg(depth);
+                return f(static_cast<Segment *>(nullptr));
+            };
             while (true) {
-                m_table.set_pos(page_pos);
-                m_table >> current_page;
-                assert(current_page.seg_count <= PageLength);
+                read_page(page_pos, current_page);
+                depth++;
+                prefetch_next(current_page);
                 for (size_t i = 0; i < current_page.seg_count; ++i) {
                     Segment &seg = current_page.segs[i];
                     // if it's not alive, just continue searching
-                    if (seg.state != seg_state::alive) { continue; }
-                    if (seg.hash == hash) {
-                        if (get_key(seg.key_adress) == key) {
+                    if (seg.state() != seg_state::alive) { continue; }
+                    if (seg.has_hash(hash)) {
+                        if (keys_equal(seg.key_ref(), key)) {
+                            m_counters.record_probe(depth);
+                            span.set_arg(depth);
                             auto write_at_exit = wheels::finally( // to remember any modifications
-                                [&]() { m_table.write_at(page_pos, current_page); }
+                                [&]() { write_page(page_pos, current_page, seg); }
                             );
                             return f(&seg);
                         }
@@ -428,19 +1803,30 @@ namespace details {
         // same as above, but faster 'cause it can't remember what you have done
         template <typename F> // Functor: Fn<auto (const Segment *rec)>
         auto inspect(const key_t &key, const hash_t &hash, F f) const {
+            fcl::trace::span_t span("index.inspect");
             auto page_pos = get_bucket_pos(hash);
-            auto nothing = [&f] () { return f(static_cast<const Segment *>(nullptr)); };
-            Page current_page;
+            uint64_t depth = 0;
+            auto nothing = [&] () {
+                m_counters.record_probe(depth);
+                span.set_arg(depth);
+                return f(static_cast<const Segment *>(nullptr));
+            };
+            auto buffer = m_page_buffers.acquire();
+            Page &current_page = *buffer;
             while (true) {
-                m_table.set_pos(page_pos);
-                m_table >> current_page;
+                read_page(page_pos, current_page);
+                depth++;
+                prefetch_next(current_page);
 
-                assert(current_page.seg_count <= PageLength);
                 for (size_t i = 0; i < current_page.seg_count; ++i) {
                     const Segment &seg = current_page.segs[i];
-                    if (seg.state != seg_state::alive) continue;
-                    if (seg.hash == hash) {
-                        if (get_key(seg.key_adress) == key) { return f(&seg); }
+                    if (seg.state() != seg_state::alive) continue;
+                    if (seg.has_hash(hash)) {
+                        if (keys_equal(seg.key_ref(), key)) {
+                            m_counters.record_probe(depth);
+                            span.set_arg(depth);
+                            return f(&seg);
+                        }
                     }
                 }
                 if (current_page.next_page_pos == 0) { return nothing(); }
@@ -451,19 +1837,27 @@ namespace details {
         }
 
         pos_t get_bucket_pos(const hash_t hash) const {
-            auto number = calc_bucket_number(hash);
-            auto header_size = sizeof(m_bucket_count) + sizeof(m_size) + sizeof(PageLength);
-            auto bucket_pos = header_size + sizeof(Page) * number;
-            return bucket_pos;
+            return get_page_pos(calc_bucket_number(hash));
+        }
+
+        // buckets go first, so it's a position of a bucket too
+        static pos_t get_page_pos(const uint64_t number) {
+            return pos_t(sizeof(Header) + sizeof(Page) * number);
         }
 
         uint64_t calc_bucket_number(const hash_t hash) const {
-            assert(bucket_count() != 0);
-            return hash % bucket_count(); // simpliest way to do it
+            assert(is_power_of_two(bucket_count()));
+            return hash & (bucket_count() - 1); // bucket count is always power of two
+        }
+
+        static bool is_power_of_two(const uint64_t val) {
+            return val != 0 && (val & (val - 1)) == 0;
         }
 
-        key_t get_key(pos_t key_pos) const {
-            return m_keys.read_at<key_t>(key_pos);
+        static uint64_t round_up_to_power_of_two(uint64_t val) {
+            uint64_t result = 1;
+            while (result < val) { result <<= 1; }
+            return result;
         }
     };
 
@@ -472,10 +1866,53 @@ namespace details {
     public:
         using value_t = Value;
         using pos_t = std::streamoff;
-        using bin_stream_t = fcl::BinIOStreamWrap<std::fstream>;
+        using data_t = pos_t; // what index keeps for a value
+        using bin_stream_t = fcl::BinIOStreamWrap<file_t>;
+
+        // what `data` still has after a crash, see verify_and_recover
+        static RecordsCheck<value_t> records_check(const fs::path &storage_path) {
+            auto prefix = fcl::LengthPrefix::fixed64;
+            if (fs::exists(storage_path) && fs::file_size(storage_path) >= sizeof(Header)) {
+                file_t file(storage_path.string(), std::ios::in | std::ios::binary);
+                fcl::BinIStreamWrap<file_t> stream(file);
+                prefix = flags_length_prefix(fcl::read_val<Header>(stream).flags);
+            }
+            return RecordsCheck<value_t>(storage_path, sizeof(Header), prefix);
+        }
+
+        // a position is signed like any 8-byte pod, so an inline int64 would pass for it
+        static constexpr uint64_t data_signature = fcl::details::hash_mix(
+            fcl::details::hash_mix(fcl::details::fnv_basis, "position in data"), fcl::type_signature<value_t>()
+        );
 
-        FileStorage(const fs::path &storage_path, const bool overwrite) {
+        struct Header {
+            uint64_t format_version;
+            uint64_t value_signature;
+            uint64_t flags;
+        };
+
+        // `value_lengths` matters only for a new storage, an existing one knows it from its header
+        FileStorage(
+                const fs::path &storage_path,
+                const bool overwrite,
+                const fcl::LengthPrefix value_lengths = fcl::LengthPrefix::fixed64) {
             try_to_open(storage_path.string(), m_storage_file, overwrite);
+            auto header = Header{
+                storage_format_version, fcl::type_signature<value_t>(), length_prefix_flags(value_lengths)
+            };
+            if (overwrite) {
+                m_storage << header;
+            }
+            else {
+                auto expected = header;
+                header = fcl::read_val<Header>(m_storage);
+                if (header.format_version != expected.format_version
+                        || header.value_signature != expected.value_signature
+                        || (header.flags & ~format_flags::known) != 0) {
+                    throw IncompatableFormat();
+                }
+            }
+            m_storage.set_length_prefix(flags_length_prefix(header.flags));
         }
 
         ~FileStorage() = default;
@@ -487,68 +1924,1012 @@ namespace details {
         FileStorage &operator =(const FileStorage &) = delete;
 
         value_t get(const pos_t pos) const {
+            fcl::trace::span_t span("data.read", uint64_t(pos));
+            m_counters.values_read++;
             return m_storage.read_at<value_t>(pos);
         }
 
+        // values of a batch are read in the order of the file, not in the order they are asked
+        std::vector<value_t> get_many(const std::vector<pos_t> &positions) const {
+            std::vector<size_t> order(positions.size());
+            for (size_t i = 0; i < order.size(); ++i) { order[i] = i; }
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return positions[a] < positions[b]; });
+            std::vector<value_t> values(positions.size());
+            for (auto i : order) { values[i] = get(positions[i]); }
+            return values;
+        }
+
         pos_t insert(const value_t &val) {
+            fcl::trace::span_t span("data.append");
+            m_counters.values_written++;
             return m_storage.append(val);
         }
 
+        // returns new position of the value: fixed-size values are overwritten in place,
+        // others are appended (old ones become garbage)
+        pos_t assign(const pos_t pos, const value_t &val) {
+            return assign(pos, val, std::is_trivially_copyable<value_t>());
+        }
+
+        void sync() {
+            m_storage_file.sync();
+        }
+
+        const StorageCounters &counters() const {
+            return m_counters;
+        }
+
+        const file_t::Counters &io() const {
+            return m_storage_file.counters();
+        }
+
+        void reset_counters() {
+            m_counters = StorageCounters();
+            m_storage_file.reset_counters();
+        }
+
+    private:
+        pos_t assign(const pos_t pos, const value_t &val, std::true_type /*fixed size*/) {
+            fcl::trace::span_t span("data.write", uint64_t(pos));
+            m_counters.values_written++;
+            m_storage.write_at(pos, val);
+            return pos;
+        }
+
+        pos_t assign(const pos_t, const value_t &val, std::false_type /*fixed size*/) {
+            return insert(val);
+        }
+
     private:
-        mutable std::fstream m_storage_file;
+        mutable file_t m_storage_file;
         mutable bin_stream_t m_storage{ m_storage_file };
+        mutable StorageCounters m_counters;
     };
-}
 
-template <typename Key, typename Value, uint64_t PageLength>
-class HashedFile {
-    using value_t = Value;
-    using opt_value_t = boost::optional<value_t>;
-    using key_t = Key;
-    using pos_t = std::streamoff;
+    // the same interface as FileStorage has, but values just live in the index itself,
+    // so there is no `data` file and `get` doesn't need one more read
+    template <typename Value>
+    class InlineStorage {
+        static_assert(
+            std::is_trivially_copyable<Value>::value,
+            "only trivially copyable values can be kept in the index"
+        );
 
-public:
-    using index_t = details::FileHashIndex<key_t, pos_t, PageLength>;
-    using storage_t = details::FileStorage<value_t>;
+    public:
+        using value_t = Value;
+        using data_t = Value;
 
-public:
-    HashedFile(const details::fs::path &working_dir, bool overwrite)
-        : m_index(working_dir/"hash_idx", working_dir/"keys_idx", overwrite)
-        , m_storage(working_dir/"data", overwrite) {}
+        static constexpr uint64_t data_signature = fcl::type_signature<value_t>();
 
-    ~HashedFile() = default;
+        static NoRecordsCheck records_check(const fs::path &) {
+            return {};
+        }
 
-    HashedFile(HashedFile &&) = default;
-    HashedFile &operator =(HashedFile &&) = default;
+        InlineStorage(const fs::path &, const bool, const fcl::LengthPrefix = fcl::LengthPrefix::fixed64) {}
 
-    HashedFile(const HashedFile &) = delete;
-    HashedFile &operator =(const HashedFile &) = delete;
+        value_t get(const data_t &data) const {
+            return data;
+        }
 
-    bool insert(const key_t &key, const value_t &val) {
-        return m_index.insert(key, std::bind(&storage_t::insert, &m_storage, val));
-    }
+        std::vector<value_t> get_many(const std::vector<data_t> &data) const {
+            return data;
+        }
 
-    opt_value_t get(const key_t &key) const {
-        auto pos_opt = m_index.get(key); // return value only if hash-table said 'yes'
-        if (pos_opt) {
-            return m_storage.get(pos_opt.get());
+        data_t insert(const value_t &val) {
+            return val;
         }
-        else {
-            return boost::none;
+
+        data_t assign(const data_t &, const value_t &val) {
+            return val;
         }
-    }
 
-    bool erase(const key_t &key) {
-        return m_index.erase(key);
-    }
+        void sync() {}
 
-    bool has(const key_t &key) const {
-        return m_index.has(key);
-    }
+        // values are read and written with pages, see index counters
+        const StorageCounters &counters() const {
+            static const StorageCounters nothing;
+            return nothing;
+        }
 
-    size_t size() const {
-        return m_index.size();
-    }
+        const file_t::Counters &io() const {
+            static const file_t::Counters nothing;
+            return nothing;
+        }
+
+        void reset_counters() {}
+    };
+
+    // small trivially copyable values (counters, ids) are kept right in segments
+    template <typename Value>
+    using value_storage_t = typename std::conditional<
+        std::is_trivially_copyable<Value>::value && sizeof(Value) <= 2 * sizeof(std::streamoff),
+        InlineStorage<Value>,
+        FileStorage<Value>
+    >::type;
+
+    // a new file survives a crash only if its directory entry does
+    inline void sync_dir(const fs::path &dir) {
+        auto path = dir.empty() ? fs::path(".") : dir;
+        int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) { throw fcl::IOError("cannot open [" + path.string() + "]", errno); }
+        auto closer = wheels::finally([&] { ::close(fd); });
+        if (::fsync(fd) != 0) { throw fcl::IOError("fsync failed", errno); }
+    }
+
+    // redo log of a write batch: it's on the disk before the batch touches the table and it's
+    // removed after the table is synced, so a batch cut by a crash is applied again on open
+    template <typename Key, typename Value>
+    class BatchLog {
+    public:
+        struct Entry {
+            BatchAction action;
+            Key key;
+            Value value; // nothing for `erase`
+        };
+
+        struct Header {
+            uint64_t format_version;
+            uint64_t key_signature;
+            uint64_t value_signature;
+            uint64_t count;
+            uint64_t length;   // of entries, in bytes
+            uint64_t checksum; // crc32c of entries
+        };
+
+        static void write(const fs::path &path, const std::vector<Entry> &entries) {
+            std::stringstream body;
+            fcl::BinOStreamWrap<std::stringstream> out(body);
+            for (const auto &entry : entries) {
+                out << uint8_t(entry.action) << entry.key << entry.value;
+            }
+            auto bytes = body.str();
+            Header header{
+                batch_log_format_version, fcl::type_signature<Key>(), fcl::type_signature<Value>(),
+                entries.size(), bytes.size(), fcl::crc32c(bytes.data(), bytes.size())
+            };
+
+            file_t file;
+            try_to_open(path.string(), file, true);
+            file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            file.write(bytes.data(), std::streamsize(bytes.size()));
+            file.sync();
+            sync_dir(path.parent_path());
+        }
+
+        // none if there is no log or it's torn: the batch hasn't touched the table then
+        static boost::optional<std::vector<Entry>> read(const fs::path &path) {
+            if (!fs::exists(path)) { return boost::none; }
+            file_t file(path.string(), std::ios::in | std::ios::binary);
+            if (!file) { throw CannotOpenFile(path.string()); }
+            Header header;
+            if (file.size() < int64_t(sizeof(header))) { return boost::none; }
+            file.read(reinterpret_cast<char *>(&header), sizeof(header));
+            if (header.format_version != batch_log_format_version
+                    || header.key_signature != fcl::type_signature<Key>()
+                    || header.value_signature != fcl::type_signature<Value>()) {
+                throw IncompatableFormat();
+            }
+            if (uint64_t(file.size()) != sizeof(header) + header.length) { return boost::none; }
+            std::string bytes(header.length, '\0');
+            file.read(&bytes[0], std::streamsize(bytes.size()));
+            if (fcl::crc32c(bytes.data(), bytes.size()) != header.checksum) { return boost::none; }
+
+            std::stringstream body(bytes);
+            fcl::BinIStreamWrap<std::stringstream> in(body);
+            std::vector<Entry> entries(header.count);
+            for (auto &entry : entries) {
+                uint8_t action;
+                in >> action >> entry.key >> entry.value;
+                entry.action = BatchAction(action);
+            }
+            return entries;
+        }
+    };
+
+    // minimal perfect hash of "hash and displace" kind (CHD, PTHash): hashes are split into
+    // buckets of ~`keys_per_bucket`, and every bucket gets the first pilot which sends all its
+    // hashes to free slots. n hashes take exactly n slots, the pilots are all it keeps
+    class PerfectHash {
+    public:
+        static constexpr uint64_t keys_per_bucket = 4;
+
+        PerfectHash() = default;
+
+        PerfectHash(uint64_t seed, uint64_t slot_count, std::vector<uint32_t> pilots)
+            : m_seed(seed), m_slot_count(slot_count), m_pilots(std::move(pilots)) {}
+
+        // hashes must be distinct, throws HashCollision otherwise
+        static PerfectHash build(const std::vector<uint64_t> &hashes) {
+            {
+                auto sorted = hashes;
+                std::sort(sorted.begin(), sorted.end());
+                if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) { throw HashCollision(); }
+            }
+            // a seed fails only if a bucket finds no pilot at all, another one surely helps
+            for (uint64_t attempt = 1; ; ++attempt) {
+                PerfectHash phf(fcl::details::wymix(attempt, fcl::details::wyp[3]), hashes.size(), {});
+                if (phf.place(hashes)) { return phf; }
+            }
+        }
+
+        uint64_t operator ()(const uint64_t hash) const {
+            return slot(hash, m_pilots[bucket(hash)]);
+        }
+
+        uint64_t seed() const {
+            return m_seed;
+        }
+
+        uint64_t slot_count() const {
+            return m_slot_count;
+        }
+
+        const std::vector<uint32_t> &pilots() const {
+            return m_pilots;
+        }
+
+    private:
+        uint64_t m_seed = 0;
+        uint64_t m_slot_count = 0;
+        std::vector<uint32_t> m_pilots;
+
+        // [0, n) by the high bits, no division
+        static uint64_t reduce(const uint64_t x, const uint64_t n) {
+            return uint64_t((unsigned __int128)x * n >> 64);
+        }
+
+        uint64_t bucket(const uint64_t hash) const {
+            return reduce(hash, m_pilots.size());
+        }
+
+        uint64_t slot(const uint64_t hash, const uint32_t pilot) const {
+            // the multiplier is odd, so it's never zero and wymix never degenerates
+            return reduce(fcl::details::wymix(hash ^ m_seed, (uint64_t(pilot) + 1) * fcl::details::wyp[2]), m_slot_count);
+        }
+
+        // the biggest buckets go first, while almost every slot is free
+        bool place(const std::vector<uint64_t> &hashes) {
+            m_pilots.assign(std::max<uint64_t>(1, (hashes.size() + keys_per_bucket - 1) / keys_per_bucket), 0);
+            std::vector<std::pair<uint64_t, uint64_t>> keyed; // bucket and hash
+            keyed.reserve(hashes.size());
+            for (auto hash : hashes) { keyed.emplace_back(bucket(hash), hash); }
+            std::sort(keyed.begin(), keyed.end());
+
+            std::vector<std::pair<size_t, size_t>> buckets; // first and last of `keyed`
+            for (size_t first = 0, last = 0; first < keyed.size(); first = last) {
+                while (last < keyed.size() && keyed[last].first == keyed[first].first) { last++; }
+                buckets.emplace_back(first, last);
+            }
+            std::stable_sort(buckets.begin(), buckets.end(), [](const auto &a, const auto &b) {
+                return a.second - a.first > b.second - b.first;
+            });
+
+            std::vector<bool> taken(m_slot_count, false);
+            std::vector<uint64_t> slots;
+            for (const auto &range : buckets) {
+                uint32_t pilot = 0;
+                for (;; ++pilot) {
+                    slots.clear();
+                    for (auto i = range.first; i < range.second; ++i) {
+                        auto s = slot(keyed[i].second, pilot);
+                        if (taken[s] || std::find(slots.begin(), slots.end(), s) != slots.end()) { break; }
+                        slots.push_back(s);
+                    }
+                    if (slots.size() == range.second - range.first) { break; }
+                    if (pilot == std::numeric_limits<uint32_t>::max()) { return false; }
+                }
+                m_pilots[keyed[range.first].first] = pilot;
+                for (auto s : slots) { taken[s] = true; }
+            }
+            return true;
+        }
+    };
+
+    // frozen file: header, pilots (u32, padded to 8 bytes), slots (u64) and records.
+    // a slot keeps offset of its record from the first one (high 48 bits) and 16 bits
+    // of the key hash, so most misses don't read records at all
+    struct FrozenHeader {
+        uint64_t format_version;
+        uint64_t hasher_id;
+        uint64_t key_signature;
+        uint64_t value_signature;
+        uint64_t flags;
+        uint64_t size;
+        uint64_t seed;
+        uint64_t bucket_count;
+        uint64_t records_length;
+        uint64_t checksum; // crc32c of the fields above and pilots
+
+        static constexpr uint64_t fingerprint_bits = 16;
+        static constexpr uint64_t fingerprint_mask = (uint64_t(1) << fingerprint_bits) - 1;
+
+        int64_t pilots_pos() const {
+            return int64_t(sizeof(FrozenHeader));
+        }
+
+        int64_t slots_pos() const {
+            return pilots_pos() + int64_t((bucket_count * sizeof(uint32_t) + 7) / 8 * 8);
+        }
+
+        int64_t records_pos() const {
+            return slots_pos() + int64_t(size * sizeof(uint64_t));
+        }
+
+        uint32_t calc_checksum(const std::vector<uint32_t> &pilots) const {
+            auto crc = fcl::crc32c(this, offsetof(FrozenHeader, checksum));
+            return fcl::crc32c(pilots.data(), pilots.size() * sizeof(uint32_t), crc);
+        }
+    };
+
+    // keys which can be kept in order_idx
+    template <typename T, typename = void>
+    struct is_ordered : std::false_type {};
+
+    template <typename T>
+    struct is_ordered<T, decltype(void(std::declval<const T &>() < std::declval<const T &>()))> : std::true_type {};
+
+    // one sorted run of order_idx: distinct keys in order, each alive or a tombstone, then
+    // every `fence_step`-th key with its position (fences, they are kept in memory) and a footer
+    template <typename Key>
+    class SortedRun {
+    public:
+        static constexpr uint64_t fence_step = 64;
+
+        struct Footer {
+            uint64_t format_version;
+            uint64_t key_signature;
+            uint64_t count;
+            uint64_t fences_pos;
+            uint64_t checksum; // crc32c of fences
+        };
+
+        // a position in the run, it reads the run on its own, so there may be many of them
+        class Cursor {
+        public:
+            bool valid() const {
+                return m_valid;
+            }
+
+            const Key &key() const {
+                return m_key;
+            }
+
+            bool alive() const {
+                return m_alive;
+            }
+
+            void next() {
+                m_valid = m_run->read(m_pos, m_key, m_alive);
+            }
+
+        private:
+            friend class SortedRun;
+
+            const SortedRun *m_run = nullptr;
+            int64_t m_pos = 0;
+            Key m_key{};
+            bool m_alive = false;
+            bool m_valid = false;
+        };
+
+        // `next(key, alive)` gives entries in order and returns false after the last one
+        template <typename F> // Functor: Fn<bool (Key &key, bool &alive)>
+        static void write(const fs::path &path, F next) {
+            file_t file;
+            try_to_open(path.string(), file, true);
+            fcl::BinOStreamWrap<file_t> out(file);
+            out.set_length_prefix(fcl::LengthPrefix::varint);
+
+            std::stringstream fences_body;
+            fcl::BinOStreamWrap<std::stringstream> fences(fences_body);
+            fences.set_length_prefix(fcl::LengthPrefix::varint);
+            Footer footer{ order_format_version, fcl::type_signature<Key>(), 0, 0, 0 };
+            Key key{};
+            bool alive = false;
+            while (next(key, alive)) {
+                if (footer.count % fence_step == 0) { fences << key << uint64_t(out.get_opos()); }
+                out << uint8_t(alive) << key;
+                footer.count++;
+            }
+            footer.fences_pos = uint64_t(out.get_opos());
+            auto bytes = fences_body.str();
+            footer.checksum = fcl::crc32c(bytes.data(), bytes.size());
+            file.write(bytes.data(), std::streamsize(bytes.size()));
+            file.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+            file.sync();
+        }
+
+        explicit SortedRun(const fs::path &path) : m_path(path) {
+            m_file.open(path.string(), std::ios::in | std::ios::binary);
+            if (!m_file) { throw CannotOpenFile(path.string()); }
+            if (m_file.size() < int64_t(sizeof(Footer))) { throw IncompatableFormat(); }
+            m_stream.set_length_prefix(fcl::LengthPrefix::varint);
+            m_file.seekg(m_file.size() - int64_t(sizeof(Footer)));
+            m_file.read(reinterpret_cast<char *>(&m_footer), sizeof(m_footer));
+            if (m_footer.format_version != order_format_version
+                    || m_footer.key_signature != fcl::type_signature<Key>()
+                    || m_footer.fences_pos > uint64_t(m_file.size()) - sizeof(Footer)) {
+                throw IncompatableFormat();
+            }
+
+            std::string bytes(uint64_t(m_file.size()) - sizeof(Footer) - m_footer.fences_pos, '\0');
+            m_file.seekg(int64_t(m_footer.fences_pos));
+            m_file.read(&bytes[0], std::streamsize(bytes.size()));
+            if (fcl::crc32c(bytes.data(), bytes.size()) != m_footer.checksum) {
+                throw CorruptedPage(path.string(), int64_t(m_footer.fences_pos));
+            }
+            std::stringstream body(bytes);
+            fcl::BinIStreamWrap<std::stringstream> fences(body);
+            fences.set_length_prefix(fcl::LengthPrefix::varint);
+            m_fences.resize((m_footer.count + fence_step - 1) / fence_step);
+            for (auto &fence : m_fences) { fences >> fence.first >> fence.second; }
+        }
+
+        SortedRun(const SortedRun &) = delete;
+        SortedRun &operator =(const SortedRun &) = delete;
+
+        uint64_t count() const {
+            return m_footer.count;
+        }
+
+        const fs::path &path() const {
+            return m_path;
+        }
+
+        // at the first key which isn't less than `from`
+        Cursor seek(const Key &from) const {
+            auto fence = std::upper_bound(
+                m_fences.begin(), m_fences.end(), from,
+                [](const Key &key, const std::pair<Key, uint64_t> &f) { return key < f.first; }
+            );
+            Cursor cursor = begin();
+            if (fence != m_fences.begin()) {
+                cursor.m_pos = int64_t(std::prev(fence)->second);
+                cursor.next();
+            }
+            while (cursor.valid() && cursor.key() < from) { cursor.next(); }
+            return cursor;
+        }
+
+        Cursor begin() const {
+            Cursor cursor;
+            cursor.m_run = this;
+            cursor.next();
+            return cursor;
+        }
+
+    private:
+        fs::path m_path;
+        mutable file_t m_file;
+        mutable fcl::BinIStreamWrap<file_t> m_stream{ m_file };
+        Footer m_footer{};
+        std::vector<std::pair<Key, uint64_t>> m_fences;
+
+        bool read(int64_t &pos, Key &key, bool &alive) const {
+            if (uint64_t(pos) >= m_footer.fences_pos) { return false; }
+            m_stream.set_ipos(pos);
+            uint8_t mark;
+            m_stream >> mark >> key;
+            alive = mark != 0;
+            pos = m_stream.get_ipos();
+            return true;
+        }
+    };
+
+    // memtable and runs as one sorted sequence: the newest entry of a key hides older ones
+    template <typename Key>
+    class MergeCursor {
+    public:
+        using memtable_t = std::map<Key, bool>; // key and whether it's alive
+
+        // `runs` go from the newest to the oldest, the memtable is newer than all of them
+        MergeCursor(
+                std::shared_ptr<const memtable_t> memtable,
+                std::vector<std::shared_ptr<const SortedRun<Key>>> runs,
+                const Key *from)
+            : m_memtable(std::move(memtable)), m_runs(std::move(runs)) {
+            if (m_memtable) {
+                m_mem_it = from ? m_memtable->lower_bound(*from) : m_memtable->begin();
+            }
+            for (auto &run : m_runs) { m_cursors.push_back(from ? run->seek(*from) : run->begin()); }
+        }
+
+        // tombstones are given too: merged runs have to keep them unless nothing is older
+        bool next(Key &key, bool &alive) {
+            const Key *min = nullptr;
+            if (m_memtable && m_mem_it != m_memtable->end()) {
+                min = &m_mem_it->first;
+                alive = m_mem_it->second;
+            }
+            for (auto &cursor : m_cursors) {
+                if (cursor.valid() && (!min || cursor.key() < *min)) {
+                    min = &cursor.key();
+                    alive = cursor.alive();
+                }
+            }
+            if (!min) { return false; }
+            key = *min;
+
+            if (m_memtable && m_mem_it != m_memtable->end() && !(key < m_mem_it->first)) { ++m_mem_it; }
+            for (auto &cursor : m_cursors) {
+                if (cursor.valid() && !(key < cursor.key())) { cursor.next(); }
+            }
+            return true;
+        }
+
+    private:
+        std::shared_ptr<const memtable_t> m_memtable;
+        typename memtable_t::const_iterator m_mem_it;
+        std::vector<std::shared_ptr<const SortedRun<Key>>> m_runs;
+        std::vector<typename SortedRun<Key>::Cursor> m_cursors;
+    };
+
+    // ordered index over keys of a table (order_idx), a log-structured one: changes go to
+    // the memtable, which becomes a sorted run when it's big enough, and the newest runs are
+    // merged while the older one is at most twice bigger, so there are O(log n) runs.
+    // a manifest lists the runs. it's marked unclean before the table first changes and clean by
+    // `close`, so a crash (and the memtable lost with it) is seen on the next open
+    template <typename Key>
+    class KeyOrder {
+    public:
+        using memtable_t = typename MergeCursor<Key>::memtable_t;
+        using run_t = SortedRun<Key>;
+
+        static constexpr size_t memtable_limit = size_t(1) << 16;
+        // keys sorted in memory at once by `rebuild`
+        static constexpr size_t rebuild_chunk = size_t(1) << 20;
+
+        struct Manifest {
+            uint64_t format_version;
+            uint64_t key_signature;
+            uint64_t flags;
+            uint64_t next_run;
+            uint64_t run_count; // then ids of runs from the oldest one
+        };
+
+        KeyOrder() = default;
+
+        KeyOrder(KeyOrder &&other) noexcept {
+            swap(other);
+        }
+
+        KeyOrder &operator =(KeyOrder &&other) noexcept {
+            swap(other);
+            return *this;
+        }
+
+        KeyOrder(const KeyOrder &) = delete;
+        KeyOrder &operator =(const KeyOrder &) = delete;
+
+        ~KeyOrder() {
+            close();
+        }
+
+        // an index is there only if it was built once. returns false if it was
+        // not closed properly: it's out of date then and has to be rebuilt
+        bool open(const fs::path &dir) {
+            m_dir = dir;
+            if (!fs::exists(manifest_path())) { return true; }
+
+            file_t file(manifest_path().string(), std::ios::in | std::ios::binary);
+            if (!file) { throw CannotOpenFile(manifest_path().string()); }
+            Manifest manifest;
+            file.read(reinterpret_cast<char *>(&manifest), sizeof(manifest));
+            if (file.eof() || manifest.format_version != order_format_version
+                    || manifest.key_signature != fcl::type_signature<Key>()
+                    || (manifest.flags & ~format_flags::known) != 0) {
+                throw IncompatableFormat();
+            }
+            std::vector<uint64_t> ids(manifest.run_count);
+            file.read(reinterpret_cast<char *>(ids.data()), std::streamsize(ids.size() * sizeof(uint64_t)));
+            if (file.eof()) { throw IncompatableFormat(); }
+
+            m_enabled = true;
+            m_next_run = manifest.next_run;
+            m_memtable = std::make_shared<memtable_t>();
+            if (manifest.flags & format_flags::unclean) { return false; }
+            for (auto id : ids) { m_runs.push_back({ id, std::make_shared<run_t>(run_path(id)) }); }
+            return true;
+        }
+
+        // flushes the memtable and marks the index clean
+        void close() {
+            if (!m_enabled) { return; }
+            m_enabled = false;
+            if (!m_unclean) { return; }
+            if (!m_memtable->empty()) { flush(); }
+            m_unclean = false;
+            write_manifest();
+        }
+
+        bool enabled() const {
+            return m_enabled;
+        }
+
+        void insert(const Key &key) {
+            change(key, true);
+        }
+
+        void erase(const Key &key) {
+            change(key, false);
+        }
+
+        // before the table gets a change for the index: a crash between the two is seen by `open`
+        void mark_unclean() {
+            if (!m_enabled || m_unclean) { return; }
+            m_unclean = true;
+            write_manifest();
+        }
+
+        // a new index from `for_each_key(f)`, which calls f(key) for every key of the table:
+        // keys are sorted by chunks into runs, then the runs are merged into one
+        template <typename F> // Functor: Fn<void (Fn<void (const Key &)>)>
+        void rebuild(const fs::path &dir, F for_each_key) {
+            fcl::trace::span_t span("order.rebuild");
+            drop(dir);
+            fs::create_directories(dir);
+            m_dir = dir;
+            m_enabled = true;
+            m_unclean = true; // until the manifest lists the new runs
+            m_memtable = std::make_shared<memtable_t>();
+
+            std::vector<Key> chunk;
+            auto write_chunk = [&] {
+                std::sort(chunk.begin(), chunk.end());
+                // a key can't be twice in a table, but a run mustn't have duplicates anyway
+                chunk.erase(std::unique(chunk.begin(), chunk.end(), [](const Key &a, const Key &b) {
+                    return !(a < b) && !(b < a);
+                }), chunk.end());
+                size_t i = 0;
+                add_run([&](Key &key, bool &alive) {
+                    if (i == chunk.size()) { return false; }
+                    key = chunk[i++];
+                    alive = true;
+                    return true;
+                });
+                chunk.clear();
+            };
+            for_each_key([&](const Key &key) {
+                chunk.push_back(key);
+                if (chunk.size() == rebuild_chunk) { write_chunk(); }
+            });
+            if (!chunk.empty() || m_runs.empty()) { write_chunk(); }
+            while (m_runs.size() > 1) { merge(0, m_runs.size()); }
+
+            m_unclean = false;
+            write_manifest();
+        }
+
+        // removes the index (of `dir`, if this one isn't open)
+        void drop(const fs::path &dir) {
+            m_enabled = false;
+            m_unclean = false;
+            m_runs.clear();
+            m_memtable.reset();
+            fs::remove_all(dir);
+        }
+
+        // keys from `from` (or the first one) in order, tombstones are skipped by the caller.
+        // it sees changes made after it was created or not, but it stays valid
+        MergeCursor<Key> scan(const Key *from) const {
+            std::vector<std::shared_ptr<const run_t>> runs;
+            for (auto it = m_runs.rbegin(); it != m_runs.rend(); ++it) { runs.push_back(it->second); }
+            return MergeCursor<Key>(m_memtable, std::move(runs), from);
+        }
+
+        uint64_t run_count() const {
+            return m_runs.size();
+        }
+
+    private:
+        fs::path m_dir;
+        bool m_enabled = false;
+        bool m_unclean = false;
+        uint64_t m_next_run = 0;
+        // scans keep them alive, so the memtable is replaced, not cleared, when it becomes a run
+        std::shared_ptr<memtable_t> m_memtable;
+        std::vector<std::pair<uint64_t, std::shared_ptr<const run_t>>> m_runs; // from the oldest
+
+        void swap(KeyOrder &other) noexcept {
+            std::swap(m_dir, other.m_dir);
+            std::swap(m_enabled, other.m_enabled);
+            std::swap(m_unclean, other.m_unclean);
+            std::swap(m_next_run, other.m_next_run);
+            std::swap(m_memtable, other.m_memtable);
+            std::swap(m_runs, other.m_runs);
+        }
+
+        fs::path manifest_path() const {
+            return m_dir/"manifest";
+        }
+
+        fs::path run_path(uint64_t id) const {
+            return m_dir/("run_" + std::to_string(id));
+        }
+
+        void change(const Key &key, bool alive) {
+            if (!m_enabled) { return; }
+            mark_unclean();
+            (*m_memtable)[key] = alive;
+            if (m_memtable->size() >= memtable_limit) { flush(); }
+        }
+
+        void flush() {
+            fcl::trace::span_t span("order.flush", m_memtable->size());
+            MergeCursor<Key> memtable(m_memtable, {}, nullptr);
+            add_run([&](Key &key, bool &alive) { return memtable.next(key, alive); });
+            m_memtable = std::make_shared<memtable_t>();
+            while (m_runs.size() > 1
+                   && m_runs[m_runs.size() - 2].second->count() <= 2 * m_runs.back().second->count()) {
+                merge(m_runs.size() - 2, m_runs.size());
+            }
+            write_manifest();
+        }
+
+        template <typename F>
+        void add_run(F next) {
+            auto id = m_next_run++;
+            run_t::write(run_path(id), next);
+            m_runs.push_back({ id, std::make_shared<const run_t>(run_path(id)) });
+        }
+
+        // runs [first, last) become one, tombstones are dropped if nothing is older
+        void merge(size_t first, size_t last) {
+            fcl::trace::span_t span("order.merge", last - first);
+            std::vector<std::shared_ptr<const run_t>> runs;
+            for (auto i = last; i > first; --i) { runs.push_back(m_runs[i - 1].second); }
+            MergeCursor<Key> merged(nullptr, std::move(runs), nullptr);
+            bool oldest = first == 0;
+            auto id = m_next_run++;
+            run_t::write(run_path(id), [&](Key &key, bool &alive) {
+                while (merged.next(key, alive)) {
+                    if (alive || !oldest) { return true; }
+                }
+                return false;
+            });
+
+            std::vector<fs::path> old;
+            for (auto i = first; i < last; ++i) { old.push_back(m_runs[i].second->path()); }
+            m_runs.erase(m_runs.begin() + ptrdiff_t(first), m_runs.begin() + ptrdiff_t(last));
+            m_runs.insert(m_runs.begin() + ptrdiff_t(first), { id, std::make_shared<const run_t>(run_path(id)) });
+            // open scans still read them, unlinked files live while they are open
+            write_manifest();
+            for (auto &path : old) { fs::remove(path); }
+        }
+
+        // a new manifest replaces the old one at once
+        void write_manifest() {
+            Manifest manifest{
+                order_format_version, fcl::type_signature<Key>(), m_unclean ? format_flags::unclean : 0,
+                m_next_run, m_runs.size()
+            };
+            auto tmp_path = manifest_path();
+            tmp_path += ".tmp";
+            {
+                file_t file;
+                try_to_open(tmp_path.string(), file, true);
+                file.write(reinterpret_cast<const char *>(&manifest), sizeof(manifest));
+                for (auto &run : m_runs) { file.write(reinterpret_cast<const char *>(&run.first), sizeof(run.first)); }
+                file.sync();
+            }
+            fs::rename(tmp_path, manifest_path());
+        }
+    };
+
+    // for keys without `operator <`: there is nothing to order, writes don't notice it
+    template <typename Key>
+    class NoKeyOrder {
+    public:
+        bool open(const fs::path &) {
+            return true;
+        }
+
+        void close() {}
+
+        bool enabled() const {
+            return false;
+        }
+
+        void insert(const Key &) {}
+        void erase(const Key &) {}
+        void mark_unclean() {}
+
+        void drop(const fs::path &dir) {
+            fs::remove_all(dir);
+        }
+    };
+
+    template <typename Key>
+    using key_order_t = typename std::conditional<is_ordered<Key>::value, KeyOrder<Key>, NoKeyOrder<Key>>::type;
+}
+
+// inserts and erases which HashedFile::write applies at once: all of them get to the table,
+// even if the process dies in the middle (then they get there on the next open)
+template <typename Key, typename Value>
+class WriteBatch {
+public:
+    // like HashedFile::insert: an existing key keeps its value
+    void insert(const Key &key, const Value &val) {
+        m_ops.push_back({ details::BatchAction::insert, key, val });
+    }
+
+    void insert_or_assign(const Key &key, const Value &val) {
+        m_ops.push_back({ details::BatchAction::assign, key, val });
+    }
+
+    void erase(const Key &key) {
+        m_ops.push_back({ details::BatchAction::erase, key, Value() });
+    }
+
+    size_t size() const {
+        return m_ops.size();
+    }
+
+    bool empty() const {
+        return m_ops.empty();
+    }
+
+    void clear() {
+        m_ops.clear();
+    }
+
+private:
+    template <typename, typename, uint64_t, typename>
+    friend class HashedFile;
+
+    std::vector<typename details::BatchLog<Key, Value>::Entry> m_ops;
+};
+
+template <typename Key, typename Value, uint64_t PageLength, typename Hasher = fcl::WyHash<Key>>
+class HashedFile {
+    using value_t = Value;
+    using opt_value_t = boost::optional<value_t>;
+    using key_t = Key;
+
+public:
+    using storage_t = details::value_storage_t<value_t>;
+    using index_t = details::FileHashIndex<
+        key_t, typename storage_t::data_t, PageLength, Hasher, storage_t::data_signature
+    >;
+    using cache_t = fcl::ValueCache<key_t, value_t, Hasher>;
+
+private:
+    using data_t = typename storage_t::data_t; // position in `data` or the value itself
+    using batch_log_t = details::BatchLog<key_t, value_t>;
+    using batch_entry_t = typename batch_log_t::Entry;
+
+public:
+    static constexpr bool inline_values = std::is_same<storage_t, details::InlineStorage<value_t>>::value;
+
+public:
+    // `lengths` chooses how sizes of keys and values are stored in a new table: LengthPrefix::varint
+    // saves up to 7 bytes per string. existing table is opened the way it was created
+    HashedFile(
+            const details::fs::path &working_dir,
+            bool overwrite,
+            fcl::LengthPrefix lengths = fcl::LengthPrefix::fixed64)
+        : m_index(working_dir/"hash_idx", working_dir/"keys_idx", overwrite, lengths)
+        , m_storage(working_dir/"data", overwrite, lengths)
+        , m_batch_log_path(working_dir/"batch_log")
+        , m_order_dir(working_dir/"order_idx") {
+        if (overwrite) { m_order.drop(m_order_dir); }
+        // it's out of date after a crash, the whole of it is built again
+        bool order_is_fresh = m_order.open(m_order_dir);
+        if (!overwrite) {
+            // the last batch was cut by a crash, it's applied again
+            auto entries = batch_log_t::read(m_batch_log_path);
+            if (entries) { apply(*entries); }
+        }
+        details::fs::remove(m_batch_log_path);
+        if (!order_is_fresh) { rebuild_order(details::is_ordered<key_t>()); }
+    }
+
+    ~HashedFile() = default;
+
+    HashedFile(HashedFile &&) = default;
+    HashedFile &operator =(HashedFile &&) = default;
+
+    HashedFile(const HashedFile &) = delete;
+    HashedFile &operator =(const HashedFile &) = delete;
+
+    bool insert(const key_t &key, const value_t &val) {
+        auto timer = m_index.latencies_timer(details::Operation::insert);
+        m_order.mark_unclean();
+        auto inserted = m_index.insert(key, std::bind(&storage_t::insert, &m_storage, val));
+        if (inserted) { m_order.insert(key); }
+        return inserted;
+    }
+
+    // returns true if the key was inserted and false if it already existed and got the new value
+    bool insert_or_assign(const key_t &key, const value_t &val) {
+        auto timer = m_index.latencies_timer(details::Operation::upsert);
+        m_cache.invalidate(key);
+        m_order.mark_unclean();
+        auto inserted = m_index.upsert(
+            key,
+            [&](const data_t *old) {
+                return old ? m_storage.assign(*old, val) : m_storage.insert(val);
+            }
+        );
+        if (inserted) { m_order.insert(key); }
+        return inserted;
+    }
+
+    // read-modify-write with a single index probe: `make_value` gets current value (if any)
+    template <typename F> // Functor: Fn<value_t (const opt_value_t &old)>
+    bool upsert(const key_t &key, F make_value) {
+        auto timer = m_index.latencies_timer(details::Operation::upsert);
+        m_cache.invalidate(key);
+        m_order.mark_unclean();
+        auto inserted = m_index.upsert(
+            key,
+            [&](const data_t *old) {
+                if (!old) { return m_storage.insert(make_value(opt_value_t())); }
+                auto new_value = make_value(opt_value_t(m_storage.get(*old)));
+                return m_storage.assign(*old, new_value);
+            }
+        );
+        if (inserted) { m_order.insert(key); }
+        return inserted;
+    }
+
+    // returns false (and changes nothing) if there is no such key
+    bool update(const key_t &key, const value_t &val) {
+        auto timer = m_index.latencies_timer(details::Operation::update);
+        m_cache.invalidate(key);
+        return m_index.update(
+            key,
+            [&](const data_t &old) { return m_storage.assign(old, val); }
+        );
+    }
+
+    opt_value_t get(const key_t &key) const {
+        auto timer = m_index.latencies_timer(details::Operation::get);
+        if (m_cache.enabled()) {
+            auto cached = m_cache.get(key);
+            if (cached) { return *cached; }
+        }
+        auto data_opt = m_index.get(key); // return value only if hash-table said 'yes'
+        if (data_opt) {
+            auto value = m_storage.get(data_opt.get());
+            m_cache.put(key, value);
+            return value;
+        }
+        else {
+            return boost::none;
+        }
+    }
+
+    bool erase(const key_t &key) {
+        auto timer = m_index.latencies_timer(details::Operation::erase);
+        m_cache.invalidate(key);
+        m_order.mark_unclean();
+        auto erased = m_index.erase(key);
+        if (erased) { m_order.erase(key); }
+        return erased;
+    }
+
+    // the table grows at most once and every touched chain is read and written once.
+    // the batch is logged before and the table is synced after, so if the process dies
+    // in the middle, the batch is applied again by the next open (after verify_and_recover)
+    void write(const WriteBatch<key_t, value_t> &batch) {
+        auto timer = m_index.latencies_timer(details::Operation::batch);
+        if (batch.empty()) { return; }
+        auto entries = resolve(fold(batch.m_ops));
+        if (entries.empty()) { return; }
+        batch_log_t::write(m_batch_log_path, entries);
+        apply(entries);
+        details::fs::remove(m_batch_log_path);
+    }
+
+    bool has(const key_t &key) const {
+        auto timer = m_index.latencies_timer(details::Operation::has);
+        return m_cache.contains(key) || m_index.has(key);
+    }
+
+    size_t size() const {
+        return m_index.size();
+    }
 
     bool empty() const {
         return size() == 0;
@@ -558,6 +2939,32 @@ public:
         return m_index;
     }
 
+    const storage_t &storage() const {
+        return m_storage;
+    }
+
+    // values of popular keys are kept in memory, up to `bytes` (0 turns it off, as it's by default).
+    // gets of them don't read any file
+    void set_cache_capacity(size_t bytes) {
+        m_cache.set_capacity(bytes);
+    }
+
+    const cache_t &cache() const {
+        return m_cache;
+    }
+
+    // counters of the index, of the storage and of all their files
+    void reset_counters() {
+        m_index.reset_counters();
+        m_storage.reset_counters();
+        m_cache.reset_counters();
+    }
+
+    // keeps bucket pages of the index in memory, up to `bytes`, see FileHashIndex::set_resident_memory
+    void set_resident_memory(uint64_t bytes) {
+        m_index.set_resident_memory(bytes);
+    }
+
     void set_load_factor_threshold(float new_threshold) {
         m_index.set_max_load_factor(new_threshold);
     }
@@ -566,7 +2973,374 @@ public:
         return m_index.load_factor();
     }
 
+    // rebuilds the index with as few buckets as its load factor allows
+    void shrink_to_fit() {
+        m_index.shrink_to_fit();
+    }
+
+    // ordered index over keys (order_idx) for `range_scan` and `prefix_scan`: it's built from
+    // the table once, then every write keeps it up to date (and it's built again after a crash).
+    // until then it costs nothing. keys need `operator <`
+    void build_ordered_index() {
+        static_assert(details::is_ordered<key_t>::value, "keys without operator < can't be ordered");
+        rebuild_order(std::true_type());
+    }
+
+    void drop_ordered_index() {
+        m_order.drop(m_order_dir);
+    }
+
+    bool has_ordered_index() const {
+        return m_order.enabled();
+    }
+
+    // records of a range in the order of keys, batch by batch. values of a batch are read
+    // in the order of the data file. writes don't break a scan, but it may miss their keys
+    class Scan {
+    public:
+        static constexpr size_t default_batch = 256;
+
+        // false when there is nothing more
+        bool next(std::vector<std::pair<key_t, value_t>> &batch, size_t max_batch = default_batch) {
+            fcl::trace::span_t span("order.scan");
+            batch.clear();
+            std::vector<key_t> keys;
+            std::vector<data_t> data;
+            key_t key;
+            bool alive;
+            while (!m_done && keys.size() < max_batch) {
+                if (!m_cursor.next(key, alive) || (m_to && !(key < *m_to))) {
+                    m_done = true;
+                    break;
+                }
+                if (!alive) { continue; }
+                // order_idx may still have keys which verify_and_recover has dropped
+                auto found = m_table->m_index.get(key);
+                if (!found) { continue; }
+                keys.push_back(std::move(key));
+                data.push_back(*found);
+            }
+            auto values = m_table->m_storage.get_many(data);
+            for (size_t i = 0; i < keys.size(); ++i) { batch.emplace_back(std::move(keys[i]), std::move(values[i])); }
+            span.set_arg(batch.size());
+            return !batch.empty();
+        }
+
+    private:
+        friend class HashedFile;
+
+        Scan(const HashedFile &table, const key_t *from, boost::optional<key_t> to)
+            : m_table(&table), m_cursor(table.m_order.scan(from)), m_to(std::move(to)) {}
+
+        const HashedFile *m_table;
+        details::MergeCursor<key_t> m_cursor;
+        boost::optional<key_t> m_to;
+        bool m_done = false;
+    };
+
+    // keys in [from, to), or all the keys from `from` without `to`
+    Scan range_scan(const key_t &from, const boost::optional<key_t> &to = boost::none) const {
+        check_order();
+        return Scan(*this, &from, to);
+    }
+
+    // all the keys in order
+    Scan scan() const {
+        check_order();
+        return Scan(*this, nullptr, boost::none);
+    }
+
+    // keys which start with `prefix`
+    template <typename K = key_t>
+    typename std::enable_if<std::is_same<K, std::string>::value, Scan>::type
+    prefix_scan(const key_t &prefix) const {
+        check_order();
+        // the first string after all those with the prefix: chars are compared as unsigned ones
+        auto to = prefix;
+        while (!to.empty() && static_cast<unsigned char>(to.back()) == 0xff) { to.pop_back(); }
+        if (to.empty()) { return Scan(*this, &prefix, boost::none); }
+        to.back() = char(static_cast<unsigned char>(to.back()) + 1);
+        return Scan(*this, &prefix, to);
+    }
+
+    // writes a read-only copy of the table to the file `path`, FrozenFile opens it.
+    // the table is read twice: hashes for the perfect hash first, then keys and values.
+    // the file appears at once (by rename), so a crash leaves either the old one or the new one
+    void freeze(const details::fs::path &path) const {
+        std::vector<uint64_t> hashes;
+        hashes.reserve(size());
+        m_index.for_each([&](const typename index_t::RecordView &record) { hashes.push_back(record.hash()); });
+        auto phf = details::PerfectHash::build(hashes);
+        hashes = std::vector<uint64_t>();
+
+        details::FrozenHeader header{
+            details::frozen_format_version, Hasher::id, fcl::type_signature<key_t>(),
+            fcl::type_signature<value_t>(), details::format_flags::varint_lengths, phf.slot_count(),
+            phf.seed(), phf.pilots().size(), 0, 0
+        };
+        auto tmp_path = path;
+        tmp_path += ".tmp";
+        details::file_t file;
+        details::try_to_open(tmp_path.string(), file, true);
+        auto cleanup = wheels::finally([&] {
+            if (file.is_open()) {
+                file.close();
+                details::fs::remove(tmp_path);
+            }
+        });
+
+        // records are packed one after another in the order of the table
+        std::vector<uint64_t> slots(phf.slot_count());
+        fcl::BinOStreamWrap<details::file_t> records(file);
+        records.set_length_prefix(fcl::LengthPrefix::varint);
+        records.set_opos(header.records_pos());
+        m_index.for_each([&](const typename index_t::RecordView &record) {
+            auto offset = uint64_t(records.get_opos() - header.records_pos());
+            if (offset >> (64 - details::FrozenHeader::fingerprint_bits)) {
+                throw std::length_error("frozen table is too big");
+            }
+            auto hash = record.hash(); // it loads the key
+            slots[phf(hash)] = offset << details::FrozenHeader::fingerprint_bits
+                | (hash & details::FrozenHeader::fingerprint_mask);
+            records << record.key() << m_storage.get(record.data());
+        });
+        header.records_length = uint64_t(records.get_opos() - header.records_pos());
+        header.checksum = header.calc_checksum(phf.pilots());
+
+        file.seekp(0);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(phf.pilots().data()),
+                   std::streamsize(phf.pilots().size() * sizeof(uint32_t)));
+        const char padding[8] = {};
+        file.write(padding, header.slots_pos() - file.tellp());
+        file.write(reinterpret_cast<const char *>(slots.data()), std::streamsize(slots.size() * sizeof(uint64_t)));
+        file.sync();
+        file.close();
+        details::fs::rename(tmp_path, path);
+        details::sync_dir(path.parent_path());
+    }
+
+    // it's always here, but it's empty unless built with FCL_LATENCY_STATS
+    const fcl::LatencyHistogram &latency(const details::Operation op) const {
+        return m_index.latencies()[op];
+    }
+
+    void reset_latencies() {
+        m_index.reset_latencies();
+    }
+
+    // run it on a closed table if opening has thrown details::UncleanShutdown (process died)
+    static details::RecoveryReport verify_and_recover(
+            const details::fs::path &working_dir,
+            unsigned threads = std::thread::hardware_concurrency()) {
+        return index_t::verify_and_recover(
+            working_dir/"hash_idx", working_dir/"keys_idx", storage_t::records_check(working_dir/"data"), threads
+        );
+    }
+
 private:
     index_t m_index;
     storage_t m_storage;
+    details::fs::path m_batch_log_path;
+    details::fs::path m_order_dir;
+    details::key_order_t<key_t> m_order;
+    mutable cache_t m_cache;
+
+    void rebuild_order(std::true_type /*ordered keys*/) {
+        m_order.rebuild(m_order_dir, [&](auto add) {
+            m_index.for_each([&](const typename index_t::RecordView &record) { add(record.key()); });
+        });
+    }
+
+    void rebuild_order(std::false_type /*ordered keys*/) {}
+
+    void check_order() const {
+        static_assert(details::is_ordered<key_t>::value, "keys without operator < can't be scanned");
+        if (!m_order.enabled()) { throw details::NoOrderedIndex(); }
+    }
+
+    // one entry per key with the same effect as all the operations on it in their order.
+    // operations are sorted by hash (and then by order), so equal keys are neighbours
+    static std::vector<batch_entry_t> fold(const std::vector<batch_entry_t> &ops) {
+        Hasher hasher;
+        std::vector<std::pair<uint64_t, size_t>> order; // hash and position
+        order.reserve(ops.size());
+        for (size_t i = 0; i < ops.size(); ++i) { order.emplace_back(hasher(ops[i].key), i); }
+        std::sort(order.begin(), order.end());
+
+        std::vector<batch_entry_t> entries;
+        entries.reserve(ops.size());
+        size_t same_hash = 0; // first entry with the hash of the current operation
+        for (size_t k = 0; k < order.size(); ++k) {
+            if (k == 0 || order[k].first != order[k - 1].first) { same_hash = entries.size(); }
+            const auto &op = ops[order[k].second];
+            auto entry_it = std::find_if(
+                entries.begin() + ptrdiff_t(same_hash), entries.end(),
+                [&](const batch_entry_t &entry) { return entry.key == op.key; }
+            );
+            if (entry_it == entries.end()) {
+                entries.push_back(op);
+                continue;
+            }
+            auto &entry = *entry_it;
+            switch (op.action) {
+            case details::BatchAction::insert:
+                // the key is there after anything but erase
+                if (entry.action == details::BatchAction::erase) {
+                    entry.action = details::BatchAction::assign;
+                    entry.value = op.value;
+                }
+                break;
+            case details::BatchAction::assign:
+                entry.action = details::BatchAction::assign;
+                entry.value = op.value;
+                break;
+            case details::BatchAction::erase:
+                entry.action = details::BatchAction::erase;
+                break;
+            }
+        }
+        return entries;
+    }
+
+    // inserts become assigns of missing keys or go away, so only assigns and erases are logged:
+    // they give the same table whether they were partly applied before or not
+    std::vector<batch_entry_t> resolve(std::vector<batch_entry_t> entries) const {
+        size_t kept = 0;
+        for (auto &entry : entries) {
+            if (entry.action == details::BatchAction::insert) {
+                if (m_index.has(entry.key)) { continue; }
+                entry.action = details::BatchAction::assign;
+            }
+            if (&entries[kept] != &entry) { entries[kept] = std::move(entry); }
+            kept++;
+        }
+        entries.resize(kept);
+        return entries;
+    }
+
+    // entries are resolved ones, see `resolve`
+    void apply(const std::vector<batch_entry_t> &entries) {
+        std::vector<typename index_t::BatchItem> items;
+        items.reserve(entries.size());
+        for (const auto &entry : entries) {
+            items.push_back({ &entry.key, entry.action });
+            m_cache.invalidate(entry.key);
+        }
+        m_order.mark_unclean();
+        m_index.apply_batch(
+            items,
+            [&](size_t i, const data_t *old) {
+                return old ? m_storage.assign(*old, entries[i].value) : m_storage.insert(entries[i].value);
+            },
+            [&] { m_storage.sync(); }
+        );
+        // an erase of a missing key changes nothing there
+        for (const auto &entry : entries) {
+            if (entry.action == details::BatchAction::erase) { m_order.erase(entry.key); }
+            else { m_order.insert(entry.key); }
+        }
+        m_index.sync(); // data went to the disk before the pages
+    }
+};
+
+template <typename Key, typename Value, uint64_t PageLength, typename Hasher>
+constexpr bool HashedFile<Key, Value, PageLength, Hasher>::inline_values;
+
+/*!
+ * \brief Read-only table made by HashedFile::freeze.
+ *
+ * There are no pages, chains or dead records: a minimal perfect hash (its pilots are in memory,
+ * a few bits per key) gives the only slot a key may be in, and the slot gives the record.
+ * So a lookup reads one slot and then, if 16 bits of the hash match, one record.
+ */
+template <typename Key, typename Value, typename Hasher = fcl::WyHash<Key>>
+class FrozenFile {
+    using key_t = Key;
+    using value_t = Value;
+    using opt_value_t = boost::optional<value_t>;
+    using bin_stream_t = fcl::BinIStreamWrap<details::file_t>;
+
+public:
+    explicit FrozenFile(const details::fs::path &path) : m_path(path.string()) {
+        m_file.open(m_path, std::ios::in | std::ios::binary);
+        if (!m_file) { throw details::CannotOpenFile(m_path); }
+        if (m_file.size() < int64_t(sizeof(m_header))) { throw details::IncompatableFormat(); }
+        m_file.read(reinterpret_cast<char *>(&m_header), sizeof(m_header));
+        if (m_header.format_version != details::frozen_format_version
+                || m_header.hasher_id != Hasher::id
+                || m_header.key_signature != fcl::type_signature<key_t>()
+                || m_header.value_signature != fcl::type_signature<value_t>()
+                || (m_header.flags & ~details::format_flags::known) != 0
+                || m_file.size() != m_header.records_pos() + int64_t(m_header.records_length)) {
+            throw details::IncompatableFormat();
+        }
+
+        std::vector<uint32_t> pilots(m_header.bucket_count);
+        m_file.read(reinterpret_cast<char *>(pilots.data()), std::streamsize(pilots.size() * sizeof(uint32_t)));
+        if (m_header.calc_checksum(pilots) != m_header.checksum) {
+            throw details::CorruptedPage(m_path, m_header.pilots_pos());
+        }
+        m_phf = details::PerfectHash(m_header.seed, m_header.size, std::move(pilots));
+        m_records.set_length_prefix(details::flags_length_prefix(m_header.flags));
+        m_file.reset_counters();
+    }
+
+    FrozenFile(FrozenFile &&) = default;
+    FrozenFile &operator =(FrozenFile &&) = default;
+
+    FrozenFile(const FrozenFile &) = delete;
+    FrozenFile &operator =(const FrozenFile &) = delete;
+
+    opt_value_t get(const key_t &key) const {
+        return find(key, [&]() { return fcl::read_val<value_t>(m_records); });
+    }
+
+    bool has(const key_t &key) const {
+        return find(key, []() { return true; }).is_initialized();
+    }
+
+    size_t size() const {
+        return m_header.size;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // bytes of pilots and slots, records aren't counted
+    uint64_t index_size() const {
+        return uint64_t(m_header.records_pos() - m_header.pilots_pos());
+    }
+
+    const details::file_t::Counters &io() const {
+        return m_file.counters();
+    }
+
+    void reset_counters() {
+        m_file.reset_counters();
+    }
+
+private:
+    Hasher m_hasher{};
+    std::string m_path;
+    details::FrozenHeader m_header{};
+    details::PerfectHash m_phf;
+    mutable details::file_t m_file;
+    mutable bin_stream_t m_records{ m_file };
+
+    // `read_rest` reads what follows the key of the record, if it's the right one
+    template <typename F> // Functor: Fn<T ()>
+    auto find(const key_t &key, F read_rest) const -> boost::optional<decltype(read_rest())> {
+        if (m_header.size == 0) { return boost::none; }
+        auto hash = m_hasher(key);
+        auto slot = m_records.template read_at<uint64_t>(m_header.slots_pos() + int64_t(sizeof(uint64_t) * m_phf(hash)));
+        if ((slot & details::FrozenHeader::fingerprint_mask) != (hash & details::FrozenHeader::fingerprint_mask)) {
+            return boost::none;
+        }
+        fcl::trace::span_t span("frozen.read");
+        m_records.set_ipos(m_header.records_pos() + int64_t(slot >> details::FrozenHeader::fingerprint_bits));
+        if (fcl::read_val<key_t>(m_records) != key) { return boost::none; }
+        return read_rest();
+    }
 };
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+namespace fcl {
+
+/*!
+ * \brief Histogram of latencies (or any other non-negative integers) with HDR-style buckets:
+ * every power of two is split into `sub_buckets` equal parts, so any value is known with
+ * relative error below 1/sub_buckets, while the whole uint64_t range takes ~500 counters.
+ * Recording is a couple of bit operations and one increment.
+ */
+class LatencyHistogram {
+public:
+    static constexpr unsigned sub_bucket_bits = 3;
+    static constexpr uint64_t sub_buckets = uint64_t(1) << sub_bucket_bits;
+    static constexpr size_t bucket_count = sub_buckets * (64 - sub_bucket_bits + 1);
+
+    void record(uint64_t value) {
+        m_counts[bucket_of(value)]++;
+        m_count++;
+        m_sum += value;
+        m_max = std::max(m_max, value);
+    }
+
+    uint64_t count() const {
+        return m_count;
+    }
+
+    uint64_t max() const {
+        return m_max;
+    }
+
+    double mean() const {
+        return m_count == 0 ? 0.0 : double(m_sum) / double(m_count);
+    }
+
+    // `q` in [0, 1]. it's the upper bound of a bucket, so it's never less than real one
+    uint64_t percentile(double q) const {
+        if (m_count == 0) { return 0; }
+        auto rank = uint64_t(std::ceil(q * double(m_count)));
+        rank = std::min(std::max(rank, uint64_t(1)), m_count);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucket_count; ++i) {
+            seen += m_counts[i];
+            if (seen >= rank) { return std::min(upper_bound_of(i), m_max); }
+        }
+        return m_max;
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (size_t i = 0; i < bucket_count; ++i) { m_counts[i] += other.m_counts[i]; }
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        m_max = std::max(m_max, other.m_max);
+    }
+
+    void reset() {
+        *this = LatencyHistogram();
+    }
+
+    // raw access for those who want to dump the whole distribution
+    uint64_t bucket_size(size_t bucket) const {
+        return m_counts[bucket];
+    }
+
+    static size_t bucket_of(uint64_t value) {
+        if (value < sub_buckets) { return size_t(value); }
+        unsigned exponent = 63u - unsigned(__builtin_clzll(value)); // >= sub_bucket_bits
+        unsigned shift = exponent - sub_bucket_bits;
+        auto mantissa = (value >> shift) & (sub_buckets - 1);
+        return size_t(sub_buckets * (shift + 1) + mantissa);
+    }
+
+    static uint64_t upper_bound_of(size_t bucket) {
+        if (bucket < sub_buckets) { return bucket; }
+        auto shift = unsigned(bucket / sub_buckets - 1);
+        auto mantissa = bucket % sub_buckets;
+        auto lower = (sub_buckets + mantissa) << shift;
+        return lower + ((uint64_t(1) << shift) - 1);
+    }
+
+private:
+    std::array<uint64_t, bucket_count> m_counts{};
+    uint64_t m_count = 0;
+    uint64_t m_sum = 0;
+    uint64_t m_max = 0;
+};
+
+} // namespace fcl
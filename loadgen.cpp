@@ -0,0 +1,228 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <exception>
+
+#include "bench_utils.hpp"
+#include "latency_histogram.hpp"
+#include "client.hpp"
+
+
+// drives a running `server`: every client thread has its own connection and keeps `depth`
+// requests in flight. latency of a request is from its flush to its answer, so it includes
+// waiting behind the requests before it in the pipeline
+struct Options {
+    std::string socket;
+    unsigned clients = 4;
+    size_t depth = 16;
+    uint64_t ops = 1000000; // of all clients together
+    uint64_t records = 100000;
+    bool load = true;
+    size_t load_batch = 1000;
+    double read = 0.9;      // the rest are insert_or_assigns
+    std::string access = "zipf";
+    bench::SizeRange key_size{ 16, 16 };
+    bench::SizeRange value_size{ 100, 100 };
+    uint64_t seed = 42;
+};
+
+void print_usage(std::ostream &out) {
+    out << "usage: loadgen --socket P [options]\n"
+        << "  --socket P          where the server listens\n"
+        << "  --clients N         connections, one thread each (4)\n"
+        << "  --depth N           requests in flight per connection (16)\n"
+        << "  --ops N             requests of all clients together (1000000)\n"
+        << "  --records N         keys to work on (100000)\n"
+        << "  --no-load           records are there already, don't insert them first\n"
+        << "  --load-batch N      records per batch while loading (1000)\n"
+        << "  --read R            share of gets, the rest are insert_or_assigns (0.9)\n"
+        << "  --access P          uniform | zipf[:theta] | latest[:theta] |\n"
+        << "                      hotspot[:hot_fraction[:hot_ops]] (zipf)\n"
+        << "  --key-size A[:B]    key length, at least 7 (16)\n"
+        << "  --value-size A[:B]  value length (100)\n"
+        << "  --seed S            seed of all generators (42)\n";
+}
+
+Options parse_options(int argc, char **argv) {
+    Options opts;
+    bench::setters_t setters = {
+        { "--socket", [&](const std::string &v) { opts.socket = v; } },
+        { "--clients", [&](const std::string &v) { opts.clients = unsigned(std::stoul(v)); } },
+        { "--depth", [&](const std::string &v) { opts.depth = std::stoull(v); } },
+        { "--ops", [&](const std::string &v) { opts.ops = std::stoull(v); } },
+        { "--records", [&](const std::string &v) { opts.records = std::stoull(v); } },
+        { "--load-batch", [&](const std::string &v) { opts.load_batch = std::stoull(v); } },
+        { "--read", [&](const std::string &v) { opts.read = std::stod(v); } },
+        { "--access", [&](const std::string &v) { bench::AccessPattern::parse(v); opts.access = v; } },
+        { "--key-size", [&](const std::string &v) { opts.key_size = bench::SizeRange::parse(v); } },
+        { "--value-size", [&](const std::string &v) { opts.value_size = bench::SizeRange::parse(v); } },
+        { "--seed", [&](const std::string &v) { opts.seed = std::stoull(v); } },
+    };
+    bench::flags_t flags = {
+        { "--no-load", [&] { opts.load = false; } },
+    };
+
+    bench::parse_options(argc, argv, setters, flags, print_usage);
+
+    if (opts.socket.empty()) { throw bench::BadOption("--socket is needed"); }
+    if (opts.clients == 0 || opts.depth == 0 || opts.records == 0 || opts.load_batch == 0) {
+        throw bench::BadOption("--clients, --depth, --records and --load-batch must be positive");
+    }
+    if (opts.read < 0 || opts.read > 1) { throw bench::BadOption("--read must be in [0, 1]"); }
+    return opts;
+}
+
+struct ClientResult {
+    fcl::LatencyHistogram gets;
+    fcl::LatencyHistogram writes;
+    uint64_t misses = 0;
+    uint64_t errors = 0;
+};
+
+double us(double ns) {
+    return ns / 1000.0;
+}
+
+void print_row(std::ostream &out, const char *name, double seconds, const fcl::LatencyHistogram &histogram) {
+    if (histogram.count() == 0) { return; }
+    out << std::left << std::setw(8) << name << std::right << std::fixed
+        << std::setprecision(0)
+        << std::setw(12) << double(histogram.count())
+        << std::setw(12) << double(histogram.count()) / seconds
+        << std::setprecision(2)
+        << std::setw(12) << us(histogram.mean())
+        << std::setw(12) << us(double(histogram.percentile(0.5)))
+        << std::setw(12) << us(double(histogram.percentile(0.99)))
+        << std::setw(12) << us(double(histogram.percentile(0.999)))
+        << std::setw(12) << us(double(histogram.max())) << std::endl;
+}
+
+void run(const Options &opts) {
+    using bench::bench_clock_t;
+    bench::KeyGenerator keys(opts.records, opts.key_size, opts.seed);
+
+    if (opts.load) {
+        auto start = bench_clock_t::now();
+        fcl::Client client(opts.socket);
+        bench::rng_t rng(opts.seed);
+        std::vector<fcl::proto::BatchOp> ops;
+        for (uint64_t i = 0; i < opts.records; ++i) {
+            ops.push_back({ fcl::proto::Action::insert_or_assign, keys(i),
+                            bench::random_string(rng, opts.value_size(rng)) });
+            if (ops.size() == opts.load_batch || i + 1 == opts.records) {
+                client.send_batch(ops);
+                ops.clear();
+            }
+            // a few batches in flight, so the server always has the next one
+            while (client.pending() == 4 || (i + 1 == opts.records && client.pending() > 0)) {
+                auto response = client.receive();
+                if (response.status == fcl::proto::Status::error) { throw fcl::ServerError(response.value); }
+            }
+        }
+        auto seconds = std::chrono::duration<double>(bench_clock_t::now() - start).count();
+        std::cout << "loaded " << opts.records << " records in " << std::setprecision(3) << seconds << " s" << std::endl;
+    }
+
+    std::vector<ClientResult> results(opts.clients);
+    std::vector<std::exception_ptr> errors(opts.clients);
+    auto client_body = [&](unsigned id) {
+        auto my_ops = opts.ops / opts.clients + (id < opts.ops % opts.clients ? 1 : 0);
+        auto &result = results[id];
+        bench::rng_t rng(opts.seed + 1 + id);
+        auto access = bench::AccessPattern::parse(opts.access);
+        access.prepare(opts.records);
+        std::bernoulli_distribution is_read(opts.read);
+        fcl::Client client(opts.socket);
+
+        // per request in flight: is it a get and when was it flushed
+        std::deque<std::pair<bool, bench_clock_t::time_point>> in_flight;
+        uint64_t issued = 0, done = 0;
+        while (done < my_ops) {
+            size_t queued = 0;
+            while (issued < my_ops && client.pending() < opts.depth) {
+                auto key = keys(access(rng));
+                bool read = is_read(rng);
+                if (read) {
+                    client.send_get(key);
+                }
+                else {
+                    client.send_insert_or_assign(key, bench::random_string(rng, opts.value_size(rng)));
+                }
+                in_flight.emplace_back(read, bench_clock_t::time_point());
+                issued++;
+                queued++;
+            }
+            if (queued > 0) {
+                client.flush();
+                auto now = bench_clock_t::now();
+                for (auto it = in_flight.end() - ptrdiff_t(queued); it != in_flight.end(); ++it) { it->second = now; }
+            }
+
+            auto response = client.receive();
+            auto elapsed = bench_clock_t::now() - in_flight.front().second;
+            auto ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+            bool read = in_flight.front().first;
+            in_flight.pop_front();
+            done++;
+            (read ? result.gets : result.writes).record(ns);
+            if (response.status == fcl::proto::Status::error) { result.errors++; }
+            if (read && response.status == fcl::proto::Status::no) { result.misses++; }
+        }
+    };
+
+    auto start = bench_clock_t::now();
+    std::vector<std::thread> threads;
+    for (unsigned id = 0; id < opts.clients; ++id) {
+        threads.emplace_back([&, id] {
+            try {
+                client_body(id);
+            }
+            catch (...) {
+                errors[id] = std::current_exception();
+            }
+        });
+    }
+    for (auto &thread : threads) { thread.join(); }
+    auto seconds = std::chrono::duration<double>(bench_clock_t::now() - start).count();
+    for (auto &error : errors) {
+        if (error) { std::rethrow_exception(error); }
+    }
+
+    ClientResult total;
+    for (auto &result : results) {
+        total.gets.merge(result.gets);
+        total.writes.merge(result.writes);
+        total.misses += result.misses;
+        total.errors += result.errors;
+    }
+    std::cout << opts.clients << " clients, depth " << opts.depth << ": " << std::fixed << std::setprecision(0)
+              << double(total.gets.count() + total.writes.count()) / seconds << " requests/s in "
+              << std::setprecision(2) << seconds << " s, " << total.misses << " get misses, "
+              << total.errors << " errors" << std::endl;
+    std::cout << std::left << std::setw(8) << "op" << std::right
+              << std::setw(12) << "count" << std::setw(12) << "ops/s" << std::setw(12) << "mean us"
+              << std::setw(12) << "p50 us" << std::setw(12) << "p99 us" << std::setw(12) << "p999 us"
+              << std::setw(12) << "max us" << std::endl;
+    print_row(std::cout, "get", seconds, total.gets);
+    print_row(std::cout, "write", seconds, total.writes);
+}
+
+int main(int argc, char **argv) {
+    try {
+        run(parse_options(argc, argv));
+        return 0;
+    }
+    catch (const bench::BadOption &err) {
+        std::cerr << err.what() << std::endl;
+        print_usage(std::cerr);
+        return 1;
+    }
+    catch (const std::exception &err) {
+        std::cerr << "Exception: " << err.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,20 @@
+TEMPLATE = app
+TARGET = loadgen
+CONFIG += console c++11 thread
+CONFIG -= app_bundle
+CONFIG -= qt
+
+QMAKE_CXXFLAGS_RELEASE *= -O3
+
+SOURCES += loadgen.cpp
+
+HEADERS += \
+    bench_utils.hpp \
+    client.hpp \
+    fdstream.hpp \
+    latency_histogram.hpp \
+    protocol.hpp
+
+LIBPATH += /usr/local/lib/
+LIBS += $${LIBPATH}libboost_system.a \
+    $${LIBPATH}libboost_filesystem.a
@@ -1,165 +1,20 @@
 #include <iostream>
+#include <fstream>
 #include <functional>
-#include <algorithm>
 #include <string>
-#include <iterator>
-#include <random>
-#include <vector>
 #include <map>
-#include <functional>
 #include <memory>
-
-#include <wheels/stopwatch.h++>
+#include <vector>
 
 #include "hash_file_storage.hpp"
 
 
-auto &rng() {
-    static std::random_device rd;
-    static std::default_random_engine rng(rd());
-    return rng;
-}
-
-template <size_t StringLength>
-std::vector<std::string> gen_strings(const size_t count) {
-    static const char alphabet[] =
-        "abcdefghijklmnopqrstuvwxyz"
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-        "0123456789";
-
-    std::uniform_int_distribution<> dist(0, sizeof(alphabet) / sizeof(*alphabet) - 2);
-
-    std::vector<std::string> strs;
-    strs.reserve(count);
-    std::generate_n(std::back_inserter(strs), strs.capacity(),
-        [&] { std::string str;
-              str.reserve(StringLength + 1);
-              std::generate_n(std::back_inserter(str), StringLength,
-                   [&] { return alphabet[dist(rng())]; });
-              str += "\0";
-              return str; });
-    return strs;
-}
-
-template <typename Ty>
-double to_mcs(Ty t) {
-    return static_cast<double>(
-        std::chrono::duration_cast<std::chrono::microseconds>(t).count()
-    );
-}
-
-template <typename Ty>
-double to_ms(Ty t) {
-    return static_cast<double>(
-        std::chrono::duration_cast<std::chrono::milliseconds>(t).count()
-    );
-}
-
 std::string read_line(std::istream &is) {
     std::string out;
     std::getline(is, out, '\n');
     return out;
 }
 
-template <typename HashedFileTy, typename KeysTy, typename ValuesTy>
-void test_insertion(
-        std::ostream &out,
-        const size_t N,
-        HashedFileTy &hfile,
-        KeysTy &keys,
-        ValuesTy &values) {
-    auto insertion_duration = wheels::time_execution(
-        [&] { for (size_t i = 0; i < N; ++i) {
-                  hfile.insert(keys[i], values[i]);
-            }});
-
-    out << "load factor: " << hfile.get_load_factor() << std::endl;
-    out << "ins avg: " << to_mcs(insertion_duration) / N << " mcs" << std::endl;
-}
-
-template <typename HashedFileTy, typename KeysTy, typename ValuesTy>
-void test_search(
-        std::ostream &out,
-        const size_t N,
-        HashedFileTy &hfile,
-        KeysTy &keys,
-        ValuesTy &values) {
-    std::uniform_int_distribution<> dist(0, N-1);
-    size_t found = 0;
-    auto search_duration = wheels::time_execution(
-        [&] { for (size_t i = 0; i < N; ++i) {
-                  if (i % 2) {
-                      if (hfile.has(keys[dist(rng())])) found++;
-                  }
-                  else {
-                      if (hfile.has(values[dist(rng())])) found++;
-                  }
-              }});
-    out << "search avg: " << to_mcs(search_duration) / N << " mcs "
-        << "(" << found << " found)" << std::endl;
-}
-
-template <typename HashedFileTy, typename KeysTy, typename ValuesTy>
-void test_deletion(
-        std::ostream &out,
-        const size_t N,
-        HashedFileTy &hfile,
-        KeysTy &keys,
-        ValuesTy &) {
-    std::uniform_int_distribution<> dist(0, N-1);
-    auto deletion_duration = wheels::time_execution(
-        [&] { for (size_t i = 0; i < N; ++i) {
-                  if (i % 2) {
-                      hfile.erase(keys[dist(rng())]);
-                  }
-              }});
-    out << "del avg: " << to_mcs(deletion_duration) / N << " mcs" << std::endl;
-}
-
-template <size_t M>
-void test(std::ostream &out, const size_t N) {
-    out << "N: " << N << " M: " << M << std::endl;
-    using hashed_file = HashedFile<std::string, std::string, M>;
-    details::fs::create_directory("./test");
-    hashed_file hfile("./test", true);
-    std::vector<std::string> keys;
-    std::vector<std::string> values;
-
-    auto gen_duration = wheels::time_execution(
-        [&] { keys = gen_strings<10>(N);
-              values = gen_strings<10>(N); });
-
-    out << "generation: " << to_ms(gen_duration) << " ms;\n";
-    out << "page size: " << sizeof(typename hashed_file::index_t::Page) << " bytes" << std::endl;
-
-    test_insertion(out, N, hfile, keys, values);
-    test_search(out, N, hfile, keys, values);
-    test_deletion(out, N, hfile, keys, values);
-
-    out << "\n\n";
-    details::fs::remove_all("./test");
-}
-
-template <size_t MHead>
-void tests_M(std::ostream &out, const size_t N) {
-    test<MHead>(out, N);
-}
-
-template <size_t MHead, size_t ...MTail>
-auto tests_M(std::ostream &out, const size_t N)
-    -> typename std::enable_if<sizeof...(MTail) != 0, void>::type {
-    test<MHead>(out, N);
-    tests_M<MTail...>(out, N);
-}
-
-template <size_t ...Ms>
-void tests(std::ostream &out, const std::vector<size_t> Ns) {
-    out << std::boolalpha;
-    for (auto N: Ns) {
-        tests_M<Ms...>(out, N);
-    }
-}
-
 using action_t = std::function<void ()>;
 using action_map_t = std::map<std::string, action_t>;
 using hash_storage_t = HashedFile<std::string, std::string, 6>;
@@ -212,6 +67,60 @@ Ty value_or_exc(boost::optional<Ty> &opt, Exc err) {
     throw err;
 }
 
+void print_io(std::ostream &out, const std::string &name, const fcl::FdStream::Counters &io) {
+    out << "  " << name << ": read " << io.bytes_read << " bytes (" << io.sys_reads << " preads, "
+        << io.sys_bytes_read << " bytes), written " << io.bytes_written << " bytes ("
+        << io.sys_writes << " pwrites, " << io.sys_bytes_written << " bytes)" << std::endl;
+}
+
+void print_counters(std::ostream &out, const hash_storage_t &db) {
+    auto &index = db.idxs().counters();
+    out << "pages read: " << index.pages_read << " (" << index.pages_resident << " from memory)" << std::endl
+        << "pages written: " << index.pages_written << std::endl
+        << "key compares: " << index.key_compares
+        << " (" << index.false_positives << " false positives)" << std::endl
+        << "values read: " << db.storage().counters().values_read << std::endl
+        << "values written: " << db.storage().counters().values_written << std::endl
+        << "lookups by probe depth (pages):" << std::endl;
+    for (size_t i = 0; i < index.probe_depth.size(); ++i) {
+        if (index.probe_depth[i] == 0) { continue; }
+        auto last = i + 1 == index.probe_depth.size();
+        out << "  " << i + 1 << (last ? "+" : "") << ": " << index.probe_depth[i] << std::endl;
+    }
+    out << "files:" << std::endl;
+    print_io(out, "hash_idx", db.idxs().table_io());
+    print_io(out, "keys_idx", db.idxs().keys_io());
+    print_io(out, "data", db.storage().io());
+    if (!db.cache().enabled()) { return; }
+    auto &cache = db.cache().counters();
+    out << "value cache: " << db.cache().size() << " values, " << db.cache().bytes() << " of "
+        << db.cache().capacity() << " bytes" << std::endl
+        << "  hits: " << cache.hits << ", misses: " << cache.misses
+        << " (hit rate " << cache.hit_rate() << ")" << std::endl
+        << "  admitted: " << cache.admitted << ", rejected: " << cache.rejected
+        << ", evicted: " << cache.evicted << ", invalidated: " << cache.invalidated << std::endl;
+}
+
+void print_latencies(std::ostream &out, const hash_storage_t &db) {
+    if (!details::latency_stats_t::enabled) {
+        out << "latencies: not measured (build with FCL_LATENCY_STATS)" << std::endl;
+        return;
+    }
+    auto us = [](double ns) { return ns / 1000.0; };
+    out << "latencies, us: count / mean / p50 / p99 / p999 / max" << std::endl;
+    for (size_t i = 0; i < details::operation_count; ++i) {
+        auto op = details::Operation(i);
+        auto &histogram = db.latency(op);
+        if (histogram.count() == 0) { continue; }
+        out << "  " << details::operation_name(op) << ": " << histogram.count()
+            << " / " << us(histogram.mean())
+            << " / " << us(double(histogram.percentile(0.5)))
+            << " / " << us(double(histogram.percentile(0.99)))
+            << " / " << us(double(histogram.percentile(0.999)))
+            << " / " << us(double(histogram.max())) << std::endl;
+    }
+}
+
 void ignore_line(std::istream &is) {
     std::string tmp;
     std::getline(is, tmp);
@@ -220,14 +129,22 @@ void ignore_line(std::istream &is) {
 int main() {
     opt_hash_storage_t hfile;
     action_map_t action_map = {
-        { "run_tests", [&] { tests<10, 100, 1000>(std::cout, {1000, 10000, 100000, 1000000}); } },
-
         { "stats", [&] { auto &active_db = ref_or_err(hfile, "no active db found");
                          std::cout << "size: " << active_db.idxs().size() << std::endl
                             << "bucket`count: " << active_db.idxs().bucket_count() << std::endl
                             << "load factor: " << active_db.idxs().load_factor() << std::endl
                             << "page size: " << sizeof(typename hash_storage_t::index_t::Page)
-                            << " bytes" << std::endl; } },
+                            << " bytes" << std::endl;
+                         print_counters(std::cout, active_db);
+                         print_latencies(std::cout, active_db); } },
+
+        { "chains", [&] { auto &active_db = ref_or_err(hfile, "no active db found");
+                          auto lengths = active_db.idxs().chain_lengths();
+                          std::cout << "buckets by chain length (pages):" << std::endl;
+                          for (size_t i = 0; i < lengths.size(); ++i) {
+                              if (lengths[i] == 0) { continue; }
+                              std::cout << "  " << i + 1 << ": " << lengths[i] << std::endl;
+                          } } },
 
         { "load_db", [&] { std::cout << "Enter directory to load from → ";
                            auto dir = fcl::read_val<std::string>(std::cin);
@@ -240,6 +157,20 @@ int main() {
                              }
                              hfile = std::make_unique<hash_storage_t>(dir, true); } },
 
+        { "recover_db", [&] { std::cout << "Enter directory to recover → ";
+                              auto dir = fcl::read_val<std::string>(std::cin);
+                              hfile.reset(nullptr);
+                              auto report = hash_storage_t::verify_and_recover(dir);
+                              std::cout << (report.was_clean ? "was closed properly" : "was not closed")
+                                  << std::endl
+                                  << "pages: " << report.pages << std::endl
+                                  << "corrupted pages: " << report.corrupted_pages << std::endl
+                                  << "cut links: " << report.cut_links << std::endl
+                                  << "torn bytes cut off: " << report.torn_bytes << std::endl
+                                  << "dropped segments: " << report.dropped_segments << std::endl
+                                  << (report.rehash_undone ? "cut rehash is rolled back\n" : "")
+                                  << "size: " << report.size << std::endl; } },
+
         { "insert", [&] { auto &active_db = ref_or_err(hfile, "no active db found");
                           std::cout << "Enter key ↓" << std::endl;
                           ignore_line(std::cin);
@@ -247,13 +178,22 @@ int main() {
                           std::cout << "Enter value ↓" << std::endl;
                           auto value = read_line(std::cin);
                           if (!active_db.insert(key, value)) {
-                              std::cout << "Cannot insert: key already binded\n";
+                              std::cout << "Cannot insert: key already binded" << std::endl;
+                              return;
                           }
-                          auto val = active_db.get(key);
-                          std::cout << "pair (" << key << ", " << value_or_exc(
-                              val, NoSuchValue("associated value not found")) << ")"
+                          std::cout << "pair (" << key << ", " << value << ")"
                           << " added" << std::endl; } },
 
+        { "insert_or_assign", [&] { auto &active_db = ref_or_err(hfile, "no active db found");
+                                    std::cout << "Enter key ↓" << std::endl;
+                                    ignore_line(std::cin);
+                                    auto key = read_line(std::cin);
+                                    std::cout << "Enter value ↓" << std::endl;
+                                    auto value = read_line(std::cin);
+                                    auto inserted = active_db.insert_or_assign(key, value);
+                                    std::cout << "pair (" << key << ", " << value << ")"
+                                    << (inserted ? " added" : " updated") << std::endl; } },
+
         { "get", [&] { auto &active_db = ref_or_err(hfile, "no active db found");
                        std::cout << "Enter associated key ↓" << std::endl;
                        ignore_line(std::cin);
@@ -278,6 +218,55 @@ int main() {
                           std::cout << (result ? "value successfuly removed"
                                                : "no associated values") << std::endl; } },
 
+        { "freeze", [&] { auto &active_db = ref_or_err(hfile, "no active db found");
+                          std::cout << "Enter file to freeze the db to → ";
+                          auto path = fcl::read_val<std::string>(std::cin);
+                          active_db.freeze(path);
+                          FrozenFile<std::string, std::string> frozen(path);
+                          std::cout << frozen.size() << " records frozen, index takes "
+                                    << frozen.index_size() << " bytes" << std::endl; } },
+
+        { "cache", [&] { auto &active_db = ref_or_err(hfile, "no active db found");
+                         std::cout << "Enter value cache size in bytes, 0 to turn it off → ";
+                         active_db.set_cache_capacity(fcl::read_val<size_t>(std::cin)); } },
+
+        { "resident", [&] { auto &active_db = ref_or_err(hfile, "no active db found");
+                            std::cout << "Enter memory for bucket pages in bytes, 0 to keep them on disk → ";
+                            active_db.set_resident_memory(fcl::read_val<uint64_t>(std::cin));
+                            std::cout << active_db.idxs().resident_buckets() << " of "
+                                      << active_db.idxs().bucket_count() << " buckets in memory" << std::endl; } },
+
+        { "order", [&] { auto &active_db = ref_or_err(hfile, "no active db found");
+                         active_db.build_ordered_index();
+                         std::cout << "ordered index built" << std::endl; } },
+
+        { "prefix", [&] { auto &active_db = ref_or_err(hfile, "no active db found");
+                          std::cout << "Enter key prefix ↓" << std::endl;
+                          ignore_line(std::cin);
+                          auto prefix = read_line(std::cin);
+                          auto scan = active_db.prefix_scan(prefix);
+                          std::vector<std::pair<std::string, std::string>> batch;
+                          size_t count = 0;
+                          while (scan.next(batch)) {
+                              for (auto &record : batch) {
+                                  std::cout << "(" << record.first << ", " << record.second << ")" << std::endl;
+                              }
+                              count += batch.size();
+                          }
+                          std::cout << count << " records" << std::endl; } },
+
+        { "trace", [&] { if (!fcl::trace::span_t::enabled) {
+                             std::cout << "not traced (build with FCL_TRACING)" << std::endl;
+                             return;
+                         }
+                         std::cout << "Enter file to write the trace to → ";
+                         auto path = fcl::read_val<std::string>(std::cin);
+                         std::ofstream out(path);
+                         fcl::trace::write_chrome_json(out);
+                         fcl::trace::clear();
+                         std::cout << (out ? "written, open it in chrome://tracing or ui.perfetto.dev"
+                                           : "cannot write it") << std::endl; } },
+
         { "close_db", [&] { hfile.reset(nullptr); } },
 
         { "help", [&] { for (auto &action : action_map) {
@@ -302,6 +291,8 @@ int main() {
         catch (const NoSuchValue &err) { std::cout << "Sorry, " << err.what() << std::endl; }
         catch (const EmptyOptional &err) { std::cout << err.what() << std::endl; }
         catch (const details::CannotOpenFile &err) { std::cout << err.what() << std::endl; }
+        catch (const details::UncleanShutdown &err) { std::cout << err.what() << std::endl; }
+        catch (const details::NoOrderedIndex &err) { std::cout << err.what() << std::endl; }
         catch (const std::exception &err) {
             std::cout << "Exception: " << err.what() << std::endl;
             return 1;
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+
+namespace fcl {
+
+/*!
+ * \brief Binary protocol of the table server (see server.cpp and client.hpp).
+ *
+ * Every message is a frame: u32 length of the rest, u8 tag and fields. Integers are
+ * little-endian, strings are u32 length and bytes. A request's tag is its `Op`, a response's
+ * one is its `Status`. Requests are pipelined: a client sends as many as it wants without
+ * waiting, responses come back in the same order.
+ *
+ *   get, has, erase           key            -> ok [value] | no
+ *   insert, insert_or_assign  key value      -> ok | no (bool results of HashedFile)
+ *   batch                     u32 count, then count times: u8 action, key, [value]
+ *                                            -> ok
+ * Any request may get `error` with a message instead.
+ */
+namespace proto {
+    enum class Op : uint8_t {
+        get = 1, has, insert, insert_or_assign, erase, batch
+    };
+
+    enum class Status : uint8_t {
+        ok = 0,
+        no = 1,   // not found, already there, nothing to erase
+        error = 2 // the value is a message then
+    };
+
+    // what a batch does with a key, see WriteBatch
+    enum class Action : uint8_t {
+        insert = 0, insert_or_assign = 1, erase = 2
+    };
+
+    struct BatchOp {
+        Action action;
+        std::string key;
+        std::string value; // nothing for erase
+    };
+
+    struct Response {
+        Status status = Status::ok;
+        std::string value;
+    };
+
+    // a frame can't be bigger, so a broken peer can't make us allocate gigabytes
+    constexpr uint32_t max_frame_length = uint32_t(64) << 20;
+
+    class ProtocolError : public std::exception {
+    public:
+        ProtocolError(const std::string &what) : m_message("protocol error: " + what) {}
+
+        virtual const char *what() const noexcept override {
+            return m_message.c_str();
+        }
+    private:
+        const std::string m_message;
+    };
+
+    inline void put_u32(std::string &out, const uint32_t val) {
+        char bytes[4] = {
+            char(val & 0xff), char((val >> 8) & 0xff), char((val >> 16) & 0xff), char(val >> 24)
+        };
+        out.append(bytes, sizeof(bytes));
+    }
+
+    inline uint32_t get_u32(const char *p) {
+        auto b = reinterpret_cast<const unsigned char *>(p);
+        return uint32_t(b[0]) | uint32_t(b[1]) << 8 | uint32_t(b[2]) << 16 | uint32_t(b[3]) << 24;
+    }
+
+    inline void put_string(std::string &out, const std::string &str) {
+        put_u32(out, uint32_t(str.size()));
+        out += str;
+    }
+
+    // appends frames to a buffer: length is patched by `end`
+    class FrameWriter {
+    public:
+        explicit FrameWriter(std::string &out) : m_out(out) {}
+
+        FrameWriter &begin(const uint8_t tag) {
+            m_start = m_out.size();
+            put_u32(m_out, 0);
+            m_out += char(tag);
+            return *this;
+        }
+
+        FrameWriter &u8(const uint8_t val) {
+            m_out += char(val);
+            return *this;
+        }
+
+        FrameWriter &u32(const uint32_t val) {
+            put_u32(m_out, val);
+            return *this;
+        }
+
+        FrameWriter &string(const std::string &str) {
+            put_string(m_out, str);
+            return *this;
+        }
+
+        void end() {
+            auto length = m_out.size() - m_start - 4;
+            if (length > max_frame_length) { throw ProtocolError("frame is too big"); }
+            for (size_t i = 0; i < 4; ++i) { m_out[m_start + i] = char((length >> (8 * i)) & 0xff); }
+        }
+
+    private:
+        std::string &m_out;
+        size_t m_start = 0;
+    };
+
+    // fields of one frame, every read checks bounds
+    class FrameReader {
+    public:
+        FrameReader(const char *data, size_t length) : m_p(data), m_end(data + length) {}
+
+        uint8_t u8() {
+            need(1);
+            return uint8_t(*m_p++);
+        }
+
+        uint32_t u32() {
+            need(4);
+            auto val = get_u32(m_p);
+            m_p += 4;
+            return val;
+        }
+
+        std::string string() {
+            auto length = u32();
+            need(length);
+            std::string str(m_p, length);
+            m_p += length;
+            return str;
+        }
+
+        bool at_end() const {
+            return m_p == m_end;
+        }
+
+    private:
+        const char *m_p;
+        const char *m_end;
+
+        void need(size_t n) const {
+            if (size_t(m_end - m_p) < n) { throw ProtocolError("frame is cut"); }
+        }
+    };
+
+    // size of the first frame in `data` (with its length field) or zero if it isn't all here yet
+    inline size_t complete_frame(const char *data, const size_t length) {
+        if (length < 4) { return 0; }
+        auto frame = get_u32(data);
+        if (frame > max_frame_length) { throw ProtocolError("frame is too big"); }
+        if (frame == 0) { throw ProtocolError("empty frame"); }
+        return length - 4 >= frame ? size_t(frame) + 4 : 0;
+    }
+}
+
+} // namespace fcl
@@ -0,0 +1,410 @@
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <vector>
+#include <unordered_map>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bench_utils.hpp"
+#include "protocol.hpp"
+#include "hash_file_storage.hpp"
+
+
+// serves one table to local processes over a unix socket, see protocol.hpp and client.hpp.
+// one thread does everything: the table isn't thread safe anyway, and requests of a pipeline
+// are read and executed in a row without syscalls between them
+using table_t = HashedFile<std::string, std::string, 6>; // the same tables as the repl makes
+
+struct Options {
+    std::string dir;
+    std::string socket;        // dir/socket by default
+    bool create = false;
+    bool recover = false;
+    size_t max_output = 4 << 20; // a connection isn't read while it has more answers unsent
+};
+
+void print_usage(std::ostream &out) {
+    out << "usage: server --dir D [options]\n"
+        << "  --dir D          the table\n"
+        << "  --socket P       where to listen (D/socket)\n"
+        << "  --create         make a new table in D, the old one is lost\n"
+        << "  --recover        verify_and_recover the table if it wasn't closed properly\n"
+        << "  --max-output N   bytes of unsent answers per connection before it stops being read (4194304)\n"
+        << "SIGINT or SIGTERM closes the table properly\n";
+}
+
+Options parse_options(int argc, char **argv) {
+    Options opts;
+    bench::setters_t setters = {
+        { "--dir", [&](const std::string &v) { opts.dir = v; } },
+        { "--socket", [&](const std::string &v) { opts.socket = v; } },
+        { "--max-output", [&](const std::string &v) { opts.max_output = std::stoull(v); } },
+    };
+    bench::flags_t flags = {
+        { "--create", [&] { opts.create = true; } },
+        { "--recover", [&] { opts.recover = true; } },
+    };
+
+    bench::parse_options(argc, argv, setters, flags, print_usage);
+
+    if (opts.dir.empty()) { throw bench::BadOption("--dir is needed"); }
+    if (opts.socket.empty()) { opts.socket = (bench::fs::path(opts.dir)/"socket").string(); }
+    if (opts.max_output == 0) { throw bench::BadOption("--max-output must be positive"); }
+    return opts;
+}
+
+class Server {
+public:
+    struct Stats {
+        uint64_t connections = 0;
+        uint64_t requests = 0;
+        uint64_t errors = 0;
+    };
+
+    Server(table_t &table, const std::string &socket_path, size_t max_output)
+        : m_table(table), m_socket_path(socket_path), m_max_output(max_output) {
+        m_epoll = ::epoll_create1(EPOLL_CLOEXEC);
+        if (m_epoll < 0) { throw fcl::IOError("epoll_create1", errno); }
+
+        // signals come as events of the loop, so the table is closed by the same thread
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        ::sigprocmask(SIG_BLOCK, &signals, nullptr);
+        ::signal(SIGPIPE, SIG_IGN);
+        m_signals = ::signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (m_signals < 0) { throw fcl::IOError("signalfd", errno); }
+        watch(m_signals, EPOLLIN);
+
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(addr.sun_path)) {
+            throw fcl::proto::ProtocolError("socket path is too long [" + socket_path + "]");
+        }
+        std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+        ::unlink(socket_path.c_str()); // left by a server which has died
+        m_listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_listener < 0) { throw fcl::IOError("socket", errno); }
+        if (::bind(m_listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+            throw fcl::IOError("cannot bind [" + socket_path + "]", errno);
+        }
+        if (::listen(m_listener, SOMAXCONN) != 0) { throw fcl::IOError("listen", errno); }
+        watch(m_listener, EPOLLIN);
+    }
+
+    ~Server() {
+        for (auto &connection : m_connections) { ::close(connection.first); }
+        if (m_listener >= 0) {
+            ::close(m_listener);
+            ::unlink(m_socket_path.c_str());
+        }
+        if (m_signals >= 0) { ::close(m_signals); }
+        if (m_epoll >= 0) { ::close(m_epoll); }
+    }
+
+    Server(const Server &) = delete;
+    Server &operator =(const Server &) = delete;
+
+    // until SIGINT or SIGTERM
+    void run() {
+        std::vector<epoll_event> events(256);
+        for (;;) {
+            // a paused listener is tried again in a while, even if no connection is over
+            auto n = ::epoll_wait(m_epoll, events.data(), int(events.size()), m_listening ? -1 : accept_retry_ms);
+            if (n < 0) {
+                if (errno == EINTR) { continue; }
+                throw fcl::IOError("epoll_wait", errno);
+            }
+            if (n == 0) { resume_accepting(); }
+            for (int i = 0; i < n; ++i) {
+                auto fd = events[size_t(i)].data.fd;
+                if (fd == m_signals) { return; }
+                if (fd == m_listener) {
+                    accept_all();
+                    continue;
+                }
+                auto it = m_connections.find(fd);
+                if (it == m_connections.end()) { continue; }
+                if (!serve(it->second, events[size_t(i)].events)) { drop(fd); }
+            }
+        }
+    }
+
+    const Stats &stats() const {
+        return m_stats;
+    }
+
+private:
+    struct Connection {
+        int fd;
+        std::string in;
+        std::string out;
+        size_t out_pos = 0; // sent already
+        uint32_t events = EPOLLIN;
+    };
+
+    table_t &m_table;
+    const std::string m_socket_path;
+    const size_t m_max_output;
+    static constexpr int accept_retry_ms = 1000;
+    int m_epoll = -1;
+    int m_signals = -1;
+    int m_listener = -1;
+    bool m_listening = true;
+    std::chrono::steady_clock::time_point m_last_accept_error;
+    std::unordered_map<int, Connection> m_connections;
+    Stats m_stats;
+
+    void watch(int fd, uint32_t events) {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        if (::epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) != 0) { throw fcl::IOError("epoll_ctl", errno); }
+    }
+
+    void accept_all() {
+        for (;;) {
+            auto fd = ::accept4(m_listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) { continue; }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) { return; }
+                // out of fds, say: the listener stays readable, so it's left alone until
+                // a connection is over (or for accept_retry_ms), not to spin on it
+                pause_accepting(errno);
+                return;
+            }
+            watch(fd, EPOLLIN);
+            m_connections.emplace(fd, Connection{ fd, {}, {}, 0, EPOLLIN });
+            m_stats.connections++;
+        }
+    }
+
+    void drop(int fd) {
+        ::close(fd); // removes it from epoll too
+        m_connections.erase(fd);
+        resume_accepting();
+    }
+
+    void pause_accepting(int error) {
+        auto now = std::chrono::steady_clock::now();
+        if (now - m_last_accept_error >= std::chrono::milliseconds(accept_retry_ms)) {
+            std::cerr << fcl::IOError("accept4", error).what() << std::endl;
+            m_last_accept_error = now;
+        }
+        if (::epoll_ctl(m_epoll, EPOLL_CTL_DEL, m_listener, nullptr) != 0) { throw fcl::IOError("epoll_ctl", errno); }
+        m_listening = false;
+    }
+
+    void resume_accepting() {
+        if (m_listening) { return; }
+        watch(m_listener, EPOLLIN);
+        m_listening = true;
+    }
+
+    // false if the connection is over
+    bool serve(Connection &conn, uint32_t events) {
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            if (!receive(conn)) { return false; }
+        }
+        for (;;) {
+            bool stopped;
+            try {
+                stopped = execute_all(conn);
+            }
+            catch (const fcl::proto::ProtocolError &err) {
+                // framing is lost, there is no way to answer
+                std::cerr << "connection dropped: " << err.what() << std::endl;
+                return false;
+            }
+            if (!send(conn)) { return false; }
+            // all the answers are gone, so the requests which the limit has stopped may go on:
+            // nothing else would wake this connection up for them
+            if (!stopped || !conn.out.empty()) { break; }
+        }
+
+        // answers have to go out before more requests are read
+        uint32_t wanted = conn.out.size() - conn.out_pos < m_max_output ? uint32_t(EPOLLIN) : 0;
+        if (conn.out_pos < conn.out.size()) { wanted |= EPOLLOUT; }
+        if (wanted != conn.events) {
+            epoll_event event{};
+            event.events = wanted;
+            event.data.fd = conn.fd;
+            if (::epoll_ctl(m_epoll, EPOLL_CTL_MOD, conn.fd, &event) != 0) { throw fcl::IOError("epoll_ctl", errno); }
+            conn.events = wanted;
+        }
+        return true;
+    }
+
+    bool receive(Connection &conn) {
+        char buf[64 * 1024];
+        for (;;) {
+            auto n = ::recv(conn.fd, buf, sizeof(buf), 0);
+            if (n < 0) {
+                if (errno == EINTR) { continue; }
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            if (n == 0) { return false; }
+            conn.in.append(buf, size_t(n));
+            if (size_t(n) < sizeof(buf)) { return true; }
+        }
+    }
+
+    bool send(Connection &conn) {
+        while (conn.out_pos < conn.out.size()) {
+            auto n = ::send(conn.fd, conn.out.data() + conn.out_pos, conn.out.size() - conn.out_pos, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) { continue; }
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            conn.out_pos += size_t(n);
+        }
+        conn.out.clear();
+        conn.out_pos = 0;
+        return true;
+    }
+
+    // every complete request which has come, while there is room for answers.
+    // true if the room has run out while a complete request is left
+    bool execute_all(Connection &conn) {
+        fcl::proto::FrameWriter writer(conn.out);
+        size_t pos = 0, frame;
+        bool stopped = false;
+        while ((frame = fcl::proto::complete_frame(conn.in.data() + pos, conn.in.size() - pos)) != 0) {
+            if (conn.out.size() - conn.out_pos >= m_max_output) {
+                stopped = true;
+                break;
+            }
+            fcl::proto::FrameReader reader(conn.in.data() + pos + 4, frame - 4);
+            pos += frame;
+            m_stats.requests++;
+            try {
+                execute(reader, writer);
+            }
+            catch (const std::exception &err) {
+                // a bad request or a failed operation, the next requests don't depend on it
+                m_stats.errors++;
+                writer.begin(uint8_t(fcl::proto::Status::error)).string(err.what()).end();
+            }
+        }
+        conn.in.erase(0, pos);
+        return stopped;
+    }
+
+    void answer(fcl::proto::FrameWriter &writer, bool result) {
+        writer.begin(uint8_t(result ? fcl::proto::Status::ok : fcl::proto::Status::no)).end();
+    }
+
+    void execute(fcl::proto::FrameReader &reader, fcl::proto::FrameWriter &writer) {
+        using fcl::proto::Op;
+        auto op = Op(reader.u8());
+        switch (op) {
+        case Op::get: {
+            auto key = reader.string();
+            expect_end(reader);
+            auto val = m_table.get(key);
+            if (!val) { return answer(writer, false); }
+            writer.begin(uint8_t(fcl::proto::Status::ok)).string(*val).end();
+            return;
+        }
+        case Op::has: {
+            auto key = reader.string();
+            expect_end(reader);
+            return answer(writer, m_table.has(key));
+        }
+        case Op::insert: {
+            auto key = reader.string();
+            auto val = reader.string();
+            expect_end(reader);
+            return answer(writer, m_table.insert(key, val));
+        }
+        case Op::insert_or_assign: {
+            auto key = reader.string();
+            auto val = reader.string();
+            expect_end(reader);
+            return answer(writer, m_table.insert_or_assign(key, val));
+        }
+        case Op::erase: {
+            auto key = reader.string();
+            expect_end(reader);
+            return answer(writer, m_table.erase(key));
+        }
+        case Op::batch:
+            m_table.write(read_batch(reader));
+            return answer(writer, true);
+        }
+        throw fcl::proto::ProtocolError("unknown request " + std::to_string(unsigned(op)));
+    }
+
+    // the whole batch is read before anything is applied, so a bad one changes nothing
+    static WriteBatch<std::string, std::string> read_batch(fcl::proto::FrameReader &reader) {
+        using fcl::proto::Action;
+        WriteBatch<std::string, std::string> batch;
+        auto count = reader.u32();
+        for (uint32_t i = 0; i < count; ++i) {
+            auto action = Action(reader.u8());
+            auto key = reader.string();
+            switch (action) {
+            case Action::insert: batch.insert(key, reader.string()); break;
+            case Action::insert_or_assign: batch.insert_or_assign(key, reader.string()); break;
+            case Action::erase: batch.erase(key); break;
+            default: throw fcl::proto::ProtocolError("unknown batch action " + std::to_string(unsigned(action)));
+            }
+        }
+        expect_end(reader);
+        return batch;
+    }
+
+    static void expect_end(const fcl::proto::FrameReader &reader) {
+        if (!reader.at_end()) { throw fcl::proto::ProtocolError("garbage after the request"); }
+    }
+};
+
+constexpr int Server::accept_retry_ms;
+
+int run(const Options &opts) {
+    if (opts.create) {
+        bench::fs::create_directories(opts.dir);
+    }
+    else if (opts.recover) {
+        auto report = table_t::verify_and_recover(opts.dir);
+        if (!report.was_clean) {
+            std::cout << "table was not closed properly: " << report.corrupted_pages << " corrupted pages, "
+                      << report.cut_links << " cut links, " << report.size << " records" << std::endl;
+        }
+    }
+
+    table_t table(opts.dir, opts.create);
+    Server server(table, opts.socket, opts.max_output);
+    std::cout << "serving [" << opts.dir << "] at [" << opts.socket << "]" << std::endl;
+    server.run();
+
+    auto &stats = server.stats();
+    std::cout << "stopped: " << stats.connections << " connections, " << stats.requests << " requests, "
+              << stats.errors << " errors, " << table.size() << " records" << std::endl;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    try {
+        return run(parse_options(argc, argv));
+    }
+    catch (const bench::BadOption &err) {
+        std::cerr << err.what() << std::endl;
+        print_usage(std::cerr);
+        return 1;
+    }
+    catch (const std::exception &err) {
+        std::cerr << "Exception: " << err.what() << std::endl;
+        return 1;
+    }
+}
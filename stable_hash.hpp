@@ -0,0 +1,173 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+
+namespace fcl {
+
+namespace details {
+    // wyhash (by Wang Yi, public domain): 64x64->128 multiplication as the only mixing step,
+    // long inputs are eaten by 48 bytes per iteration in three independent lanes,
+    // so cpu can pipeline them. result depends only on bytes, not on platform or std library
+    constexpr uint64_t wyp[4] = {
+        0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+        0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+    };
+
+    inline void wymum(uint64_t &a, uint64_t &b) {
+#if defined(__SIZEOF_INT128__)
+        __uint128_t r = a;
+        r *= b;
+        a = static_cast<uint64_t>(r);
+        b = static_cast<uint64_t>(r >> 64);
+#else
+        uint64_t ha = a >> 32, hb = b >> 32, la = uint32_t(a), lb = uint32_t(b);
+        uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+        uint64_t t = rl + (rm0 << 32), c = t < rl;
+        uint64_t lo = t + (rm1 << 32);
+        c += lo < t;
+        uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+        a = lo;
+        b = hi;
+#endif
+    }
+
+    inline uint64_t wymix(uint64_t a, uint64_t b) {
+        wymum(a, b);
+        return a ^ b;
+    }
+
+    // all reads are little-endian, otherwise the same table would hash differently elsewhere
+    inline uint64_t wyr8(const uint8_t *p) {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        return v;
+    }
+
+    inline uint64_t wyr4(const uint8_t *p) {
+        uint32_t v;
+        std::memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap32(v);
+#endif
+        return v;
+    }
+
+    inline uint64_t wyr3(const uint8_t *p, size_t k) {
+        return (uint64_t(p[0]) << 16) | (uint64_t(p[k >> 1]) << 8) | p[k - 1];
+    }
+}
+
+inline uint64_t wyhash(const void *key, size_t len, uint64_t seed = 0) {
+    using namespace details;
+    auto p = static_cast<const uint8_t *>(key);
+    seed ^= wymix(seed ^ wyp[0], wyp[1]);
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+            b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0) {
+            a = wyr3(p, len);
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
+    }
+    a ^= wyp[1];
+    b ^= seed;
+    wymum(a, b);
+    return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+
+// hasher concept for HashedFile: `uint64_t operator ()(const T &) const` plus `static constexpr
+// uint64_t id`, which is stored in the table header, so table can't be opened with another hash
+
+// note: padding bytes of a struct are hashed too, so keep such keys zero-initialized
+template <typename T, typename = void>
+struct WyHash {
+    static_assert(
+        std::is_trivially_copyable<T>::value,
+        "WyHash can hash only strings and trivially copyable types"
+    );
+
+    static constexpr uint64_t id = 0x7779686173680001ull; // "wyhash" + revision
+
+    uint64_t operator ()(const T &val) const {
+        return wyhash(&val, sizeof(T));
+    }
+};
+
+// integers are hashed without going through the bytes
+template <typename T>
+struct WyHash<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+    static constexpr uint64_t id = 0x7779686173680001ull;
+
+    uint64_t operator ()(const T &val) const {
+        return details::wymix(uint64_t(val) ^ details::wyp[0], sizeof(T) ^ details::wyp[1]);
+    }
+};
+
+template <typename CharT, typename Traits, typename Alloc>
+struct WyHash<std::basic_string<CharT, Traits, Alloc>> {
+    static constexpr uint64_t id = 0x7779686173680001ull;
+
+    uint64_t operator ()(const std::basic_string<CharT, Traits, Alloc> &str) const {
+        return wyhash(str.data(), str.size() * sizeof(CharT));
+    }
+};
+
+// std::hash is neither stable between std libraries nor good in low bits (identity for integers),
+// use it only if you know what are you doing
+template <typename T>
+struct StdHash {
+    static constexpr uint64_t id = 0;
+
+    uint64_t operator ()(const T &val) const {
+        return std::hash<T>()(val);
+    }
+};
+
+template <typename T, typename Enable>
+constexpr uint64_t WyHash<T, Enable>::id;
+
+template <typename T>
+constexpr uint64_t WyHash<T, typename std::enable_if<std::is_integral<T>::value>::type>::id;
+
+template <typename CharT, typename Traits, typename Alloc>
+constexpr uint64_t WyHash<std::basic_string<CharT, Traits, Alloc>>::id;
+
+template <typename T>
+constexpr uint64_t StdHash<T>::id;
+
+} // namespace fcl
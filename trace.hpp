@@ -0,0 +1,218 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#include <algorithm>
+
+namespace fcl {
+
+/*!
+ * \brief Trace points for diagnosing latency spikes: every `Span` is one complete event
+ * (name, start, duration and a number) in a ring buffer of its thread. Recording takes two
+ * clock reads and no locks, old events are overwritten. `write_chrome_json` dumps events
+ * of all threads in Chrome trace format, chrome://tracing and ui.perfetto.dev open it.
+ * Spans cost nothing unless FCL_TRACING is defined, see `trace::span_t`.
+ */
+namespace trace {
+    struct Event {
+        const char *name = nullptr; // string literals only, they are kept by pointer
+        uint64_t start_ns = 0;      // since the first event of the process
+        uint64_t duration_ns = 0;
+        uint64_t arg = 0;
+    };
+
+    namespace details {
+        using clock_t = std::chrono::steady_clock;
+
+        // one writer (its thread) and rare readers. every slot is a seqlock: its `seq` is
+        // the number of the event in it plus one, and 0 while the writer rewrites it, a reader
+        // keeps the event only if `seq` is the expected one both before and after copying it
+        class RingBuffer {
+        public:
+            static constexpr size_t capacity = size_t(1) << 14;
+
+            explicit RingBuffer(uint64_t thread) : m_thread(thread) {}
+
+            void push(const Event &event) {
+                auto head = m_head.load(std::memory_order_relaxed);
+                auto &slot = m_slots[head & (capacity - 1)];
+                slot.seq.store(0, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                slot.name.store(event.name, std::memory_order_relaxed);
+                slot.start_ns.store(event.start_ns, std::memory_order_relaxed);
+                slot.duration_ns.store(event.duration_ns, std::memory_order_relaxed);
+                slot.arg.store(event.arg, std::memory_order_relaxed);
+                slot.seq.store(head + 1, std::memory_order_release);
+                m_head.store(head + 1, std::memory_order_release);
+            }
+
+            std::vector<Event> snapshot() const {
+                auto head = m_head.load(std::memory_order_acquire);
+                auto first = std::max(head > capacity ? head - capacity : 0,
+                                      m_cleared.load(std::memory_order_relaxed));
+                std::vector<Event> events;
+                if (first >= head) { return events; }
+                events.reserve(size_t(head - first));
+                for (auto i = first; i < head; ++i) {
+                    const auto &slot = m_slots[i & (capacity - 1)];
+                    // a mismatch means the event is overwritten, so are all the events before it
+                    if (slot.seq.load(std::memory_order_acquire) != i + 1) { events.clear(); continue; }
+                    Event event;
+                    event.name = slot.name.load(std::memory_order_relaxed);
+                    event.start_ns = slot.start_ns.load(std::memory_order_relaxed);
+                    event.duration_ns = slot.duration_ns.load(std::memory_order_relaxed);
+                    event.arg = slot.arg.load(std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (slot.seq.load(std::memory_order_relaxed) != i + 1) { events.clear(); continue; }
+                    events.push_back(event);
+                }
+                return events;
+            }
+
+            // the writer doesn't notice it, only snapshots do
+            void clear() {
+                m_cleared.store(m_head.load(std::memory_order_acquire), std::memory_order_relaxed);
+            }
+
+            uint64_t thread() const {
+                return m_thread;
+            }
+
+        private:
+            struct Slot {
+                std::atomic<uint64_t> seq{ 0 };
+                std::atomic<const char *> name{ nullptr };
+                std::atomic<uint64_t> start_ns{ 0 };
+                std::atomic<uint64_t> duration_ns{ 0 };
+                std::atomic<uint64_t> arg{ 0 };
+            };
+
+            std::array<Slot, capacity> m_slots;
+            std::atomic<uint64_t> m_head{ 0 };
+            std::atomic<uint64_t> m_cleared{ 0 };
+            const uint64_t m_thread;
+        };
+
+        // buffers of all threads which have ever traced something, they outlive their threads
+        class Registry {
+        public:
+            static Registry &instance() {
+                static Registry registry;
+                return registry;
+            }
+
+            RingBuffer &local() {
+                thread_local std::shared_ptr<RingBuffer> buffer = add();
+                return *buffer;
+            }
+
+            std::vector<std::shared_ptr<RingBuffer>> buffers() {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                return m_buffers;
+            }
+
+            uint64_t now_ns() const {
+                return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    clock_t::now() - m_epoch
+                ).count());
+            }
+
+        private:
+            std::mutex m_mutex;
+            std::vector<std::shared_ptr<RingBuffer>> m_buffers;
+            const clock_t::time_point m_epoch = clock_t::now();
+
+            std::shared_ptr<RingBuffer> add() {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_buffers.push_back(std::make_shared<RingBuffer>(m_buffers.size() + 1));
+                return m_buffers.back();
+            }
+        };
+    }
+
+    // records time from its creation to its destruction
+    class Span {
+    public:
+        static constexpr bool enabled = true;
+
+        explicit Span(const char *name, uint64_t arg = 0)
+            : m_name(name), m_arg(arg), m_start(details::Registry::instance().now_ns()) {}
+
+        Span(const Span &) = delete;
+        Span &operator =(const Span &) = delete;
+
+        ~Span() {
+            auto &registry = details::Registry::instance();
+            registry.local().push({ m_name, m_start, registry.now_ns() - m_start, m_arg });
+        }
+
+        // when the number is known only at the end (pages read, records moved)
+        void set_arg(uint64_t arg) {
+            m_arg = arg;
+        }
+
+    private:
+        const char *m_name;
+        uint64_t m_arg;
+        uint64_t m_start;
+    };
+
+    // the same interface, but records nothing, so the compiler throws it away
+    class NoSpan {
+    public:
+        static constexpr bool enabled = false;
+
+        explicit NoSpan(const char *, uint64_t = 0) {}
+        ~NoSpan() {} // user-provided, so a span isn't an unused variable
+
+        void set_arg(uint64_t) {}
+    };
+
+    // define FCL_TRACING to get them, otherwise they cost nothing
+#if defined(FCL_TRACING)
+    using span_t = Span;
+#else
+    using span_t = NoSpan;
+#endif
+
+    // forgets all the events recorded so far
+    inline void clear() {
+        for (auto &buffer : details::Registry::instance().buffers()) { buffer->clear(); }
+    }
+
+    // the last `RingBuffer::capacity` events of every thread as "complete" events
+    // of Chrome trace format, timestamps are in microseconds there
+    inline void write_chrome_json(std::ostream &out) {
+        auto us = [](uint64_t ns) { return double(ns) / 1000.0; };
+        auto flags = out.flags();
+        auto precision = out.precision();
+        out << std::fixed;
+        out.precision(3);
+        out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+        bool first = true;
+        for (auto &buffer : details::Registry::instance().buffers()) {
+            out << (first ? "\n" : ",\n")
+                << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->thread()
+                << ", \"args\": {\"name\": \"thread " << buffer->thread() << "\"}}";
+            first = false;
+            for (const auto &event : buffer->snapshot()) {
+                out << ",\n{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                    << buffer->thread() << ", \"ts\": " << us(event.start_ns)
+                    << ", \"dur\": " << us(event.duration_ns)
+                    << ", \"args\": {\"arg\": " << event.arg << "}}";
+            }
+        }
+        out << "\n]}\n";
+        out.flags(flags);
+        out.precision(precision);
+    }
+}
+
+} // namespace fcl
@@ -0,0 +1,332 @@
+#pragma once
+
+#include <list>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+#include "stable_hash.hpp"
+
+namespace fcl {
+
+// what a ValueCache has done since it was created (or since `reset_counters`)
+struct CacheCounters {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t admitted = 0;      // left the window for the main part...
+    uint64_t rejected = 0;      // ...or were dropped, as less popular than its victim
+    uint64_t evicted = 0;       // victims of the main part
+    uint64_t invalidated = 0;   // dropped by writes
+
+    double hit_rate() const {
+        auto lookups = hits + misses;
+        return lookups == 0 ? 0.0 : double(hits) / double(lookups);
+    }
+};
+
+namespace details {
+    // memory which a key or a value holds outside of itself, roughly
+    inline size_t heap_size(const std::string &str) {
+        return str.capacity();
+    }
+
+    template <typename T>
+    size_t heap_size(const T &) {
+        return 0;
+    }
+
+    /*!
+     * \brief Count-min sketch of how often hashes were seen, 4 rows of 4-bit counters. Counters
+     * are halved once there were 10 increments per counter of a row, so old popularity fades.
+     */
+    class FrequencySketch {
+    public:
+        static constexpr unsigned rows = 4;
+        static constexpr uint8_t max_count = 15;
+
+        // for about `expected` different hashes, counts are forgotten
+        void resize(size_t expected) {
+            m_width_bits = 6;
+            while ((size_t(1) << m_width_bits) < expected) { m_width_bits++; }
+            m_counters.assign((size_t(rows) << m_width_bits) / 2, 0); // two counters per byte
+            m_additions = 0;
+        }
+
+        size_t width() const {
+            return size_t(1) << m_width_bits;
+        }
+
+        unsigned frequency(uint64_t hash) const {
+            unsigned result = max_count;
+            for (unsigned row = 0; row < rows; ++row) { result = std::min(result, get(index(hash, row))); }
+            return result;
+        }
+
+        // only the smallest counters grow (conservative update), the others already overestimate
+        void increment(uint64_t hash) {
+            auto min = frequency(hash);
+            if (min == max_count) { return; }
+            for (unsigned row = 0; row < rows; ++row) {
+                auto i = index(hash, row);
+                if (get(i) == min) { set(i, min + 1); }
+            }
+            if (++m_additions == 10 * width()) { age(); }
+        }
+
+    private:
+        unsigned m_width_bits = 0;
+        std::vector<uint8_t> m_counters;
+        size_t m_additions = 0;
+
+        size_t index(uint64_t hash, unsigned row) const {
+            static constexpr uint64_t seeds[rows] = {
+                0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full, 0x165667b19e3779f9ull, 0xd6e8feb86659fd93ull
+            };
+            return (size_t(row) << m_width_bits) + size_t((hash * seeds[row]) >> (64 - m_width_bits));
+        }
+
+        unsigned get(size_t i) const {
+            return (m_counters[i / 2] >> (i % 2 * 4)) & 0xf;
+        }
+
+        void set(size_t i, unsigned count) {
+            auto shift = i % 2 * 4;
+            m_counters[i / 2] = uint8_t((m_counters[i / 2] & ~(0xf << shift)) | (count << shift));
+        }
+
+        void age() {
+            for (auto &pair : m_counters) { pair = uint8_t((pair >> 1) & 0x77); }
+            m_additions /= 2;
+        }
+    };
+}
+
+/*!
+ * \brief Values of the most popular keys, up to `capacity` bytes, W-TinyLFU: new values get
+ * to a small LRU window (1% of the capacity), values leaving it compete for the main part
+ * with its LRU victim, and the one seen more often (by FrequencySketch) stays. The main part
+ * is a segmented LRU: values hit there are protected (80% of it) from one-time keys.
+ * So a scan or a burst of new keys passes through the window without flushing hot values.
+ *
+ * Values are found by hashes of keys, keys are compared too. It's a cache, writers have to
+ * `invalidate` keys they change. Not thread-safe.
+ */
+template <typename Key, typename Value, typename Hasher = fcl::WyHash<Key>>
+class ValueCache {
+public:
+    // a cache of zero bytes is off: it has nothing and counts nothing
+    explicit ValueCache(size_t capacity = 0) {
+        set_capacity(capacity);
+    }
+
+    bool enabled() const {
+        return m_capacity != 0;
+    }
+
+    size_t capacity() const {
+        return m_capacity;
+    }
+
+    // evicts values if it becomes smaller
+    void set_capacity(size_t capacity) {
+        m_capacity = capacity;
+        if (!enabled()) {
+            clear();
+            return;
+        }
+        m_window_limit = std::max<size_t>(m_capacity / 100, 1);
+        m_protected_limit = (m_capacity - m_window_limit) / 10 * 8;
+        if (m_sketch.width() < 64) { m_sketch.resize(64); }
+        evict();
+    }
+
+    // values in it
+    size_t size() const {
+        return m_map.size();
+    }
+
+    // memory they take, roughly
+    size_t bytes() const {
+        return m_window_bytes + m_probation_bytes + m_protected_bytes;
+    }
+
+    // nullptr on a miss. the value stays there until the next change of the cache
+    const Value *get(const Key &key) {
+        if (!enabled()) { return nullptr; }
+        auto hash = m_hasher(key);
+        m_sketch.increment(hash);
+        auto it = m_map.find(hash);
+        if (it == m_map.end() || !(it->second->key == key)) {
+            m_counters.misses++;
+            return nullptr;
+        }
+        m_counters.hits++;
+        touch(it->second);
+        return &it->second->value;
+    }
+
+    // doesn't count as a lookup and changes nothing
+    bool contains(const Key &key) const {
+        auto it = m_map.find(m_hasher(key));
+        return it != m_map.end() && it->second->key == key;
+    }
+
+    // the value of `key` read after a miss
+    void put(const Key &key, const Value &value) {
+        if (!enabled()) { return; }
+        auto hash = m_hasher(key);
+        auto charge = sizeof(Entry) + entry_overhead + details::heap_size(key) + details::heap_size(value);
+        if (charge > m_capacity - m_window_limit) { return; }
+        auto it = m_map.find(hash);
+        if (it != m_map.end()) { remove(it->second); }
+
+        m_window.push_front(Entry{ hash, key, value, charge, Segment::window });
+        m_map[hash] = m_window.begin();
+        m_window_bytes += charge;
+        // a sketch narrower than the number of values overestimates all of them
+        if (m_map.size() > m_sketch.width()) { m_sketch.resize(m_map.size() * 2); }
+        evict();
+    }
+
+    // the key is changed or gone
+    void invalidate(const Key &key) {
+        if (m_map.empty()) { return; }
+        auto it = m_map.find(m_hasher(key));
+        if (it == m_map.end() || !(it->second->key == key)) { return; }
+        m_counters.invalidated++;
+        remove(it->second);
+    }
+
+    void clear() {
+        m_map.clear();
+        m_window.clear();
+        m_probation.clear();
+        m_protected.clear();
+        m_window_bytes = m_probation_bytes = m_protected_bytes = 0;
+    }
+
+    const CacheCounters &counters() const {
+        return m_counters;
+    }
+
+    void reset_counters() {
+        m_counters = CacheCounters();
+    }
+
+private:
+    enum class Segment : uint8_t {
+        window, probation, protected_
+    };
+
+    struct Entry {
+        uint64_t hash;
+        Key key;
+        Value value;
+        size_t charge;
+        Segment segment;
+    };
+
+    using list_t = std::list<Entry>;
+    using iterator_t = typename list_t::iterator;
+
+    // links of a list node, a hash map node (with the hash and the iterator) and its bucket
+    static constexpr size_t entry_overhead = 6 * sizeof(void *);
+
+    size_t m_capacity = 0;
+    size_t m_window_limit = 0;
+    size_t m_protected_limit = 0;
+    Hasher m_hasher;
+    details::FrequencySketch m_sketch;
+    std::unordered_map<uint64_t, iterator_t> m_map;
+    // the most recent ones first
+    list_t m_window, m_probation, m_protected;
+    size_t m_window_bytes = 0, m_probation_bytes = 0, m_protected_bytes = 0;
+    CacheCounters m_counters;
+
+    list_t &list_of(Segment segment) {
+        switch (segment) {
+        case Segment::window: return m_window;
+        case Segment::probation: return m_probation;
+        default: return m_protected;
+        }
+    }
+
+    size_t &bytes_of(Segment segment) {
+        switch (segment) {
+        case Segment::window: return m_window_bytes;
+        case Segment::probation: return m_probation_bytes;
+        default: return m_protected_bytes;
+        }
+    }
+
+    void move_to_front(iterator_t entry, Segment segment) {
+        bytes_of(entry->segment) -= entry->charge;
+        bytes_of(segment) += entry->charge;
+        list_of(segment).splice(list_of(segment).begin(), list_of(entry->segment), entry);
+        entry->segment = segment;
+    }
+
+    void touch(iterator_t entry) {
+        if (entry->segment == Segment::window || entry->segment == Segment::protected_) {
+            move_to_front(entry, entry->segment);
+            return;
+        }
+        // the second hit in the main part: it's protected now, protected ones
+        // which don't fit go back to probation
+        move_to_front(entry, Segment::protected_);
+        while (m_protected_bytes > m_protected_limit) {
+            move_to_front(std::prev(m_protected.end()), Segment::probation);
+        }
+    }
+
+    void remove(iterator_t entry) {
+        bytes_of(entry->segment) -= entry->charge;
+        m_map.erase(entry->hash);
+        list_of(entry->segment).erase(entry);
+    }
+
+    iterator_t victim() {
+        return m_probation.empty() ? std::prev(m_protected.end()) : std::prev(m_probation.end());
+    }
+
+    void evict() {
+        auto main_limit = m_capacity - m_window_limit;
+        while (m_window_bytes > m_window_limit) {
+            auto candidate = std::prev(m_window.end());
+            auto frequency = m_sketch.frequency(candidate->hash);
+            // one bigger than the whole main part (after a cut of the capacity) never fits there
+            bool admit = candidate->charge <= main_limit;
+            while (admit && m_probation_bytes + m_protected_bytes + candidate->charge > main_limit
+                   && !(m_probation.empty() && m_protected.empty())) {
+                auto loser = victim();
+                if (m_sketch.frequency(loser->hash) >= frequency) {
+                    admit = false;
+                    break;
+                }
+                m_counters.evicted++;
+                remove(loser);
+            }
+            if (admit) {
+                m_counters.admitted++;
+                move_to_front(candidate, Segment::probation);
+            }
+            else {
+                m_counters.rejected++;
+                remove(candidate);
+            }
+        }
+        // the capacity was cut
+        while (m_probation_bytes + m_protected_bytes > main_limit) {
+            m_counters.evicted++;
+            remove(victim());
+        }
+        while (m_protected_bytes > m_protected_limit) {
+            move_to_front(std::prev(m_protected.end()), Segment::probation);
+        }
+    }
+};
+
+} // namespace fcl
@@ -0,0 +1,413 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <iterator>
+
+#define WHEELS_HAS_FEATURE_CXX_ALIGNED_UNION
+#define WHEELS_HAS_FEATURE_CXX_THREADS
+#include <wheels/concurrency/locker_box.h++>
+
+#include "bench_utils.hpp"
+#include "latency_histogram.hpp"
+#include "hash_file_storage.hpp"
+
+
+enum class OpKind { read, update, insert, scan, rmw };
+
+constexpr size_t op_kind_count = 5;
+
+const char *op_kind_name(const OpKind kind) {
+    static const char *names[op_kind_count] = { "read", "update", "insert", "scan", "rmw" };
+    return names[size_t(kind)];
+}
+
+// shares of operations, they don't have to sum up to one
+using Mix = std::array<double, op_kind_count>;
+
+struct Workload {
+    Mix mix;
+    std::string access;
+};
+
+// core workloads of ycsb. there is no ordered iteration here, so a scan reads
+// `scan_length` records with consecutive numbers one by one
+const std::map<std::string, Workload> &workloads() {
+    static const std::map<std::string, Workload> all = {
+        { "a", { {{ 0.50, 0.50, 0.00, 0.00, 0.00 }}, "zipf" } },   // update heavy
+        { "b", { {{ 0.95, 0.05, 0.00, 0.00, 0.00 }}, "zipf" } },   // read mostly
+        { "c", { {{ 1.00, 0.00, 0.00, 0.00, 0.00 }}, "zipf" } },   // read only
+        { "d", { {{ 0.95, 0.00, 0.05, 0.00, 0.00 }}, "latest" } }, // read latest
+        { "e", { {{ 0.00, 0.00, 0.05, 0.95, 0.00 }}, "zipf" } },   // short ranges
+        { "f", { {{ 0.50, 0.00, 0.00, 0.00, 0.50 }}, "zipf" } },   // read-modify-write
+    };
+    return all;
+}
+
+struct Options {
+    std::string workload = "a";
+    Mix mix{};
+    std::array<bool, op_kind_count> mix_set{};
+    std::string access;
+    uint64_t records = 100000;
+    uint64_t ops = 1000000;   // 0 means no limit
+    double duration = 0;      // seconds, 0 means no limit
+    unsigned threads = 4;
+    double interval = 1;
+    bench::SizeRange scan_length{ 1, 100 };
+    bench::SizeRange key_size{ 16, 16 };
+    bench::SizeRange value_size{ 100, 100 };
+    uint64_t page_length = 16;
+    size_t value_cache = 0;   // bytes
+    std::string dir;
+    uint64_t seed = 42;
+};
+
+// page length is a template parameter, so only some of them are here
+const uint64_t page_lengths[] = { 4, 10, 16, 64, 100 };
+
+void print_usage(std::ostream &out) {
+    out << "usage: ycsb [options]\n"
+        << "  --workload W        a | b | c | d | e | f, see ycsb core workloads (a)\n"
+        << "  --read R            share of reads, overrides the workload one\n"
+        << "  --update R          ...of updates\n"
+        << "  --insert R          ...of inserts\n"
+        << "  --scan R            ...of scans\n"
+        << "  --rmw R             ...of read-modify-writes\n"
+        << "  --access P          uniform | zipf[:theta] | latest[:theta] |\n"
+        << "                      hotspot[:hot_fraction[:hot_ops]] (the workload one)\n"
+        << "  --records N         records loaded before the run (100000)\n"
+        << "  --ops N             operations of all threads together, 0 for no limit (1000000)\n"
+        << "  --duration S        seconds to run, 0 for no limit (0)\n"
+        << "  --threads N         client threads (4)\n"
+        << "  --interval S        seconds between progress reports (1)\n"
+        << "  --scan-length A[:B] records per scan (1:100)\n"
+        << "  --key-size A[:B]    key length, at least 7 (16)\n"
+        << "  --value-size A[:B]  value length (100)\n"
+        << "  --page-length L     one of 4, 10, 16, 64, 100 (16)\n"
+        << "  --value-cache B     bytes of values of popular keys kept in memory (0)\n"
+        << "  --dir D             where to create the table (system temp directory)\n"
+        << "  --seed S            seed of all generators (42)\n";
+}
+
+Options parse_options(int argc, char **argv) {
+    Options opts;
+    auto share = [&](OpKind kind) {
+        return [&opts, kind](const std::string &v) {
+            opts.mix[size_t(kind)] = std::stod(v);
+            opts.mix_set[size_t(kind)] = true;
+        };
+    };
+    bench::setters_t setters = {
+        { "--workload", [&](const std::string &v) {
+            if (!workloads().count(v)) { throw bench::BadOption("--workload " + v); }
+            opts.workload = v; } },
+        { "--read", share(OpKind::read) },
+        { "--update", share(OpKind::update) },
+        { "--insert", share(OpKind::insert) },
+        { "--scan", share(OpKind::scan) },
+        { "--rmw", share(OpKind::rmw) },
+        { "--access", [&](const std::string &v) { bench::AccessPattern::parse(v); opts.access = v; } },
+        { "--records", [&](const std::string &v) { opts.records = std::stoull(v); } },
+        { "--ops", [&](const std::string &v) { opts.ops = std::stoull(v); } },
+        { "--duration", [&](const std::string &v) { opts.duration = std::stod(v); } },
+        { "--threads", [&](const std::string &v) { opts.threads = unsigned(std::stoul(v)); } },
+        { "--interval", [&](const std::string &v) { opts.interval = std::stod(v); } },
+        { "--scan-length", [&](const std::string &v) { opts.scan_length = bench::SizeRange::parse(v); } },
+        { "--key-size", [&](const std::string &v) { opts.key_size = bench::SizeRange::parse(v); } },
+        { "--value-size", [&](const std::string &v) { opts.value_size = bench::SizeRange::parse(v); } },
+        { "--page-length", [&](const std::string &v) { opts.page_length = std::stoull(v); } },
+        { "--value-cache", [&](const std::string &v) { opts.value_cache = std::stoull(v); } },
+        { "--dir", [&](const std::string &v) { opts.dir = v; } },
+        { "--seed", [&](const std::string &v) { opts.seed = std::stoull(v); } },
+    };
+
+    bench::parse_options(argc, argv, setters, {}, print_usage);
+
+    auto &workload = workloads().at(opts.workload);
+    for (size_t i = 0; i < op_kind_count; ++i) {
+        if (!opts.mix_set[i]) { opts.mix[i] = workload.mix[i]; }
+        if (opts.mix[i] < 0) { throw bench::BadOption("shares of operations can't be negative"); }
+    }
+    if (opts.access.empty()) { opts.access = workload.access; }
+
+    if (std::all_of(opts.mix.begin(), opts.mix.end(), [](double share) { return share == 0; })) {
+        throw bench::BadOption("there are no operations in the mix");
+    }
+    if (opts.ops == 0 && opts.duration <= 0) { throw bench::BadOption("either --ops or --duration is needed"); }
+    if (opts.records == 0 || opts.threads == 0) { throw bench::BadOption("--records and --threads must be positive"); }
+    if (opts.interval <= 0) { throw bench::BadOption("--interval must be positive"); }
+    if (opts.scan_length.min == 0) { throw bench::BadOption("--scan-length must be positive"); }
+    if (std::find(std::begin(page_lengths), std::end(page_lengths), opts.page_length) == std::end(page_lengths)) {
+        throw bench::BadOption("--page-length " + std::to_string(opts.page_length));
+    }
+    if (opts.dir.empty()) { opts.dir = bench::fs::temp_directory_path().string(); }
+    return opts;
+}
+
+using Histograms = std::array<fcl::LatencyHistogram, op_kind_count>;
+
+// what one client thread has measured. reporter takes `interval` away every interval
+struct ClientStats {
+    std::mutex mutex;
+    Histograms interval;
+    Histograms total;
+    uint64_t read_misses = 0;
+
+    void record(OpKind kind, bench::bench_clock_t::duration elapsed) {
+        auto ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        std::lock_guard<std::mutex> lock(mutex);
+        interval[size_t(kind)].record(ns);
+        total[size_t(kind)].record(ns);
+    }
+};
+
+double us(double ns) {
+    return ns / 1000.0;
+}
+
+void print_interval(std::ostream &out, double since_start, double seconds, const Histograms &histograms) {
+    uint64_t ops = 0;
+    for (auto &histogram : histograms) { ops += histogram.count(); }
+    out << std::fixed << std::setprecision(1) << std::setw(8) << since_start << " s"
+        << std::setprecision(0) << std::setw(12) << double(ops) / seconds << " ops/s";
+    out << std::setprecision(1);
+    for (size_t i = 0; i < op_kind_count; ++i) {
+        auto &histogram = histograms[i];
+        if (histogram.count() == 0) { continue; }
+        out << "  " << op_kind_name(OpKind(i))
+            << " p50 " << us(double(histogram.percentile(0.5)))
+            << " p99 " << us(double(histogram.percentile(0.99))) << " us";
+    }
+    out << std::endl;
+}
+
+void print_totals(std::ostream &out, double seconds, const Histograms &histograms) {
+    out << std::left << std::setw(8) << "op" << std::right
+        << std::setw(12) << "count" << std::setw(12) << "ops/s" << std::setw(12) << "mean us"
+        << std::setw(12) << "p50 us" << std::setw(12) << "p99 us" << std::setw(12) << "p999 us"
+        << std::setw(12) << "max us" << std::endl;
+    out << std::fixed;
+    for (size_t i = 0; i < op_kind_count; ++i) {
+        auto &histogram = histograms[i];
+        if (histogram.count() == 0) { continue; }
+        out << std::left << std::setw(8) << op_kind_name(OpKind(i)) << std::right
+            << std::setprecision(0)
+            << std::setw(12) << double(histogram.count())
+            << std::setw(12) << double(histogram.count()) / seconds
+            << std::setprecision(2)
+            << std::setw(12) << us(histogram.mean())
+            << std::setw(12) << us(double(histogram.percentile(0.5)))
+            << std::setw(12) << us(double(histogram.percentile(0.99)))
+            << std::setw(12) << us(double(histogram.percentile(0.999)))
+            << std::setw(12) << us(double(histogram.max())) << std::endl;
+    }
+}
+
+template <uint64_t PageLength>
+void run(const Options &opts) {
+    using table_t = HashedFile<std::string, std::string, PageLength>;
+    using bench::bench_clock_t;
+
+    auto dir = bench::make_run_dir(opts.dir);
+    auto cleanup = wheels::finally([&] { bench::fs::remove_all(dir); });
+    // one lock for the whole table: HashedFile itself isn't thread-safe
+    wheels::locker_box<table_t> box(dir, true);
+
+    // keys are numbered, number of a key defines it completely
+    bench::KeyGenerator keys(uint64_t(1) << 40, opts.key_size, opts.seed);
+
+    auto load_start = bench_clock_t::now();
+    {
+        bench::rng_t rng(opts.seed);
+        for (auto &&table : box.open()) {
+            for (uint64_t i = 0; i < opts.records; ++i) {
+                table.insert(keys(i), bench::random_string(rng, opts.value_size(rng)));
+            }
+            table.set_cache_capacity(opts.value_cache);
+        }
+    }
+    auto load_seconds = std::chrono::duration<double>(bench_clock_t::now() - load_start).count();
+    std::cout << "loaded " << opts.records << " records in " << std::setprecision(3)
+              << load_seconds << " s" << std::endl;
+
+    std::atomic<uint64_t> issued{ 0 };
+    std::atomic<uint64_t> next_key{ opts.records };
+    std::atomic<uint64_t> inserted{ opts.records };
+    std::atomic<bool> stop{ false };
+    std::atomic<unsigned> running{ opts.threads };
+
+    std::vector<std::unique_ptr<ClientStats>> stats;
+    for (unsigned i = 0; i < opts.threads; ++i) { stats.emplace_back(new ClientStats()); }
+
+    auto client_body = [&](unsigned id) {
+        bench::rng_t rng(opts.seed + 1 + id);
+        auto access = bench::AccessPattern::parse(opts.access);
+        access.prepare(opts.records);
+        std::discrete_distribution<size_t> choose_op(opts.mix.begin(), opts.mix.end());
+        auto &my_stats = *stats[id];
+
+        // popular records move with inserts only for `latest`, others stay among loaded ones
+        auto pick = [&]() {
+            auto item = access(rng);
+            if (opts.access.compare(0, 6, "latest") == 0) { item += inserted.load() - opts.records; }
+            return item;
+        };
+
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (opts.ops != 0 && issued.fetch_add(1) >= opts.ops) { break; }
+            auto kind = OpKind(choose_op(rng));
+            // everything random is prepared before the clock starts
+            std::string key, value;
+            uint64_t scan_first = 0, scan_length = 0;
+            switch (kind) {
+            case OpKind::read: key = keys(pick()); break;
+            case OpKind::update:
+            case OpKind::rmw:
+                key = keys(pick());
+                value = bench::random_string(rng, opts.value_size(rng));
+                break;
+            case OpKind::insert:
+                key = keys(next_key++);
+                value = bench::random_string(rng, opts.value_size(rng));
+                break;
+            case OpKind::scan:
+                scan_first = pick();
+                scan_length = opts.scan_length(rng);
+                break;
+            }
+
+            bool missed = false;
+            auto start = bench_clock_t::now();
+            for (auto &&table : box.open()) {
+                switch (kind) {
+                case OpKind::read: missed = !table.get(key); break;
+                case OpKind::update: table.update(key, value); break;
+                case OpKind::insert: table.insert(key, value); break;
+                case OpKind::scan:
+                    for (uint64_t i = 0; i < scan_length; ++i) { table.get(keys(scan_first + i)); }
+                    break;
+                case OpKind::rmw:
+                    // upsert reads the old value anyway, so it's a real read-modify-write
+                    table.upsert(key, [&](const boost::optional<std::string> &) { return value; });
+                    break;
+                }
+            }
+            my_stats.record(kind, bench_clock_t::now() - start);
+            if (kind == OpKind::insert) { inserted++; }
+            if (missed) {
+                std::lock_guard<std::mutex> lock(my_stats.mutex);
+                my_stats.read_misses++;
+            }
+        }
+    };
+
+    std::vector<std::exception_ptr> errors(opts.threads);
+    auto client = [&](unsigned id) {
+        auto finish = wheels::finally([&] { running--; });
+        try {
+            client_body(id);
+        }
+        catch (...) {
+            errors[id] = std::current_exception();
+            stop = true;
+        }
+    };
+
+    std::cout << "running " << opts.threads << " threads, mix read/update/insert/scan/rmw "
+              << opts.mix[0] << "/" << opts.mix[1] << "/" << opts.mix[2] << "/" << opts.mix[3]
+              << "/" << opts.mix[4] << ", access " << bench::AccessPattern::parse(opts.access).name()
+              << std::endl;
+
+    auto run_start = bench_clock_t::now();
+    std::vector<std::thread> clients;
+    for (unsigned i = 0; i < opts.threads; ++i) { clients.emplace_back(client, i); }
+
+    // progress reports, until all clients have finished (or time is over)
+    auto interval = std::chrono::duration_cast<bench_clock_t::duration>(
+        std::chrono::duration<double>(opts.interval)
+    );
+    auto last_report = run_start;
+    while (running.load() != 0) {
+        auto next_report = last_report + interval;
+        while (running.load() != 0 && bench_clock_t::now() < next_report) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        auto now = bench_clock_t::now();
+        if (opts.duration > 0 && now - run_start >= std::chrono::duration<double>(opts.duration)) {
+            stop = true;
+        }
+
+        Histograms merged;
+        for (auto &client_stats : stats) {
+            std::lock_guard<std::mutex> lock(client_stats->mutex);
+            for (size_t i = 0; i < op_kind_count; ++i) {
+                merged[i].merge(client_stats->interval[i]);
+                client_stats->interval[i].reset();
+            }
+        }
+        print_interval(
+            std::cout,
+            std::chrono::duration<double>(now - run_start).count(),
+            std::chrono::duration<double>(now - last_report).count(),
+            merged
+        );
+        last_report = now;
+    }
+    for (auto &thread : clients) { thread.join(); }
+    for (auto &error : errors) {
+        if (error) { std::rethrow_exception(error); }
+    }
+    auto run_seconds = std::chrono::duration<double>(bench_clock_t::now() - run_start).count();
+
+    Histograms totals;
+    uint64_t read_misses = 0;
+    for (auto &client_stats : stats) {
+        for (size_t i = 0; i < op_kind_count; ++i) { totals[i].merge(client_stats->total[i]); }
+        read_misses += client_stats->read_misses;
+    }
+    std::cout << "done in " << std::setprecision(3) << run_seconds << " s, "
+              << read_misses << " reads missed" << std::endl;
+    print_totals(std::cout, run_seconds, totals);
+    for (auto &&table : box.open()) {
+        if (!table.cache().enabled()) { break; }
+        auto &cache = table.cache().counters();
+        std::cout << "value cache: " << std::setprecision(1) << 100 * cache.hit_rate() << "% hits, "
+                  << table.cache().size() << " values, " << cache.evicted << " evicted, "
+                  << cache.rejected << " rejected, " << cache.invalidated << " invalidated" << std::endl;
+    }
+}
+
+void run_with_page_length(const Options &opts) {
+    switch (opts.page_length) {
+    case 4: return run<4>(opts);
+    case 10: return run<10>(opts);
+    case 16: return run<16>(opts);
+    case 64: return run<64>(opts);
+    case 100: return run<100>(opts);
+    }
+    throw bench::BadOption("--page-length " + std::to_string(opts.page_length));
+}
+
+int main(int argc, char **argv) {
+    try {
+        run_with_page_length(parse_options(argc, argv));
+    }
+    catch (const bench::BadOption &err) {
+        std::cerr << err.what() << std::endl;
+        print_usage(std::cerr);
+        return 1;
+    }
+    catch (const std::exception &err) {
+        std::cerr << "Exception: " << err.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
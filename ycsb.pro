@@ -0,0 +1,26 @@
+TEMPLATE = app
+TARGET = ycsb
+CONFIG += console c++11 thread
+CONFIG -= app_bundle
+CONFIG -= qt
+
+QMAKE_CXXFLAGS_RELEASE *= -O3
+
+SOURCES += ycsb.cpp
+
+HEADERS += \
+    bench_utils.hpp \
+    binschema.hpp \
+    binstreamwrap.hpp \
+    binstreamwrapfwd.hpp \
+    crc32c.hpp \
+    fdstream.hpp \
+    hash_file_storage.hpp \
+    latency_histogram.hpp \
+    stable_hash.hpp \
+    trace.hpp \
+    value_cache.hpp
+
+LIBPATH += /usr/local/lib/
+LIBS += $${LIBPATH}libboost_system.a \
+    $${LIBPATH}libboost_filesystem.a